@@ -58,7 +58,7 @@
  * 					remaining space as a write buffer, as described in the Pea Hash paper;
  * 			 3. Our hash table now uses only 32-bit hash, which means it supports at most
  * 					65,536 buckets. We can consider using larger hash and extend the hash table
- * 					to more buckets.
+ * 					to more buckets. (Edit: DONE, each half of the 64-bit hash indexes a bucket)
  */
 #pragma once
 
@@ -68,6 +68,7 @@
 
 #include <iostream>
 #include <limits>
+#include <stdexcept>
 
 #include <cassert>
 #include <cstring>
@@ -102,7 +103,7 @@ static uint64_t major_overflows{0};
 
 #define BYTE_ROUND_UP(n) (((n) + 7) / 8)
 #define ROUND_UP(n, b) (((n) + (b) - 1) / (b))
-#define ROUNDUP_POWER_2(n) ((n) == 0 ? 1 : (((n) & ((n) - 1)) == 0) ? (n) : (1 << (64 -__builtin_clzll(n))))
+#define ROUNDUP_POWER_2(n) ((n) == 0 ? 1 : (((n) & ((n) - 1)) == 0) ? (n) : (1ull << (64 -__builtin_clzll(n))))
 
 #define GET_BIT(bits, n)   (bits & (1ull << (n)))
 #define SET_BIT(bits, n)   (bits |= (1ull << (n)))
@@ -151,10 +152,7 @@ class DleftFpStash {
 	DleftFpStash(size_t size = 0)
 			: num_buckets_(ROUNDUP_POWER_2(size / Bucket::bucket_capacity)),
 				num_stash_buckets_(num_buckets_ / BUCKET_STASH_BUCKET_RATIO) {
-		if (num_buckets_ > (1 << 16)) {
-			printf("error: table is too large\n");
-			exit(1);
-		}
+		CheckNumBuckets(num_buckets_);
 
 		buckets = buckets_ = new Bucket[num_buckets_];
 		assert(buckets_ != nullptr);
@@ -683,7 +681,7 @@ class DleftFpStash {
 			}
 
 			size_t stash_idx = (idx / BUCKET_STASH_BUCKET_RATIO) & (num_stash_buckets_ - 1);
-			uint8_t min_stash_num;
+			uint8_t min_stash_num = 0;
 			pos_t min_stash_size = 0xff;
 			bucket->stash_stride_ = GetStride(idx);
 			for (uint8_t stash_num = 0; stash_num < 16; stash_num++) {  // Bind bucket to its most underfull candidate stash bucket
@@ -727,9 +725,9 @@ class DleftFpStash {
 		for (int i = 0; i < Bucket::bucket_capacity; i++) {
 			hash_t hash = H()(bucket->tuples_[i].key);
 			idx_t alt_idx = IDX1(hash) & (num_buckets_ - 1);
-			uint8_t alt_fp = FP(IDX2(hash));
+			ofp_t alt_fp = OFP(IDX2(hash) & (num_buckets_ - 1));  // A key's fingerprint is its other bucket index
 			if (alt_idx == idx) {
-				alt_fp = FP(alt_idx);
+				alt_fp = OFP(alt_idx);
 				alt_idx = IDX2(hash) & (num_buckets_ - 1);
 				if (UNLIKELY( alt_idx == idx )) {
 					continue;
@@ -739,7 +737,7 @@ class DleftFpStash {
 			if (alt_bucket->GetSize() == Bucket::bucket_capacity) {
 				continue;
 			}  // `alt_bucket` has free space, so move the key there
-			alt_bucket->Append(std::move(bucket->tuples_[i].key), std::move(bucket->tuples_[i].value), hash, nullptr);
+			alt_bucket->Append(std::move(bucket->tuples_[i].key), std::move(bucket->tuples_[i].value), alt_fp, nullptr);
 			return static_cast<uint8_t>(i);
 		}
 		return StashBucket::invalid_pos;
@@ -785,12 +783,14 @@ class DleftFpStash {
 		// Insertion failed; do one move on both buckets
 		pos_t pos;
 		if ((pos = OneMove(idx1)) != StashBucket::invalid_pos) {
-			buckets_[idx1].InsertAt(std::forward<K>(key), std::forward<V>(key), pos, OFP(idx2));
+			buckets_[idx1].InsertAt(std::forward<K>(key), std::forward<V>(value), pos, OFP(idx2));
 		} else if ((pos = OneMove(idx2)) != StashBucket::invalid_pos) {
-			buckets_[idx2].InsertAt(std::forward<K>(key), std::forward<V>(key), pos, OFP(idx1));
+			buckets_[idx2].InsertAt(std::forward<K>(key), std::forward<V>(value), pos, OFP(idx1));
+		} else {
+			return false;
 		}
-
-		return false;
+		size_++;
+		return true;
 	}
 
 	// Removes a key from the hash table
@@ -852,16 +852,14 @@ class DleftFpStash {
 		idx_t old_num_stash_buckets = num_stash_buckets_;
 		Bucket *old_buckets = buckets_;
 		StashBucket *old_stash_buckets = stash_buckets_;
+		size_t old_size = size_;  // `Append` counts the rehashed keys again, so the size is restored afterwards
 		size_t new_capacity = ROUNDUP_POWER_2(new_size / Bucket::bucket_capacity);
 
 		if (num_buckets_ == new_capacity) {
 			return true;
 		}
 
-		if (new_capacity > std::numeric_limits<idx_t>::max()) {
-			printf("error: table is too large\n");
-			exit(1);
-		}
+		CheckNumBuckets(new_capacity);
 		num_buckets_ = new_capacity;
 		num_stash_buckets_ = num_buckets_ / BUCKET_STASH_BUCKET_RATIO;
 		buckets_ = new Bucket[num_buckets_];
@@ -895,19 +893,21 @@ class DleftFpStash {
 			}
 		}
 
-		delete old_buckets;
-		delete old_stash_buckets;
-		
+		delete[] old_buckets;
+		delete[] old_stash_buckets;
+		size_ = old_size;
+
 		return true;
 
 	 resize_failed:  // If any insertion fails, resize fails
-		delete buckets_;
-		delete stash_buckets_;
+		delete[] buckets_;
+		delete[] stash_buckets_;
 
 		num_buckets_ = old_num_buckets;
 		num_stash_buckets_ = old_num_stash_buckets;
 		buckets_ = old_buckets;
 		stash_buckets_ = old_stash_buckets;
+		size_ = old_size;
 
 		return false;
 	}
@@ -916,7 +916,14 @@ class DleftFpStash {
 
 	auto StashBucketCapacity() const -> size_t { return StashBucket::bucket_capacity * num_stash_buckets_; }
 
-	static auto GetStride(uint16_t idx) -> idx_t {
+	// Throws if a table of `num_buckets` buckets cannot be indexed by `idx_t`
+	static void CheckNumBuckets(size_t num_buckets) {
+		if (num_buckets > std::numeric_limits<idx_t>::max()) {
+			throw std::length_error("DleftFpStash: table is too large");
+		}
+	}
+
+	static auto GetStride(idx_t idx) -> idx_t {
 		hash_t hash = H()(idx);
 		return IDX1(hash) ^ IDX2(hash);
 		// return idx * idx + 7 * idx + 457;
@@ -994,6 +1001,7 @@ class DleftTest {
     TestDleftFind();
     TestDleftInsert();
     TestDleftResize();
+    TestDleftLargeTable();
 
 		TestDleftFalsePositives();
 		TestDleftMaxLoadFactor();
@@ -1527,6 +1535,36 @@ class DleftTest {
       assert(value == i);
     }
 
+    printf("[PASSED]\n");
+  }
+
+  static void TestDleftLargeTable() {
+    printf("[TEST DLEFT LARGE TABLE]\n");
+
+    const int testcase_size = 6000000;
+    DleftType hash_table(1 << 23);  // 2^19 buckets and 2^9 stash buckets
+    assert(hash_table.num_buckets_ > (1 << 16));
+
+    for (int i = 0; i < testcase_size; i++) {
+      assert(hash_table.insert(i, i));
+    }
+    assert(hash_table.size() == testcase_size);
+
+    size_t used_high_buckets = 0;  // Buckets past the old 65,536-bucket limit must be used too
+    for (size_t i = 1 << 16; i < hash_table.num_buckets_; i++) {
+      used_high_buckets += hash_table.buckets_[i].GetSize() > 0;
+    }
+    assert(used_high_buckets > (hash_table.num_buckets_ - (1 << 16)) / 2);
+
+    for (int i = 0; i < testcase_size; i += 2) {
+      assert(hash_table.erase(i));
+    }
+    for (int i = 0; i < testcase_size; i++) {
+      uint32_t value = 0;
+      assert(hash_table.find(i, value) == (i % 2 == 1));
+      assert(i % 2 == 0 || value == i);
+    }
+
     printf("[PASSED]\n");
   }
 
@@ -50,27 +50,52 @@
  * bucket to handle them, so that they can still be retrieved in reasonable time.
  * 
  * Finally, we neeed to determine the (# of buckets) to (# of stash buckets) ratio. Since
- * there are about 2% overflow keys in our experiments, we use 256 : 1. This also keeps
- * these two numbers powers of 2, allowing for quick modulo operations.
+ * there are about 2% overflow keys in our experiments, we use 1024 : 1 by default. This also
+ * keeps these two numbers powers of 2, allowing for quick modulo operations. This ratio and
+ * the sizes of buckets and stash buckets can be changed per table (see `DleftPolicy`).
  * 
  * TODO: 1. The "one move" strategy in George Varghese's paper can be applied; (Edit: DONE)
  * 			 2. Since the bucket header size is less than one cacheline size, we can use the
- * 					remaining space as a write buffer, as described in the Pea Hash paper;
+ * 					remaining space as a write buffer, as described in the Pea Hash paper; (Edit: DONE)
  * 			 3. Our hash table now uses only 32-bit hash, which means it supports at most
  * 					65,536 buckets. We can consider using larger hash and extend the hash table
- * 					to more buckets.
+ * 					to more buckets. (Edit: DONE, bucket indexes borrow fingerprint bits past 65,536
+ * 					buckets)
  */
 #pragma once
 
 #include <stdint.h>
 
+#include <fcntl.h>
 #include <immintrin.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include <cassert>
+#include <cstddef>
+#include <cstdio>
 #include <cstring>
 
+#include "../HashBrown-hashfunc/hashbrown.h"
+
 #define __TEST_DLEFT__
 #define __HASH_TABLE_TEST__
 // #define __DEBUG_DLEFT__
@@ -81,27 +106,15 @@
 # define DEBUG_DLEFT(foo)
 #endif
 
-#define __COUNT_FALSE_POSITIVES__
-#define __COUNT_OVERFLOWS__
-
-#ifdef __COUNT_FALSE_POSITIVES__
-static uint64_t false_positive{0};
-#endif
-
-#ifdef __COUNT_OVERFLOWS__
-static uint64_t minor_overflows{0};
-static uint64_t major_overflows{0};
-#endif
-
 #define CACHELINE_SIZE (64)
 
-#define BUCKET_STASH_BUCKET_RATIO (1024)
+#define HUGE_PAGE_SIZE (2ull << 20)
 
 #define MAX_LOAD_FACTOR_100 (95)
 
 #define BYTE_ROUND_UP(n) (((n) + 7) / 8)
 #define ROUND_UP(n, b) (((n) + (b) - 1) / (b))
-#define ROUNDUP_POWER_2(n) ((n) == 0 ? 1 : (((n) & ((n) - 1)) == 0) ? (n) : (1 << (64 -__builtin_clzll(n))))
+#define ROUNDUP_POWER_2(n) ((n) == 0 ? 1 : (((n) & ((n) - 1)) == 0) ? (n) : (1ull << (64 -__builtin_clzll(n))))
 
 #define GET_BIT(bits, n)   (bits & (1ull << (n)))
 #define SET_BIT(bits, n)   (bits |= (1ull << (n)))
@@ -113,11 +126,12 @@ static uint64_t major_overflows{0};
 
 #define FINGERPRINT8(hash)  (static_cast<uint8_t>(hash))
 #define FINGERPRINT16(hash) (static_cast<uint16_t>(hash))
-#define BUCKET_IDX(hash)  ((hash) >> 16)
 
 #define LIKELY(foo)   foo
 #define UNLIKELY(foo) foo
 
+#define PREFETCH(addr) _mm_prefetch(reinterpret_cast<const char *>(addr), _MM_HINT_T0)
+
 #define SEARCH_8_128(val, src, mask) \
 	do { \
 		__m128i val_vec = _mm_set1_epi8(static_cast<uint8_t>(val)); \
@@ -134,40 +148,364 @@ static uint64_t major_overflows{0};
 		mask = _mm_movemask_epi8(result); \
 	} while (0)
 
+#define TARGET_AVX2   __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+
+// Kernels that probe both candidate buckets of a key; the widest one that the CPU supports is picked at startup
+enum class ProbeKernel : uint8_t { SSE2, AVX2, AVX512 };
+
+static inline auto DetectProbeKernel() -> ProbeKernel {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+		return ProbeKernel::AVX512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return ProbeKernel::AVX2;
+	}
+	return ProbeKernel::SSE2;
+}
+
+// Allocation policies for the bucket arrays: an allocator hands out raw memory aligned to at least a
+// cacheline (so that no bucket header straddles two cachelines), and is given back its size when freed
+struct AlignedAllocator {
+	static auto Allocate(size_t size) -> void * { return ::operator new(size, std::align_val_t(CACHELINE_SIZE)); }
+
+	static void Deallocate(void *ptr, size_t) { ::operator delete(ptr, std::align_val_t(CACHELINE_SIZE)); }
+};
+
+// Backs arrays of at least a huge page with transparent huge pages, so that random probes into a large
+// table rarely miss the TLB; `populate` faults the whole array in at once, rather than page by page
+template <size_t page_size = HUGE_PAGE_SIZE, bool populate = false>
+struct HugePageAllocator {
+	static auto Allocate(size_t size) -> void * {
+		if (size < page_size) {
+			return AlignedAllocator::Allocate(size);
+		}
+		size = ROUND_UP(size, page_size) * page_size;
+
+		// Over-allocate, so that the array can start at a huge page boundary, and unmap the rest
+		char *addr = static_cast<char *>(mmap(nullptr, size + page_size, PROT_READ | PROT_WRITE,
+																					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if (addr == MAP_FAILED) {
+			throw std::bad_alloc();
+		}
+		char *aligned = reinterpret_cast<char *>(ROUND_UP(reinterpret_cast<uintptr_t>(addr), page_size) * page_size);
+		if (aligned != addr) {
+			munmap(addr, aligned - addr);
+		}
+		if (aligned != addr + page_size) {
+			munmap(aligned + size, addr + page_size - aligned);
+		}
+
+		madvise(aligned, size, MADV_HUGEPAGE);  // Only a hint; without it, the array still works with small pages
+	 #ifdef MADV_POPULATE_WRITE
+		if (populate) {
+			madvise(aligned, size, MADV_POPULATE_WRITE);
+		}
+	 #endif
+		return aligned;
+	}
+
+	static void Deallocate(void *ptr, size_t size) {
+		if (size < page_size) {
+			AlignedAllocator::Deallocate(ptr, size);
+		} else {
+			munmap(ptr, ROUND_UP(size, page_size) * page_size);
+		}
+	}
+};
+
+// Backs arrays of at least a huge page with explicit (2MB or 1GB) hugetlb pages, which have to be reserved
+// beforehand (see /proc/sys/vm/nr_hugepages); falls back to transparent huge pages when none is left
+template <size_t page_size = HUGE_PAGE_SIZE, bool populate = false>
+struct HugeTLBAllocator {
+	static auto Allocate(size_t size) -> void * {
+		if (size < page_size) {
+			return AlignedAllocator::Allocate(size);
+		}
+		size = ROUND_UP(size, page_size) * page_size;
+
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (__builtin_ctzll(page_size) << MAP_HUGE_SHIFT);
+		void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags | (populate ? MAP_POPULATE : 0), -1, 0);
+		if (addr == MAP_FAILED) {
+			return HugePageAllocator<page_size, populate>::Allocate(size);
+		}
+		return addr;
+	}
+
+	static void Deallocate(void *ptr, size_t size) { HugePageAllocator<page_size, populate>::Deallocate(ptr, size); }
+};
+
+// Geometry of a table, passed to `DleftFpStash` as `Policy`; the defaults are the geometry described above.
+// Smaller buckets and stash buckets take fewer cachelines per lookup, but overflow sooner, and fewer stash
+// buckets per bucket save memory, but make the table grow sooner (`policy_tuning.cpp` measures the tradeoff).
+// The 8-bit and 16-bit fingerprints are not part of it: the probe kernels compare whole bucket headers, whose
+// layout stays fixed, so buckets and minor overflows can only get fewer slots than the header has room for.
+// `bucket_capacity`: slots per bucket, at most 16 (one fingerprint byte each in the 16-byte fingerprint array)
+// `max_minor_overflows`: overflows of a bucket tracked in its header, at most 4
+// `stash_bucket_capacity`: slots per stash bucket, at most 255 (positions are bytes, and 0xff is invalid)
+// `stash_ratio`: buckets per stash bucket, a power of 2
+// `slab_values`: slots hold a 32-bit handle to the value instead of the value, which lives in a slab of
+// fixed-size blocks; for large values, so that buckets stay a few cachelines long, at the cost of one more cache
+// miss per lookup that finds its key (and none for those that do not)
+// `soa_buckets`: a bucket keeps its keys in one array and their values in another, instead of pairs, so that keys
+// compared on fingerprint matches, most of which are false positives in negative lookups, sit in as few cachelines
+// as possible (one for 16 4-byte keys) and values are only touched when a key is found; stash buckets keep pairs
+// `compare_keys`: lookups compare the key with all keys of a bucket at once with vector compares, rather than
+// its fingerprint with theirs and then the key with those that match; for 4-byte and 8-byte integral keys in
+// `soa_buckets`, where a bucket's keys take as many bytes as 2 (or 4) AVX2 vectors, and as fingerprints filter
+// keys no faster than the keys themselves; overflows are still found through their 16-bit fingerprints
+// `aligned_buckets`: buckets and stash buckets start on a cacheline, padded to whole cachelines if need be, so that
+// probing a bucket takes exactly `sizeof(Bucket) / 64` cacheline fetches rather than one more when it straddles a
+// boundary; see `OneCachelineDleftPolicy` and `TwoCachelineDleftPolicy` for buckets that need no padding
+// `num_choices`: candidate buckets per key, 2 to 4; the third and fourth come from the first two by double hashing,
+// so they cost no more hash function calls. Keys go to the least loaded candidate, which evens out buckets so
+// that fewer keys overflow at the same load, at the cost of more buckets probed by lookups that miss in the first
+// two (all of them for negative lookups). Partial-key mode has exactly two, as its relocation is an involution.
+// `max_moves`: longest chain of moves, 1 to 8, that an insertion searches for once its candidate buckets and their
+// stash buckets are full, each move taking a key to another of its candidate buckets, until one has a free slot;
+// with 1, only keys of the candidate buckets move, as in cuckoo hashing with a single kick. Longer chains let
+// tables with a few hot buckets fill up further before they double, at the cost of a breadth-first search over
+// up to 256 buckets (hashing their keys) when insertions would fail otherwise.
+template <int bucket_capacity_ = 16, int max_minor_overflows_ = 4, int stash_bucket_capacity_ = 255,
+					size_t stash_ratio_ = 1024, bool slab_values_ = false, bool soa_buckets_ = false,
+					bool compare_keys_ = false, bool aligned_buckets_ = false, int num_choices_ = 2, int max_moves_ = 1>
+struct DleftPolicy {
+	static constexpr int bucket_capacity = bucket_capacity_;
+	static constexpr int max_minor_overflows = max_minor_overflows_;
+	static constexpr int stash_bucket_capacity = stash_bucket_capacity_;
+	static constexpr size_t stash_ratio = stash_ratio_;
+	static constexpr bool slab_values = slab_values_;
+	static constexpr bool soa_buckets = soa_buckets_;
+	static constexpr bool compare_keys = compare_keys_;
+	static constexpr bool aligned_buckets = aligned_buckets_;
+	static constexpr int num_choices = num_choices_;
+	static constexpr int max_moves = max_moves_;
+
+	static_assert(bucket_capacity > 0 && bucket_capacity <= 16, "a bucket has at most 16 slots");
+	static_assert(max_minor_overflows > 0 && max_minor_overflows <= 4, "a bucket header tracks at most 4 overflows");
+	static_assert(stash_bucket_capacity > 0 && stash_bucket_capacity <= 255, "a stash bucket has at most 255 slots");
+	static_assert(stash_ratio > 0 && (stash_ratio & (stash_ratio - 1)) == 0, "the stash ratio must be a power of 2");
+	static_assert(num_choices >= 2 && num_choices <= 4, "a key has 2 to 4 candidate buckets");
+	static_assert(max_moves >= 1 && max_moves <= 8, "a chain has 1 to 8 moves");
+};
+
+// Aligned geometries whose buckets of 8-byte pairs (e.g. 4-byte keys and values) fill exactly one or two cachelines,
+// with the 32-byte header followed by 4 or 12 pairs; their stash ratios leave the fewest bytes per key at full load
+using OneCachelineDleftPolicy = DleftPolicy<4, 4, 255, 64, false, false, false, true>;
+using TwoCachelineDleftPolicy = DleftPolicy<12, 4, 255, 128, false, false, false, true>;
+
+// A snapshot of the counters of a table with `with_stats` (see `DleftFpStash::stats`). Counters only grow,
+// so rates, e.g. of overflows per insertion, come from the difference between two snapshots.
+struct DleftStats {
+	uint64_t false_positives{0};     // Keys compared on a fingerprint match, but different from the one looked for
+	uint64_t minor_overflows{0};     // Keys placed in a stash bucket and tracked by their bucket's header
+	uint64_t major_overflows{0};     // Keys placed in a stash bucket once their bucket's minor overflows ran out
+	uint64_t one_move_attempts{0};   // Insertions that found both candidate buckets and their stash buckets full
+	uint64_t one_move_successes{0};  // Those of them that moved a key to its other bucket to make room
+	uint64_t resizes{0};             // Resizes, including incremental migrations started
+	uint64_t resize_ns{0};           // Time spent in resizes (not in the migration steps that follow)
+	size_t bytes_in_use{0};          // As of the snapshot, see `memory_usage`
+
+	// `path_lengths[i]` counts the insertions that made room by a chain of `i` moves, up to the policy's `max_moves`,
+	// and `path_lengths[0]` those that found no chain short enough and failed
+	static constexpr int max_path_length = 8;
+	uint64_t path_lengths[max_path_length + 1]{};
+
+	auto operator+=(const DleftStats &other) -> DleftStats & {
+		false_positives += other.false_positives;
+		minor_overflows += other.minor_overflows;
+		major_overflows += other.major_overflows;
+		one_move_attempts += other.one_move_attempts;
+		one_move_successes += other.one_move_successes;
+		resizes += other.resizes;
+		resize_ns += other.resize_ns;
+		bytes_in_use += other.bytes_in_use;
+		for (int i = 0; i <= max_path_length; i++) {
+			path_lengths[i] += other.path_lengths[i];
+		}
+		return *this;
+	}
+};
+
+// A variable-length key, e.g. a DNS name or a URL; use `KeySpan` as `K` for tables keyed by byte strings.
+// It is only a view of the key's bytes: a table copies the bytes of every key it inserts into its key
+// arena, so the buffer passed in need not outlive the call, and its slots hold the offset and length of
+// the copy in 8 bytes, so slots stay small. Keys are compared only on a fingerprint match, with the
+// lengths compared before the bytes.
+class KeySpan {
+ public:
+	// Longest key a table stores; inserting a longer one throws `std::length_error`
+	static constexpr size_t max_length = 0xffff;
+
+	KeySpan() = default;
+
+	KeySpan(const char *data, size_t length) : data_(data), size_(length) {}
+
+	KeySpan(std::string_view str) : KeySpan(str.data(), str.size()) {}
+
+	auto data() const -> const char * { return data_; }
+
+	auto size() const -> size_t { return size_; }
+
+	auto operator==(const KeySpan &other) const -> bool {
+		return size() == other.size() && (size() == 0 || memcmp(data(), other.data(), size()) == 0);
+	}
+
+ private:
+	const char *data_{nullptr};
+	size_t size_{0};
+};
+
+// Hashes a `KeySpan` with `hashbrown`; use two different seeds for `H1` and `H2`
+template <uint64_t seed>
+struct KeySpanHasher {
+	auto operator()(const KeySpan &key) const -> uint32_t {
+		uint64_t hash = hashbrown(seed, key.size(), const_cast<char *>(key.data()));
+		return static_cast<uint32_t>(hash ^ (hash >> 32));
+	}
+};
+
 static void *buckets;
 static void *stash_buckets;
 
-template <class K, class V, class H1, class H2>
+// `buffered` enables the write buffer, which keeps freshly inserted keys right after the bucket header, in its
+// cacheline when buckets are cacheline-aligned (see `DleftPolicy::aligned_buckets`)
+// `concurrent` makes the table thread-safe: writers lock striped spinlocks, while readers never lock, but
+// validate the version of the locks they depend on and retry if a writer got in the way
+// `incremental` amortizes resizing: instead of rehashing every key at once, the old arrays are kept
+// alongside the new ones, and each insertion or removal migrates one old bucket
+// `partial_key` derives the second hash from the first one and its fingerprint (so `H2` is unused), which
+// lets a key's alternative bucket be computed without rehashing, as in libcuckoo's partial-key hashing
+// `Allocator` allocates the bucket arrays (see `AlignedAllocator`, `HugePageAllocator` and `HugeTLBAllocator`)
+// `Policy` sets the sizes of buckets and stash buckets, and how many of them there are (see `DleftPolicy`)
+// `with_stats` keeps the counters of `stats()`; otherwise, counting compiles to nothing
+// Tables in a single mode are more easily named by the aliases that follow the class, e.g. `ConcurrentDleftFpStash`
+template <class K, class V, class H1, class H2, bool buffered = false, bool concurrent = false,
+					bool incremental = false, bool partial_key = false, class Allocator = AlignedAllocator,
+					class Policy = DleftPolicy<>, bool with_stats = false>
 class DleftFpStash {
  public:
+	using idx_t = uint32_t;
+
+	using policy_type = Policy;
+
   DleftFpStash(size_t = 0);
 
-	~DleftFpStash() { delete[] buckets_; delete[] stash_buckets_; }
+	~DleftFpStash();
 
-	auto insert(K &&key, V &&value) -> bool {
-		uint32_t hash1 = H1()(key), hash2 = H2()(key);
-		InsertStatus status = Insert<false>(std::forward<K>(key), std::forward<V>(value), hash1, hash2);
-		while (status == InsertStatus::FAILED) {
-			Resize(capacity() * 2);
-			status = Insert<false>(std::forward<K>(key), std::forward<V>(value), hash1, hash2);
-		}
-		return status == InsertStatus::INSERTED;
+	// Inserts a key unless it is in the table already; returns whether it was inserted
+	auto insert(K &&key, V &&value) -> bool { return Emplace<false>(std::move(key), std::move(value)); }
+
+	auto insert(const K &key, const V &value) -> bool { return Emplace<false>(K(key), value); }
+
+	// Same as `insert`, but the value is constructed from `args` directly in its slot, and only if the key is not
+	// in the table already (otherwise, neither `key` nor `args` are moved from)
+	template <class... Args>
+	auto try_emplace(K &&key, Args &&...args) -> bool {
+		return Emplace<false>(std::move(key), InPlace<Args...>{std::forward_as_tuple(std::forward<Args>(args)...)});
 	}
 
-	auto erase(const K &key) -> bool { return Erase(key, H1()(key), H2()(key)); }
+	template <class... Args>
+	auto try_emplace(const K &key, Args &&...args) -> bool {
+		return Emplace<false>(K(key), InPlace<Args...>{std::forward_as_tuple(std::forward<Args>(args)...)});
+	}
 
-	auto find(const K &key, V &value) const -> bool { return Find(key, &value, H1()(key), H2()(key)); }
+	// As keys and values are stored apart, there is no pair to construct from `args`; same as `try_emplace`
+	template <class... Args>
+	auto emplace(K &&key, Args &&...args) -> bool { return try_emplace(std::move(key), std::forward<Args>(args)...); }
 
-	void clear() {
-		for (size_t i = 0; i < num_buckets_; i++) {
-			buckets_[i].Clear();
+	template <class... Args>
+	auto emplace(const K &key, Args &&...args) -> bool { return try_emplace(key, std::forward<Args>(args)...); }
+
+	// Inserts a key, or assigns `value` to it if it is in the table already; returns whether it was inserted
+	template <class Value>
+	auto insert_or_assign(K &&key, Value &&value) -> bool {
+		return Emplace<true>(std::move(key), std::forward<Value>(value));
+	}
+
+	template <class Value>
+	auto insert_or_assign(const K &key, Value &&value) -> bool { return Emplace<true>(K(key), std::forward<Value>(value)); }
+
+	auto erase(const K &key) -> bool {
+		uint32_t hash1 = H1()(key), hash2 = Hash2(key, hash1);
+		if (concurrent) {
+			return EraseConcurrent(key, hash1, hash2);
 		}
-		for (size_t i = 0; i < num_stash_buckets_; i++) {
-			stash_buckets_[i].Clear();
+		if (Migrating()) {
+			MigrateKey(hash1, hash2);
+			Migrate(migration_batch_size);
+		}
+		bool erased = Erase(key, hash1, hash2);
+		if (UNLIKELY( size_ < shrink_size_ )) {
+			Shrink();
 		}
+		return erased;
+	}
+
+	auto find(const K &key, V &value) const -> bool {
+		uint32_t hash1 = H1()(key), hash2 = Hash2(key, hash1);
+		return concurrent ? FindConcurrent(key, &value, hash1, hash2) : Find(key, &value, hash1, hash2);
 	}
 
-	void reserve(size_t size) { Resize(size); }
+	// Searches for `n` keys, overlapping the cache misses of different lookups
+	// `found[i]` tells whether `keys[i]` is found; if so, its value is stored in `values[i]`
+	void find_batch(const K *keys, V *values, bool *found, size_t n) const;
+
+	// Calls `fn(key, value)` on every key in the table, in no particular order, scanning the validity bitmaps of
+	// the bucket arrays front to back; `fn` may modify values, but must not insert or remove keys
+	// In concurrent mode, writers wait until it returns, while readers can still read
+	template <class Fn>
+	void for_each(Fn fn);
+
+	// Same as above, but splits the bucket arrays among `num_threads` threads, which call `fn` concurrently
+	template <class Fn>
+	void parallel_for_each(Fn fn, size_t num_threads = std::thread::hardware_concurrency());
+
+	// Walks the keys in the same order as `for_each`, yielding key-value pairs (`it->key` and `it->value`)
+	// Invalidated by any insertion or removal; in concurrent mode, use `for_each` instead, as it does not lock
+	class iterator;
+
+	auto begin() -> iterator;
+
+	auto end() -> iterator;
+
+	void clear() { LockAll(); Clear(); UnlockAll(); }
+
+	// Replaces the contents of the table with `n` key-value pairs, much faster than inserting them one by one: the
+	// table is sized for `n` keys up front, and the keys are hashed and partitioned by bucket, so that each of
+	// `num_threads` threads fills a disjoint range of buckets; only the few keys that overflow both candidate
+	// buckets are inserted serially, as binding stash buckets needs the whole table
+	// Of duplicate keys, the last one wins
+	void build(const K *keys, const V *values, size_t n, size_t num_threads = std::thread::hardware_concurrency());
+
+	void reserve(size_t size) { LockAll(); FinishMigration(); Resize(size, resize_threads_); UnlockAll(); }
+
+	// Moves overflows back into their buckets, or major overflows into minor overflow slots, wherever there is room
+	// Removals do so already for the bucket they remove from, so this only finds work in tables mapped from
+	// snapshots of older builds, or major overflows whose bucket was ambiguous at the time (see `Promote`)
+	// Returns the number of overflows moved
+	auto promote_overflows() -> size_t;
+
+	// Resizes the table to the fewest buckets that hold its keys at a load factor of at most `MAX_LOAD_FACTOR_100`
+	// (or more buckets, if the keys do not fit after all); like any resize, it either succeeds or leaves the table
+	// as it was. In incremental mode, an ongoing migration is finished first
+	void shrink_to_fit();
+
+	// Halves the table whenever a removal brings its load factor below `load_factor`, to give memory back once
+	// traffic drops; 0 (the default) turns this off. As the table then doubles when it fills up, the factor is
+	// capped at a quarter of `MAX_LOAD_FACTOR_100`, so that halving leaves room to grow, and growing to shrink
+	// If a halved table cannot hold the keys, it is left as it was, and halving is tried again at half the size
+	void set_shrink_load_factor(double load_factor) {
+		LockAll();
+		shrink_load_factor_ = std::min(std::max(load_factor, 0.0), MAX_LOAD_FACTOR_100 / 400.0);
+		UpdateShrinkSize();
+		UnlockAll();
+	}
+
+	// Sets how many threads rehash the keys when the table is resized (by `reserve` or when it fills up); a resize
+	// is not worth more than one thread unless the table holds many keys
+	void set_resize_threads(size_t num_threads) { resize_threads_ = std::max<size_t>(num_threads, 1); }
 
 	auto load_factor() const -> double { return 1.0 * size_ / capacity(); }
 
@@ -175,67 +513,320 @@ class DleftFpStash {
 
 	auto size() const -> size_t { return size_; }
 
+	// Bytes taken by the bucket arrays (both the new and the old ones while migrating), the key arena and value slab,
+	// if any, and the memory retired in concurrent mode that readers may still be reading
+	auto memory_usage() const -> size_t {
+		size_t bytes = num_buckets_ * sizeof(Bucket) + num_stash_buckets_ * sizeof(StashBucket);
+		if (Migrating()) {
+			bytes += old_num_buckets_ * sizeof(Bucket) + old_num_stash_buckets_ * sizeof(StashBucket);
+		}
+		if constexpr (var_key) {
+			bytes += arena_.Bytes() + old_arena_.Bytes();
+		}
+		if constexpr (slab_value) {
+			bytes += slab_.Bytes();
+		}
+		if constexpr (concurrent) {
+			bytes += retired_bytes_;
+		}
+		return bytes;
+	}
+
+	// Sums the counters of every thread; only `bytes_in_use` is set without `with_stats`
+	// Safe to call while other threads use the table, in which case the counters may lag a little
+	auto stats() const -> DleftStats;
+
+	// Writes the table into a snapshot file, which `open_mapped` can use as a table later on
+	// Returns `false` if the file cannot be written
+	auto save(const char *path) -> bool;
+
+	// Replaces the contents of the table with a snapshot written by `save`; the file is mapped copy-on-write
+	// rather than read, so keys are loaded by page faults as they are accessed, and the file is never modified
+	// Returns `false` if the file cannot be mapped, or was saved by a table of another type or version
+	auto open_mapped(const char *path) -> bool;
+
  private:
+	// Whether slots hold handles into `slab_` rather than values (see `DleftPolicy`)
+	static constexpr bool slab_value = Policy::slab_values;
+
+	using StoredValue = std::conditional_t<slab_value, uint32_t, V>;
+
+	// Whether keys are variable-length, in which case their bytes are stored in `arena_`
+	static constexpr bool var_key = std::is_same<K, KeySpan>::value;
+
+	struct KeyArena;
+	struct KeyProbe;
+
+	// A variable-length key as slots hold it: the offset of its bytes in the key arena and its length, in 8 bytes
+	class KeyRef {
+	 public:
+		KeyRef() = default;
+
+		KeyRef(uint64_t offset, size_t length) : bits_((offset << 16) | length) {
+			assert(offset < (uint64_t{1} << 48) && length <= KeySpan::max_length);
+		}
+
+		auto offset() const -> uint64_t { return bits_ >> 16; }
+
+		auto size() const -> size_t { return bits_ & 0xffff; }
+
+		// Compares the bytes in the arena of the key looked for, once the lengths match
+		auto operator==(const KeyProbe &probe) const -> bool {
+			if (size() != probe.key.size()) {
+				return false;
+			} else if (size() == 0) {  // The empty key may have no data at all
+				return true;
+			}
+			const char *data = probe.arena->TryAt(*this);
+			return data != nullptr && memcmp(data, probe.key.data(), size()) == 0;
+		}
+
+	 private:
+		uint64_t bits_{0};
+	};
+
+	// A variable-length key looked for, along with the arena of the keys it is compared with
+	struct KeyProbe {
+		KeySpan key;
+		const KeyArena *arena;
+	};
+
+	// What slots hold in place of a key, and what the bucket functions compare it with
+	using StoredKey = std::conditional_t<var_key, KeyRef, K>;
+
+	using LookupKey = std::conditional_t<var_key, KeyProbe, K>;
+
   using Tuple = struct {
-    K key;
-    V value;
+    StoredKey key;
+    StoredValue value;
   };
 
 	static constexpr size_t tuple_size = sizeof(Tuple);
 
+	// Whether buckets keep keys and values in separate arrays (see `DleftPolicy`)
+	static constexpr bool soa_bucket = Policy::soa_buckets;
+
+	static_assert(!(soa_bucket && buffered), "the write buffer keeps whole pairs in the header's cacheline");
+
+	// Whether lookups compare keys rather than fingerprints in buckets (see `DleftPolicy`)
+	static constexpr bool compare_key = Policy::compare_keys;
+
+	static_assert(!compare_key || (soa_bucket && std::is_integral_v<K> && (sizeof(K) == 4 || sizeof(K) == 8)),
+								"keys are compared directly only if they are 4-byte or 8-byte integers in a key array");
+	static_assert(!compare_key || Policy::bucket_capacity % (32 / sizeof(K)) == 0,
+								"keys are compared a whole AVX2 vector at a time");
+
+	// Candidate buckets per key (see `DleftPolicy`)
+	static constexpr int num_choices = Policy::num_choices;
+
+	static_assert(!partial_key || num_choices == 2, "in partial-key mode, a key has exactly two candidate buckets");
+
+	// A slot of a structure-of-arrays bucket, which reads and writes like a `Tuple`
+	template <class Key, class Value>
+	struct SlotRef {
+		Key &key;
+		Value &value;
+
+		auto operator=(SlotRef &&other) -> SlotRef & {
+			key = std::move(other.key);
+			value = std::move(other.value);
+			return *this;
+		}
+	};
+
+	// The arguments of `try_emplace`, passed down the insertion path in place of a value, so that the value is only
+	// constructed once its slot is found
+	template <class... Args>
+	struct InPlace {
+		std::tuple<Args &&...> args_;
+	};
+
+	template <class Value>
+	struct IsInPlace : std::false_type {};
+
+	template <class... Args>
+	struct IsInPlace<InPlace<Args...>> : std::true_type {};
+
+	struct ValueSlab;
+
+	// In slab mode, a value (or `InPlace`) on its way to a slot, along with the slab to put it in; keys and values
+	// that are only moved between slots travel as handles instead
+	template <class Value>
+	struct SlabArg {
+		using type = Value;
+
+		ValueSlab *slab_;
+		Value &&value_;
+	};
+
+	template <class Value>
+	struct IsSlabArg : std::false_type {};
+
+	template <class Value>
+	struct IsSlabArg<SlabArg<Value>> : std::true_type {};
+
+	// Stores a value into a free slot, which holds a value already (slots are never left unconstructed); arguments
+	// of `try_emplace` construct the value in the slot if that cannot throw, and assign a temporary otherwise, so
+	// that a throwing constructor leaves the slot as it was. In slab mode, the value goes into a new block
+	template <class Slot, class Value>
+	static void StoreValue(Slot &slot, Value &&value) {
+		if constexpr (IsSlabArg<std::decay_t<Value>>::value) {
+			slot = value.slab_->New(std::forward<typename std::decay_t<Value>::type>(value.value_));
+		} else if constexpr (IsInPlace<std::decay_t<Value>>::value) {
+			std::apply([&slot](auto &&...args) {
+				if constexpr (std::is_nothrow_constructible_v<V, decltype(args)...>) {
+					std::destroy_at(&slot);
+					::new (static_cast<void *>(&slot)) V(std::forward<decltype(args)>(args)...);
+				} else {
+					slot = V(std::forward<decltype(args)>(args)...);
+				}
+			}, std::move(value.args_));
+		} else {
+			slot = std::forward<Value>(value);
+		}
+	}
+
+	// Same as above, but overwrites the value of a key that is in the table already, in its block in slab mode
+	template <class Value>
+	static void AssignValue(StoredValue &slot, Value &&value) {
+		if constexpr (IsSlabArg<std::decay_t<Value>>::value) {
+			StoreValue(value.slab_->At(slot), std::forward<typename std::decay_t<Value>::type>(value.value_));
+		} else {
+			StoreValue(slot, std::forward<Value>(value));
+		}
+	}
+
 	struct Bucket;
 	struct StashBucket;
+	struct StatsShard;
 
-  struct Bucket {
+  struct alignas(Policy::aligned_buckets ? CACHELINE_SIZE : std::max(alignof(Tuple), alignof(uint16_t)))
+			Bucket {
     static constexpr size_t header_size = 32;
-    static constexpr int bucket_capacity = 16;
-    static constexpr int max_minor_overflows = 4;
-    // static constexpr size_t buf_size = CACHELINE_SIZE - header_size;
-    // static constexpr int buf_capacity = buf_size / tuple_size;
+    static constexpr int bucket_capacity = Policy::bucket_capacity;
+    static constexpr int max_minor_overflows = Policy::max_minor_overflows;
+    static constexpr size_t buf_size = CACHELINE_SIZE - header_size;
+    static constexpr int buf_capacity = buffered ? std::min<int>(buf_size / tuple_size, bucket_capacity) : 0;
+    static constexpr uint16_t buf_mask = (1u << buf_capacity) - 1;
+    static constexpr uint16_t slot_mask = (1u << bucket_capacity) - 1;
+
+    // The header layout does not depend on the policy, as the probe kernels load it as a whole; smaller
+    // buckets leave the trailing fingerprints unused, and fewer minor overflows the trailing overflow slots
+    static constexpr int header_fingerprints = 16;
+    static constexpr int header_overflows = 4;
 
     // header (32 bytes)
-    uint8_t fingerprints_[bucket_capacity];      // fingerprints for each in-bucket key
+    uint8_t fingerprints_[header_fingerprints];  // fingerprints for each in-bucket key
     uint16_t validity_{0};                       // validity bitmap for each in-bucket key
 		uint8_t overflow_count_{0};                  // the total number of overflows
 		uint8_t overflow_info_{0};                   // the 2 highest bits specify the stash bucket;
 		                                             // the 4 lowest bits serve as the validity bits for minor overflows
-		uint16_t overflow_fp_[max_minor_overflows];  // fingerprints for minor overflows
-		uint8_t overflow_pos_[max_minor_overflows];  // positions of minor overflows in the stash bucket
+		uint16_t overflow_fp_[header_overflows];     // fingerprints for minor overflows
+		uint8_t overflow_pos_[header_overflows];     // positions of minor overflows in the stash bucket
 
-		// TODO: write buffer optimization
-    // // write buffer (in the same cacheline as header)
-    // Tuple buf_[buf_capacity];
-    // uint8_t dummy_[buf_size - sizeof(buf_)];
+		// The slots of a bucket with `soa_buckets`, indexed like an array of pairs
+		struct SoaSlots {
+			StoredKey keys_[bucket_capacity];
+			StoredValue values_[bucket_capacity];
 
-    // // key-value pairs
-    // Tuple tuples_[bucket_capacity - buf_capacity];
+			auto operator[](size_t i) -> SlotRef<StoredKey, StoredValue> { return {keys_[i], values_[i]}; }
 
-		// key-value pairs
-		Tuple tuples_[bucket_capacity];
+			auto operator[](size_t i) const -> SlotRef<const StoredKey, const StoredValue> {
+				return {keys_[i], values_[i]};
+			}
+		};
+
+		// key-value pairs; the first `buf_capacity` of them fit in the 32 bytes after the header,
+		// and serve as a write buffer which is flushed into the rest of the bucket when full
+		std::conditional_t<soa_bucket, SoaSlots, Tuple[bucket_capacity]> tuples_;
 
 		enum class TupleStatus { IN_BUCKET, MINOR_OVERFLOW, MAJOR_OVERFLOW, NOT_FOUND };
 
 		Bucket() = default;
 
 		// Inserts a key, overwriting duplicates
-		auto Insert(K &&, V &&, uint32_t, StashBucket *) -> bool;
+		template <class Value>
+		auto Insert(StoredKey &&, Value &&, uint32_t, StashBucket *) -> bool;
 
 		// Inserts a key without duplicate checks
-		auto Append(K &&, V &&, uint32_t, StashBucket *) -> bool;
+		template <class Value>
+		auto Append(StoredKey &&, Value &&, uint32_t, StashBucket *) -> bool;
 
 		// Removes a key
-		auto Erase(const K &, uint32_t, StashBucket *) -> bool;
+		auto Erase(const LookupKey &, uint32_t, StashBucket *, StatsShard * = nullptr) -> bool;
+
+		// Looks for a key and returns the associated value, unless `value` is null
+		auto Find(const LookupKey &, StoredValue *, uint32_t, const StashBucket *, StatsShard * = nullptr) const -> bool;
+
+		// Same as above, but with the fingerprint matches already computed (see `ProbeMasks`)
+		auto Find(const LookupKey &, StoredValue *, uint32_t, uint16_t, uint8_t, const StashBucket *,
+							StatsShard * = nullptr) const -> bool;
+
+		template <class Value>
+		void InsertAt(StoredKey &&, Value &&, uint8_t, uint32_t);
 
-		// Looks for a key and returns the associated value
-		auto Find(const K &, V *, uint32_t, const StashBucket *) const -> bool;
+		// Returns a free slot (or `bucket_capacity` if bucket is full); in a buffered bucket, the
+		// write buffer is flushed first if it is full, so that the slot is in the write buffer when possible
+		auto FindFreeSlot() -> uint8_t;
 
-		void InsertAt(K &&, V &&, uint8_t, uint32_t);
+		// Moves the keys in the write buffer into the free slots in the rest of the bucket
+		void Flush();
 
 		// Searches for a key and returns its position
 		// `status` == IN_BUCKET: returns the key's position in bucket
 		// `status` == MINOR_OVERFLOW: returns the index of the key's `overflow_fp_` and `overflow_pos_`
 		// `status` == MAJOR_OVERFLOW: returns the index of the key's `fingerprints_` and `position_` in stash bucket
-		auto FindPos(const K &, uint32_t, const StashBucket *, TupleStatus &) const -> uint8_t;
+		// False positives are counted into the `StatsShard`, if any
+		auto FindPos(const LookupKey &, uint32_t, const StashBucket *, TupleStatus &, StatsShard * = nullptr) const
+				-> uint8_t;
+
+		auto FindPos(const LookupKey &, uint32_t, uint16_t, uint8_t, const StashBucket *, TupleStatus &,
+								 StatsShard * = nullptr) const -> uint8_t;
+
+		// Get the slots of valid in-bucket keys whose fingerprints match
+		auto MatchFingerprints(uint32_t hash) const -> uint16_t {
+			int mask;
+			SEARCH_8_128(FINGERPRINT8(hash), fingerprints_, mask);
+			return mask & validity_;
+		}
+
+		// Get the slots of valid in-bucket keys equal to `key`, with `compare_key`
+		auto MatchKeysSSE2(const K &key) const -> uint16_t;
+
+		TARGET_AVX2 auto MatchKeysAVX2(const K &key) const -> uint16_t;
+
+		// Get the slots of valid in-bucket keys that may be `key`: those equal to it with `compare_key`, and
+		// otherwise those whose fingerprints match
+		auto MatchSlots(const LookupKey &key, uint32_t hash) const -> uint16_t {
+			if constexpr (compare_key) {
+				return probe_kernel_ == ProbeKernel::SSE2 ? MatchKeysSSE2(key) : MatchKeysAVX2(key);
+			} else {
+				return MatchFingerprints(hash);
+			}
+		}
+
+		// Get the minor overflows whose fingerprints match, one even bit for each of them
+		// (the validity of minor overflows is not checked here)
+		auto MatchOverflows(uint32_t hash) const -> uint8_t {
+			int mask;
+			SEARCH_16_128(FINGERPRINT16(hash), overflow_fp_, mask);
+			return mask & 0x55;
+		}
+
+		// Fingerprint matches in both candidate buckets of a key, the first bucket in the low bits
+		struct ProbeMasks {
+			uint32_t fingerprints;  // `MatchSlots` of both buckets
+			uint16_t overflows;     // `MatchOverflows` of both buckets
+		};
+
+		// Probe kernels: SSE2 compares one header array at a time; AVX2 compares the fingerprints of both
+		// buckets at once; AVX-512 compares the whole headers of both buckets, minor overflows included,
+		// with a single instruction
+		static void ProbeSSE2(const Bucket *, const Bucket *, uint32_t, uint32_t, ProbeMasks &);
+
+		TARGET_AVX2 static void ProbeAVX2(const Bucket *, const Bucket *, uint32_t, uint32_t, ProbeMasks &);
+
+		TARGET_AVX512 static void ProbeAVX512(const Bucket *, const Bucket *, uint32_t, uint32_t, ProbeMasks &);
 
 		void Clear() {
 			validity_ = 0; overflow_count_ = 0; overflow_info_ = 0;
@@ -255,7 +846,7 @@ class DleftFpStash {
 		void SetStashBucketNum(uint8_t num) { overflow_info_ = (num << 6) | GetMinorOverflowValidity(); }
 
 		auto GetStashBucketIndex(size_t idx, size_t max) const -> size_t {
-			return (idx / BUCKET_STASH_BUCKET_RATIO + GetStashBucketNum() * GetStride(idx)) & (max - 1);
+			return (idx / Policy::stash_ratio + GetStashBucketNum() * GetStride(idx)) & (max - 1);
 		}
 
 		// Get the validity bitmap for its moinor overflows
@@ -263,18 +854,34 @@ class DleftFpStash {
 
 		// Get the number of minor overflows
 		auto GetMinorOverflowCount() const -> uint8_t { return __builtin_popcount(GetMinorOverflowValidity()); }
+
+		// Prefetch the whole bucket (header & key-value pairs), or only the header and keys with `soa_buckets`
+		void Prefetch() const {
+			size_t size = sizeof(Bucket);
+			if constexpr (soa_bucket) {
+				size = reinterpret_cast<const char *>(tuples_.values_) - reinterpret_cast<const char *>(this);
+			}
+			for (size_t offset = 0; offset < size; offset += CACHELINE_SIZE) {
+				PREFETCH(reinterpret_cast<const char *>(this) + offset);
+			}
+			PREFETCH(reinterpret_cast<const char *>(this) + size - 1);
+		}
+
+		// Prefetch the parts of its stash bucket that a search for `hash` may touch
+		void PrefetchOverflows(uint32_t, const StashBucket *) const;
   };
 
-  struct StashBucket {
-    static constexpr size_t header_size = 40;
+  struct alignas(Policy::aligned_buckets ? CACHELINE_SIZE : std::max(alignof(Tuple), alignof(uint64_t))) StashBucket {
+    static constexpr int validity_words = ROUND_UP(Policy::stash_bucket_capacity, 64);
+    static constexpr size_t header_size = 8 + 8 * validity_words;
     static constexpr int max_major_overflows = 2;
-    static constexpr int bucket_capacity = 255;
+    static constexpr int bucket_capacity = Policy::stash_bucket_capacity;
 		static constexpr uint8_t invalid_pos = 0xff;
 
-    // header (40 B)
+    // header (40 B with the default 255 slots)
     uint16_t fingerprints_[max_major_overflows];            // fingerprints for major overflows
 		uint8_t  position_[max_major_overflows];                // positions of each major overflow in stash bucket
-    uint64_t validity_[ROUND_UP(bucket_capacity, 64)] {0};  // validity bitmap for each overflow key in stash bucket
+    uint64_t validity_[validity_words] {0};                 // validity bitmap for each overflow key in stash bucket
 
 		// key-value pairs
     Tuple tuples_[bucket_capacity];
@@ -282,1176 +889,5196 @@ class DleftFpStash {
 		StashBucket() { memset(position_, invalid_pos, sizeof(position_)); }
 
 		// Inserts a major overflow, overwriting duplicates
-    auto InsertMajorOverflow(K &&, V &&, uint32_t) -> bool;
+		template <class Value>
+    auto InsertMajorOverflow(StoredKey &&, Value &&, uint32_t) -> bool;
 
 		// Inserts a major overflow without checking duplicates
-		auto AppendMajorOverflow(K &&, V &&, uint32_t) -> bool;
+		template <class Value>
+		auto AppendMajorOverflow(StoredKey &&, Value &&, uint32_t) -> bool;
 
 		// Removes a major overflow key
-    auto EraseMajorOverflow(const K &, uint32_t) -> bool;
+    auto EraseMajorOverflow(const LookupKey &, uint32_t) -> bool;
 
 		// Searches for a major overflow key and returns its associated value
-    auto FindMajorOverflow(const K &, V *, uint32_t) const -> bool;
+    auto FindMajorOverflow(const LookupKey &, StoredValue *, uint32_t) const -> bool;
 
 		// Searches for a major overflow key and returns its index of `fingerprints_` and `position_`
-		auto FindMajorOverflowIdx(const K &, uint32_t) const -> uint8_t;
+		auto FindMajorOverflowIdx(const LookupKey &, uint32_t, StatsShard * = nullptr) const -> uint8_t;
 
-    auto InsertMinorOverflow(K &&, V &&) -> uint8_t;
+		template <class Value>
+    auto InsertMinorOverflow(StoredKey &&, Value &&) -> uint8_t;
 
-    auto EraseMinorOverflow(const K &, uint8_t) -> bool;
+    auto EraseMinorOverflow(const LookupKey &, uint8_t) -> bool;
 
-    auto FindMinorOverflow(const K &, V *, uint8_t) const -> bool;
+    auto FindMinorOverflow(const LookupKey &, StoredValue *, uint8_t) const -> bool;
 
 		void Clear() { memset(validity_, 0, sizeof(validity_)); memset(position_, invalid_pos, sizeof(position_)); }
 
 		// Returns the number of valid overflow keys in bucket (either major or minor)
 		auto GetSize() const -> uint8_t {
-			return __builtin_popcountll(validity_[0]) + __builtin_popcountll(validity_[1])
-						 + __builtin_popcountll(validity_[2]) + __builtin_popcountll(validity_[3]);
+			uint8_t size = 0;
+			for (int i = 0; i < validity_words; i++) {
+				size += __builtin_popcountll(validity_[i]);
+			}
+			return size;
 		};
 
+		// Returns a free slot, or `invalid_pos` if the stash bucket is full
 		auto FindFreeSlot() const -> uint8_t {
-		 	if (~validity_[0] != 0) {
-				return __builtin_ctzll(~validity_[0]);
-			} else if (~validity_[1] != 0) {
-				return 64 + __builtin_ctzll(~validity_[1]);
-			} else if (~validity_[2] != 0) {
-				return 128 + __builtin_ctzll(~validity_[2]);
+			for (int i = 0; i < validity_words; i++) {
+				if (~validity_[i] != 0) {
+					int pos = i * 64 + __builtin_ctzll(~validity_[i]);
+					return pos < bucket_capacity ? pos : invalid_pos;
+				}
 			}
-			return 192 + __builtin_ctzll(~validity_[3]);
+			return invalid_pos;
 		}
   };
 
-	enum class InsertStatus { INSERTED, EXISTED, FAILED };
+  // A spinlock whose version is bumped both when it is locked and when it is unlocked, so that the version
+  // is odd while locked; like a seqlock, readers snapshot the version before reading the data it protects,
+  // and validate it afterwards instead of locking. Padded to a cacheline to avoid false sharing.
+  struct alignas(CACHELINE_SIZE) VersionLock {
+		std::atomic<uint64_t> version_{0};
+
+		void Lock() {
+			uint64_t version = version_.load(std::memory_order_relaxed);
+			while ((version & 1) || !version_.compare_exchange_weak(version, version + 1, std::memory_order_acquire)) {
+				_mm_pause();
+				version = version_.load(std::memory_order_relaxed);
+			}
+			std::atomic_thread_fence(std::memory_order_release);
+		}
 
-	// Check for duplicate key in a bucket; If found, return `true` and overwrite the value if `upsert`
-	template<bool upsert = true>
-	auto CheckDuplicate(K &&, V &&, uint16_t, uint32_t) -> bool;
+		auto TryLock() -> bool {
+			uint64_t version = version_.load(std::memory_order_relaxed);
+			if ((version & 1) || !version_.compare_exchange_strong(version, version + 1, std::memory_order_acquire)) {
+				return false;
+			}
+			std::atomic_thread_fence(std::memory_order_release);
+			return true;
+		}
 
-	// Try to insert a kv pair into bucket, without duplicate check
-	auto TryInsert(K &&, V &&, uint16_t, uint32_t) -> bool;
+		void Unlock() { version_.fetch_add(1, std::memory_order_release); }
 
-	// Try to move one key in a bucket to its alternative bucket
-	// Returns the index of the moved key; If no key can be moved, return `invalid_pos`
-	auto OneMove(uint16_t) -> uint8_t;
+		// Waits until no writer holds the lock, and returns its version
+		auto ReadBegin() const -> uint64_t {
+			uint64_t version;
+			while ((version = version_.load(std::memory_order_acquire)) & 1) {
+				_mm_pause();
+			}
+			return version;
+		}
 
-	// Inserts a key into the hash table; If a duplicate is found, the value is overwritten
-	// Returns `INSERTED` if insertion was successful, `EXISTED` if a duplicate key is found,
-	// and `FAILED` if the insertion failed (e.g. when running out of space)
-	// template argument `upsert` defines whether to overwrite duplicates
-	template<bool upsert = true>
-  auto Insert(K &&, V &&, uint32_t, uint32_t) -> InsertStatus;
+		// Returns `true` if no writer has locked it since `ReadBegin` returned `version`
+		auto ReadValidate(uint64_t version) const -> bool {
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return version_.load(std::memory_order_relaxed) == version;
+		}
+  };
 
-	// Inserts a key into the hash table without duplicate checks
-	// Returns `true` if insertion is successful and `false` otherwise (e.g. when running out of space)
-	auto Append(K &&, V &&, uint32_t, uint32_t) -> bool;
+	enum Stat { false_positives, minor_overflows, major_overflows, one_move_attempts, one_move_successes, resizes,
+							resize_ns, path_lengths, num_stats = path_lengths + DleftStats::max_path_length + 1 };
 
-	// Removes a key from the hash table
-	// Returns `true` if found and `false` otherwise
-  auto Erase(const K &, uint32_t, uint32_t) -> bool;
+	// The counters of `stats()` are split into shards, each thread counting into its own (see `ThreadStats`), so that
+	// threads do not bounce the same cacheline; readers count too, hence atomic counters even without `concurrent`
+	struct alignas(CACHELINE_SIZE) StatsShard {
+		std::atomic<uint64_t> counts_[num_stats]{};
 
-	// Searches for a key from the hash table
-	// Returns `true` if found and `false` otherwise; value is stored in the second argument
-  auto Find(const K &, V *, uint32_t, uint32_t) const -> bool;
+		void Count(Stat stat, uint64_t n = 1) {
+			if constexpr (with_stats) {
+				counts_[stat].fetch_add(n, std::memory_order_relaxed);
+			}
+		}
+	};
 
-	// Resize the table; may fail if the new size is smaller than current size
-	// Returns `true` if resize is successful and false otherwise
-  auto Resize(size_t) -> bool;
+	static constexpr size_t num_stats_shards = 64;
 
-	auto BucketCapacity() const -> size_t { return Bucket::bucket_capacity * num_buckets_; }
+	// Numbers threads in the order they first call it, so that each picks its own shard of counters
+	static auto ThreadIndex() -> size_t {
+		static std::atomic<size_t> num_threads{0};
+		static thread_local size_t thread_idx = num_threads.fetch_add(1, std::memory_order_relaxed);
+		return thread_idx;
+	}
 
-	auto StashBucketCapacity() const -> size_t { return StashBucket::bucket_capacity * num_stash_buckets_; }
+	// Returns the calling thread's shard of the counters, or null without `with_stats`
+	auto ThreadStats() const -> StatsShard * {
+		if constexpr (!with_stats) {
+			return nullptr;
+		} else {
+			return &stats_shards_[ThreadIndex() & (num_stats_shards - 1)];
+		}
+	}
 
-	static auto GetStride(uint16_t idx) -> size_t { return idx * idx + 7 * idx + 457; }
+	static void Count(StatsShard *shard, Stat stat, uint64_t n = 1) {
+		if constexpr (with_stats) {
+			if (shard != nullptr) {
+				shard->Count(stat, n);
+			}
+		}
+	}
 
-	size_t num_buckets_;
+	// Reads the clock only with `with_stats`, for `CountResize`
+	static auto StatsClock() -> std::chrono::steady_clock::time_point {
+		return with_stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+	}
 
-	size_t num_stash_buckets_;
+	// Counts a successful resize that started at `start`
+	void CountResize(std::chrono::steady_clock::time_point start) {
+		if constexpr (with_stats) {
+			StatsShard *stats_shard = ThreadStats();
+			stats_shard->Count(resizes);
+			stats_shard->Count(resize_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(
+																				std::chrono::steady_clock::now() - start).count());
+		}
+	}
 
-	size_t size_{0};
+	// Optimistic readers in concurrent mode count themselves in, for as long as they read, under the parity of the
+	// epoch they started in; each thread counts into its own shard, so that readers do not bounce a cacheline
+	struct alignas(CACHELINE_SIZE) ReaderShard {
+		std::atomic<uint64_t> counts_[2]{};
+	};
 
-	size_t overflow_count_{0};
+	static constexpr size_t num_reader_shards = 64;
+
+	// Counts a reader in for as long as it lives (see `Reclaim`)
+	class ReadGuard {
+	 public:
+		explicit ReadGuard(const DleftFpStash *table)
+				: shard_(&table->reader_shards_[ThreadIndex() & (num_reader_shards - 1)]) {
+			// A writer that advances the epoch in the meantime may have missed this reader, so it counts itself in
+			// again under the new epoch
+			while (true) {
+				epoch_ = table->epoch_.load();
+				shard_->counts_[epoch_ & 1].fetch_add(1);
+				if (table->epoch_.load() == epoch_) {
+					break;
+				}
+				shard_->counts_[epoch_ & 1].fetch_sub(1, std::memory_order_release);
+			}
+		}
 
-	Bucket *buckets_;
+		~ReadGuard() { shard_->counts_[epoch_ & 1].fetch_sub(1, std::memory_order_release); }
 
-	StashBucket *stash_buckets_;
+	 private:
+		ReaderShard *shard_;
+		uint64_t epoch_;
+	};
 
-#ifdef __TEST_DLEFT__
-	friend class DleftTest;
-#endif
-};
+	// Locks a stash bucket for as long as it lives; does nothing unless in concurrent mode, if `stash_bucket`
+	// is null, or if the caller holds all locks already
+	class StashGuard {
+	 public:
+		StashGuard(const DleftFpStash *table, const StashBucket *stash_bucket)
+				: lock_(concurrent && stash_bucket != nullptr && !table->all_locked_ ?
+								&table->stash_locks_[StashLockIndex(stash_bucket - table->stash_buckets_)] : nullptr) {
+			if (lock_ != nullptr) {
+				lock_->Lock();
+			}
+		}
 
-#define DLEFT_TEMPLATE template <class K, class V, class H1, class H2>
-#define DLEFT_TYPE DleftFpStash<K, V, H1, H2>
+		~StashGuard() {
+			if (lock_ != nullptr) {
+				lock_->Unlock();
+			}
+		}
 
-DLEFT_TEMPLATE
-DLEFT_TYPE::DleftFpStash(size_t size)
-		: num_buckets_(ROUNDUP_POWER_2(size / Bucket::bucket_capacity)),
-			num_stash_buckets_(num_buckets_ / BUCKET_STASH_BUCKET_RATIO) {
-	if (num_buckets_ > (1 << 16)) {
-		printf("error: table is too large\n");
-		exit(1);
-	}
+	 private:
+		VersionLock *lock_;
+	};
 
-	buckets = buckets_ = new Bucket[num_buckets_];
-	assert(buckets_ != nullptr);
+	static_assert(!concurrent || (std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value),
+								"concurrent readers copy keys and values optimistically, which requires trivially copyable types");
 
-	if (num_stash_buckets_ == 0) {
-		stash_buckets_ = nullptr;
-	} else {
-		stash_buckets = stash_buckets_ = new StashBucket[num_stash_buckets_];
-		assert(stash_buckets_ != nullptr);
-	}
-}
+	// Stores the bytes of variable-length keys, addressed by their offset in the arena. Keys are copied one after
+	// another into chunks, each twice as large as the one before, which are never moved, so that optimistic readers
+	// can follow a stale offset safely; the bytes of erased keys stay behind until the keys are compacted into
+	// another arena (see `CompactKeys`)
+	struct KeyArena {
+		static constexpr int first_chunk_bits = 20;               // the first chunk has 1 MiB
+		static constexpr int max_chunks = 48 - first_chunk_bits;  // offsets fit in 48 bits
+		static constexpr size_t first_chunk_size = size_t{1} << first_chunk_bits;
+		static constexpr uint64_t max_size = ((uint64_t{1} << max_chunks) - 1) << first_chunk_bits;
+		static_assert(KeySpan::max_length <= first_chunk_size);
 
-DLEFT_TEMPLATE
-template<bool upsert>
-auto DLEFT_TYPE::CheckDuplicate(K &&key, V &&value, uint16_t idx, uint32_t hash) -> bool {
-	using TupleStatus = typename Bucket::TupleStatus;
-	Bucket *bucket = &buckets_[idx];
-	TupleStatus status;
-	StashBucket *stash_bucket = nullptr;
-	uint8_t pos;
+		std::atomic<char *> chunks_[max_chunks]{};
+		uint64_t size_{0};  // bytes handed out so far, including the ends of chunks that the next key did not fit in
 
-	if (stash_buckets_ != nullptr && bucket->overflow_count_ > 0) {
-		stash_bucket = &stash_buckets_[bucket->GetStashBucketIndex(idx, num_stash_buckets_)];
-	}
+		KeyArena() = default;
 
-	pos = bucket->FindPos(key, hash, stash_bucket, status);
-	if (status == TupleStatus::IN_BUCKET) {
-		if (upsert) {
-			bucket->tuples_[pos].value = value;
-		}
-		return true;
-	} else if (status == TupleStatus::MINOR_OVERFLOW) {
-		if (upsert) {
-			stash_bucket->tuples_[bucket->overflow_pos_[pos]].value = value;
+		KeyArena(const KeyArena &) = delete;
+
+		~KeyArena() { Clear(); }
+
+		// Throws if a key is too long to be stored
+		static void CheckLength(const KeySpan &key) {
+			if (key.size() > KeySpan::max_length) {
+				throw std::length_error("DleftFpStash: key is too long");
+			}
 		}
-		return true;
-	} else if (UNLIKELY( status == TupleStatus::MAJOR_OVERFLOW )) {
-		if (upsert) {
-			stash_bucket->tuples_[stash_bucket->position_[pos]].value = value;
+
+		// Splits an offset into its chunk and its position in the chunk
+		static auto Locate(uint64_t offset, int &chunk) -> size_t {
+			chunk = 63 - __builtin_clzll((offset >> first_chunk_bits) + 1);
+			return offset - (((uint64_t{1} << chunk) - 1) << first_chunk_bits);
 		}
-		return true;
-	}
-	return false;
-}
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::TryInsert(K &&key, V &&value, uint16_t idx, uint32_t hash) -> bool {
-	Bucket *bucket = &buckets_[idx];
-	StashBucket *stash_bucket = nullptr;
+		static auto ChunkSize(int chunk) -> size_t { return first_chunk_size << chunk; }
 
-	if (bucket->overflow_count_ == 0) {  // No stash bucket yet
-		if (bucket->Append(std::forward<K>(key), std::forward<V>(value), hash, nullptr)) {
-			size_++;
-			return true;
-		}  // Bucket is full; need a stash bucket
-		if (stash_buckets_ == nullptr) {  // No usable stash bucket, so insertion fails
-			return false;
+		auto At(uint64_t offset) const -> char * {
+			int chunk;
+			size_t pos = Locate(offset, chunk);
+			return chunks_[chunk].load(std::memory_order_relaxed) + pos;
 		}
 
-		uint8_t stash_idx = (idx / BUCKET_STASH_BUCKET_RATIO) & (num_stash_buckets_ - 1), min_stash_num;
-		uint8_t min_stash_size = 0xff;
-		for (uint8_t stash_num = 0; stash_num < 4; stash_num++) {  // Bind bucket to its most underfull candidate stash bucket
-			stash_idx = (stash_idx + GetStride(idx)) & (num_stash_buckets_ - 1);
-			uint8_t size = stash_buckets_[stash_idx].GetSize();
-			if (size < min_stash_size) {
-				min_stash_num = stash_num;
-				min_stash_size = size;
+		// The bytes of a key, for optimistic readers, which may read a key as it is being written: null if they do
+		// not lie in any chunk
+		auto TryAt(const KeyRef &key) const -> const char * {
+			int chunk;
+			size_t pos = Locate(key.offset(), chunk);
+			if (chunk >= max_chunks || pos + key.size() > ChunkSize(chunk)) {
+				return nullptr;
 			}
+			const char *bytes = chunks_[chunk].load(std::memory_order_acquire);
+			return bytes != nullptr ? bytes + pos : nullptr;
 		}
-		bucket->SetStashBucketNum(min_stash_num);
-		assert(bucket->GetStashBucketNum() == min_stash_num);
-		DEBUG_DLEFT(
-			printf("Bucket %d bound with stash bucket %lu(%d)\n", idx,
-						 bucket->GetStashBucketIndex(idx, num_stash_buckets_), min_stash_num);
-		)
-	}
 
-	// Retry insertion with stash bucket
-	assert(stash_buckets_ != nullptr);
-	stash_bucket = &stash_buckets_[bucket->GetStashBucketIndex(idx, num_stash_buckets_)];
-	if (bucket->Append(std::forward<K>(key), std::forward<V>(value), hash, stash_bucket)) {
-		size_++;
-		return true;
-	}
-	return false;
-}
+		auto View(const KeyRef &key) const -> KeySpan {
+			return key.size() == 0 ? KeySpan() : KeySpan(At(key.offset()), key.size());
+		}
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::OneMove(uint16_t idx) -> uint8_t {
-	Bucket *bucket = &buckets_[idx];
+		// Hands out `n` bytes in a single chunk, at most as many as the first chunk has, and returns their offset
+		auto Allocate(size_t n) -> uint64_t {
+			int chunk;
+			size_t pos = Locate(size_, chunk);
+			if (pos + n > ChunkSize(chunk)) {  // Bytes never straddle two chunks
+				size_ += ChunkSize(chunk) - pos;
+				chunk++;
+			}
+			if (chunk >= max_chunks) {
+				throw std::length_error("DleftFpStash: key arena is full");
+			}
+			if (chunks_[chunk].load(std::memory_order_relaxed) == nullptr) {
+				chunks_[chunk].store(new char[ChunkSize(chunk)], std::memory_order_release);
+			}
+			uint64_t offset = size_;
+			size_ += n;
+			return offset;
+		}
 
-	// @note Computing (potentially) two hashes for each key seems a bit expensive here;
-	//       We should consider using one additional bit for each key to indicate which hash
-	//       function to use, or simply store the other hash as fingerprint (in which case
-	//       the distance between the two buckets must be limited).
-	//       For now we just keep it that way, since we're focusing on read latency.
-	assert(bucket->GetSize() == Bucket::bucket_capacity);
-	for (int i = 0; i < Bucket::bucket_capacity; i++) {
-		uint32_t hash = H1()(bucket->tuples_[i].key);
-		uint8_t alt_idx = BUCKET_IDX(hash) & (num_buckets_ - 1);
-		if (alt_idx == idx) {
-			hash = H2()(bucket->tuples_[i].key);
-			uint8_t alt_idx = BUCKET_IDX(hash) & (num_buckets_ - 1);
-			if (UNLIKELY( alt_idx == idx )) {
-				continue;
+		auto Copy(const KeySpan &key) -> KeyRef {
+			CheckLength(key);
+			if (key.size() == 0) {  // There is nothing to copy, and the empty key may have no data at all
+				return KeyRef();
 			}
+			uint64_t offset = Allocate(key.size());
+			memcpy(At(offset), key.data(), key.size());
+			return KeyRef(offset, key.size());
 		}
-		Bucket *alt_bucket = &buckets_[alt_idx];
-		if (alt_bucket->GetSize() == Bucket::bucket_capacity) {
-			continue;
-		}  // `alt_bucket` has free space, so move the key there
-		alt_bucket->Append(std::move(bucket->tuples_[i].key), std::move(bucket->tuples_[i].value), hash, nullptr);
-		return static_cast<uint8_t>(i);
-	}
-	return StashBucket::invalid_pos;
-}
 
-DLEFT_TEMPLATE
-template<bool upsert>
-auto DLEFT_TYPE::Insert(K &&key, V &&value, uint32_t hash1, uint32_t hash2) -> InsertStatus {
-	uint16_t idx1 = BUCKET_IDX(hash1) & (num_buckets_ - 1);
-	uint16_t idx2 = BUCKET_IDX(hash2) & (num_buckets_ - 1);
+		// Takes back the bytes of `key`, if no other key was copied since
+		void Release(const KeyRef &key) {
+			if (key.size() > 0 && key.offset() + key.size() == size_) {
+				size_ -= key.size();
+			}
+		}
 
-	// Check for duplicates
-	if (CheckDuplicate<upsert>(std::forward<K>(key), std::forward<V>(value), idx1, hash1) ||
-			CheckDuplicate<upsert>(std::forward<K>(key), std::forward<V>(value), idx2, hash2)) {
-		return InsertStatus::EXISTED;
-	} // If not found, insert
-	return Append(std::forward<K>(key), std::forward<V>(value), hash1, hash2) ?
-				 InsertStatus::INSERTED : InsertStatus::FAILED;
-}
+		// Exchanges the chunks of two arenas; readers of either one see a mix of both meanwhile
+		void Swap(KeyArena &other) {
+			for (int i = 0; i < max_chunks; i++) {
+				char *chunk = chunks_[i].load(std::memory_order_relaxed);
+				chunks_[i].store(other.chunks_[i].load(std::memory_order_relaxed), std::memory_order_release);
+				other.chunks_[i].store(chunk, std::memory_order_release);
+			}
+			std::swap(size_, other.size_);
+		}
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::Append(K &&key, V &&value, uint32_t hash1, uint32_t hash2) -> bool {
-	uint16_t idx1 = BUCKET_IDX(hash1) & (num_buckets_ - 1);
-	uint16_t idx2 = BUCKET_IDX(hash2) & (num_buckets_ - 1);
+		void Clear() {
+			for (int i = 0; i < max_chunks; i++) {
+				delete[] chunks_[i].exchange(nullptr, std::memory_order_relaxed);
+			}
+			size_ = 0;
+		}
 
-	// Try inserting into the more underfull candidate bucket first
-	if (buckets_[idx1].GetTotal() <= buckets_[idx2].GetTotal()) {
-		if (TryInsert(std::forward<K>(key), std::forward<V>(value), idx1, hash1) ||
-				TryInsert(std::forward<K>(key), std::forward<V>(value), idx2, hash2)) {
-			return true;
+		auto Bytes() const -> size_t {
+			size_t bytes = 0;
+			for (int i = 0; i < max_chunks; i++) {
+				if (chunks_[i].load(std::memory_order_relaxed) != nullptr) {
+					bytes += ChunkSize(i);
+				}
+			}
+			return bytes;
 		}
-	} else {
-		if (TryInsert(std::forward<K>(key), std::forward<V>(value), idx2, hash2) ||
-				TryInsert(std::forward<K>(key), std::forward<V>(value), idx1, hash1)) {
-			return true;
+
+		// Bytes copied into an arena that nothing was erased from, give or take the ends of its chunks
+		auto Used() const -> size_t { return size_; }
+	};
+
+	// The key a slot holds, as a `K`; a variable-length key is viewed in `arena`, the one of the slot's arrays
+	static auto View(const StoredKey &key, const KeyArena &arena) -> std::conditional_t<var_key, K, const K &> {
+		if constexpr (var_key) {
+			return arena.View(key);
+		} else {
+			return key;
 		}
 	}
 
-	// Insertion failed; do one move on both buckets
-	uint8_t pos;
-	if ((pos = OneMove(idx1)) != StashBucket::invalid_pos) {
-		buckets_[idx1].InsertAt(std::forward<K>(key), std::forward<V>(key), pos, hash1);
-	} else if ((pos = OneMove(idx2)) != StashBucket::invalid_pos) {
-		buckets_[idx2].InsertAt(std::forward<K>(key), std::forward<V>(key), pos, hash2);
+	// A key to look for, as the bucket functions take it; a variable-length key is compared with the keys of `arena`
+	static auto Lookup(const K &key, const KeyArena &arena) -> std::conditional_t<var_key, LookupKey, const K &> {
+		if constexpr (var_key) {
+			return {key, &arena};
+		} else {
+			return key;
+		}
 	}
 
-	return false;
-}
-
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::Erase(const K &key, uint32_t hash1, uint32_t hash2) -> bool {
-	uint16_t idx1 = BUCKET_IDX(hash1) & (num_buckets_ - 1);
-	uint16_t idx2 = BUCKET_IDX(hash2) & (num_buckets_ - 1);
-	Bucket *bucket1 = &buckets_[idx1], *bucket2 = &buckets_[idx2];
-	StashBucket *stash_bucket1{nullptr}, *stash_bucket2{nullptr};
-
-	if (bucket1->overflow_count_ > 0 && stash_buckets_ != nullptr) {
-		stash_bucket1 = &stash_buckets_[bucket1->GetStashBucketIndex(idx1, num_stash_buckets_)];
-	}
-	if (bucket1->Erase(key, hash1, stash_bucket1)) {  // Try remove from the first bucket
-		size_--;
-		return true;
-	} else if (idx1 == idx2) {
-		return false;
+	// Copies the bytes of a new variable-length key into the arena, and asks for the keys to be compacted once
+	// erased keys take more than half of it (see `CompactKeysIfNeeded`)
+	auto StoreKey(const KeySpan &key) -> KeyRef {
+		KeyArena::CheckLength(key);
+		if (concurrent) {
+			arena_lock_.Lock();
+		}
+		KeyRef stored_key = arena_.Copy(key);
+		key_bytes_ += key.size();
+		if (arena_.Used() > 2 * key_bytes_ + KeyArena::first_chunk_size) {
+			compact_keys_ = true;
+		}
+		if (concurrent) {
+			arena_lock_.Unlock();
+		}
+		return stored_key;
 	}
 
-	if (bucket2->overflow_count_ > 0 && stash_buckets_ != nullptr) {
-		stash_bucket2 = &stash_buckets_[bucket2->GetStashBucketIndex(idx2, num_stash_buckets_)];
-	}  // If not found, try remove from the second bucket
-	if (bucket2->Erase(key, hash2, stash_bucket2)) {
-		size_--;
-		return true;
+	// Takes back the bytes of a key copied by `StoreKey` that was not inserted after all
+	void ReleaseKey(const KeyRef &key) {
+		if (concurrent) {
+			arena_lock_.Lock();
+		}
+		arena_.Release(key);
+		key_bytes_ -= key.size();
+		if (concurrent) {
+			arena_lock_.Unlock();
+		}
 	}
-	return false;
-}
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::Find(const K &key, V *value, uint32_t hash1, uint32_t hash2) const -> bool {
-	// TODO: parallelize the probing of two buckets
-	uint16_t idx1 = BUCKET_IDX(hash1) & (num_buckets_ - 1);
-	uint16_t idx2 = BUCKET_IDX(hash2) & (num_buckets_ - 1);
-	Bucket *bucket1 = &buckets_[idx1], *bucket2 = &buckets_[idx2];
-	StashBucket *stash_bucket1{nullptr}, *stash_bucket2{nullptr};
+	// The rest of a block of the arena that a thread of `BulkPlace` copies keys into, so that it only takes the
+	// arena's lock once per block
+	struct KeyBlock {
+		static constexpr size_t block_size = 64 << 10;
 
-	if (bucket1->overflow_count_ > 0 && stash_buckets_ != nullptr) {
-		stash_bucket1 = &stash_buckets_[bucket1->GetStashBucketIndex(idx1, num_stash_buckets_)];
-	}
-	if (bucket1->Find(key, value, hash1, stash_bucket1)) {  // Search the first bucket
-		return true;
-	} else if (idx1 == idx2) {
-		return false;
+		uint64_t offset{0};
+		uint64_t end{0};
+		size_t key_bytes{0};  // bytes of the keys copied so far
+	};
+
+	// Copies the bytes of a key checked by `CheckLength` into `block`, which takes another block of the arena first
+	// if the key does not fit
+	auto CopyKey(const KeySpan &key, KeyBlock &block) -> KeyRef {
+		if (key.size() == 0) {
+			return KeyRef();
+		}
+		if (block.offset + key.size() > block.end) {
+			arena_lock_.Lock();
+			block.offset = arena_.Allocate(KeyBlock::block_size);
+			arena_lock_.Unlock();
+			block.end = block.offset + KeyBlock::block_size;
+		}
+		memcpy(arena_.At(block.offset), key.data(), key.size());
+		block.key_bytes += key.size();
+		KeyRef stored_key(block.offset, key.size());
+		block.offset += key.size();
+		return stored_key;
 	}
 
-	if (bucket2->overflow_count_ > 0 && stash_buckets_ != nullptr) {
-		stash_bucket2 = &stash_buckets_[bucket2->GetStashBucketIndex(idx2, num_stash_buckets_)];
-	}  // If not found, search the second bucket
-	return bucket2->Find(key, value, hash2, stash_bucket2);
-}
+	// Copies the keys into a new arena, leaving the bytes of erased keys behind, and retires the old chunks, which
+	// optimistic readers may still be comparing against in concurrent mode
+	// The caller must hold all locks, and no migration may be going on
+	void CompactKeys();
+
+	// Compacts the keys if `StoreKey` asked for it; an incremental table migrates into arrays of the same size
+	// instead, copying keys as they migrate. The caller must hold all locks
+	void CompactKeysIfNeeded();
+
+	// Stores the values of a table in slab mode, in blocks of `sizeof(V)` bytes addressed by 32-bit handles. Blocks
+	// come in chunks, each twice as large as the one before, which are never moved and only freed with the table,
+	// so that optimistic readers can follow a stale handle safely; blocks of removed values are reused first
+	struct ValueSlab {
+		static constexpr int first_chunk_bits = 10;               // the first chunk has 2^10 blocks
+		static constexpr int max_chunks = 32 - first_chunk_bits;  // enough for almost 2^32 blocks
+		static constexpr size_t max_blocks = ((size_t{1} << max_chunks) - 1) << first_chunk_bits;
+
+		std::atomic<V *> chunks_[max_chunks]{};
+		size_t size_{0};               // blocks handed out so far, including freed ones
+		std::vector<uint32_t> free_;   // handles of freed blocks
+		VersionLock lock_;             // taken by writers in concurrent mode
+
+		ValueSlab() = default;
+
+		ValueSlab(const ValueSlab &) = delete;
+
+		~ValueSlab() {  // The table destroys the values first
+			for (int i = 0; i < max_chunks; i++) {
+				if (V *chunk = chunks_[i].load(std::memory_order_relaxed)) {
+					::operator delete(chunk, std::align_val_t(alignof(V)));
+				}
+			}
+		}
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::Resize(size_t new_size) -> bool {
-	size_t old_num_buckets = num_buckets_;
-	size_t old_num_stash_buckets = num_stash_buckets_;
-	Bucket *old_buckets = buckets_;
-	StashBucket *old_stash_buckets = stash_buckets_;
-	size_t new_capacity = ROUNDUP_POWER_2(new_size / Bucket::bucket_capacity);
+		// Splits a handle into its chunk and its block in the chunk
+		static auto Locate(uint32_t handle, int &chunk) -> size_t {
+			chunk = 63 - __builtin_clzll((static_cast<size_t>(handle) >> first_chunk_bits) + 1);
+			return handle - (((size_t{1} << chunk) - 1) << first_chunk_bits);
+		}
 
-	if (num_buckets_ == new_capacity) {
-		return true;
-	}
+		auto At(uint32_t handle) const -> V & {
+			int chunk;
+			size_t block = Locate(handle, chunk);
+			return chunks_[chunk].load(std::memory_order_relaxed)[block];
+		}
 
-	if (new_capacity > (1 << 16)) {
-		printf("error: table is too large\n");
-	 #ifdef __COUNT_OVERFLOWS__
-		double bucket_lf = 1.0 * (this->size() - minor_overflows - major_overflows) / BucketCapacity();
-		double stash_lf = 1.0 * (minor_overflows + major_overflows) / StashBucketCapacity();
-		printf("Bucket Load Factor: %lf\n", bucket_lf);
-		printf("Stash Bucket Load Factor: %lf\n", stash_lf);
-	 #endif
-		exit(1);
-	}
-	num_buckets_ = new_capacity;
-	num_stash_buckets_ = num_buckets_ / BUCKET_STASH_BUCKET_RATIO;
-	buckets_ = new Bucket[num_buckets_];
-	assert(buckets_ != nullptr);
-	stash_buckets_ = (num_stash_buckets_ > 0 ? new StashBucket[num_stash_buckets_] : nullptr);
+		// Same as above, for optimistic readers, which may read a handle as it is being written: null if the handle
+		// does not point into any chunk
+		auto TryAt(uint32_t handle) const -> const V * {
+			int chunk;
+			size_t block = Locate(handle, chunk);
+			V *blocks = chunk < max_chunks ? chunks_[chunk].load(std::memory_order_acquire) : nullptr;
+			return blocks != nullptr ? &blocks[block] : nullptr;
+		}
 
-	for (size_t i = 0; i < old_num_buckets; i++) {  // Iterate over normal buckets and rehash the keys
-		for (auto j = 0; j < Bucket::bucket_capacity; j++) {
-			if (!GET_BIT(old_buckets[i].validity_, j)) {
-				continue;
+		// Constructs a value (from `InPlace` arguments, or from another value) in a free block
+		template <class Value>
+		auto New(Value &&value) -> uint32_t {
+			uint32_t handle = Allocate();
+			try {
+				if constexpr (IsInPlace<std::decay_t<Value>>::value) {
+					std::apply([this, handle](auto &&...args) {
+						::new (static_cast<void *>(&At(handle))) V(std::forward<decltype(args)>(args)...);
+					}, std::move(value.args_));
+				} else {
+					::new (static_cast<void *>(&At(handle))) V(std::forward<Value>(value));
+				}
+			} catch (...) {
+				Free(handle);
+				throw;
 			}
-			auto &key = old_buckets[i].tuples_[j].key;
-			auto &value = old_buckets[i].tuples_[j].value;
-			if (!Append(std::move(key), std::move(value), H1()(key), H2()(key))) {
-				goto resize_failed;
+			return handle;
+		}
+
+		void Delete(uint32_t handle) {
+			std::destroy_at(&At(handle));
+			Free(handle);
+		}
+
+		// Hands out blocks 0 to `n - 1` of an empty slab at once, unconstructed
+		void Reserve(size_t n) {
+			assert(size_ == 0 && free_.empty());
+			if (n > max_blocks) {
+				throw std::length_error("DleftFpStash: value slab is full");
 			}
+			for (size_ = 0; size_ < n; size_ += size_t{1} << first_chunk_bits) {
+				AllocateChunk(size_);
+			}
+			size_ = n;
 		}
-	}
-	for (size_t i = 0; i < old_num_stash_buckets; i++) {  // Iterate over stash buckets and rehash the keys
-		for (auto j = 0; j < StashBucket::bucket_capacity; j++) {
-			if (!GET_BIT_256(old_stash_buckets[i].validity_, j)) {
-				continue;
+
+		// Takes a block back, unconstructed
+		void Free(uint32_t handle) {
+			if (concurrent) {
+				lock_.Lock();
 			}
-			auto &key = old_stash_buckets[i].tuples_[j].key;
-			auto &value = old_stash_buckets[i].tuples_[j].value;
-			if (!Append(std::move(key), std::move(value), H1()(key), H2()(key))) {
-				goto resize_failed;
+			free_.push_back(handle);
+			if (concurrent) {
+				lock_.Unlock();
 			}
 		}
-	}
 
-	delete old_buckets;
-	delete old_stash_buckets;
-	
-	return true;
+		// Forgets every block; the chunks are kept for reuse
+		void Clear() {
+			free_.clear();
+			size_ = 0;
+		}
 
- resize_failed:  // If any insertion fails, resize fails
- 	delete buckets_;
-	delete stash_buckets_;
+		auto Bytes() const -> size_t {
+			size_t bytes = free_.capacity() * sizeof(uint32_t);
+			for (int i = 0; i < max_chunks; i++) {
+				if (chunks_[i].load(std::memory_order_relaxed) != nullptr) {
+					bytes += (size_t{1} << (first_chunk_bits + i)) * sizeof(V);
+				}
+			}
+			return bytes;
+		}
 
-	num_buckets_ = old_num_buckets;
-	num_stash_buckets_ = old_num_stash_buckets;
-	buckets_ = old_buckets;
-	stash_buckets_ = old_stash_buckets;
+	 private:
+		auto Allocate() -> uint32_t {
+			if (concurrent) {
+				lock_.Lock();
+			}
+			uint32_t handle;
+			if (!free_.empty()) {
+				handle = free_.back();
+				free_.pop_back();
+			} else if (size_ < max_blocks) {
+				AllocateChunk(size_);
+				handle = static_cast<uint32_t>(size_++);
+			} else {
+				if (concurrent) {
+					lock_.Unlock();
+				}
+				throw std::length_error("DleftFpStash: value slab is full");
+			}
+			if (concurrent) {
+				lock_.Unlock();
+			}
+			return handle;
+		}
 
-	return false;
-}
+		// Allocates the chunk of a block, unless it is allocated already
+		void AllocateChunk(size_t handle) {
+			int chunk;
+			Locate(static_cast<uint32_t>(handle), chunk);
+			if (chunks_[chunk].load(std::memory_order_relaxed) == nullptr) {
+				size_t bytes = (size_t{1} << (first_chunk_bits + chunk)) * sizeof(V);
+				chunks_[chunk].store(static_cast<V *>(::operator new(bytes, std::align_val_t(alignof(V)))),
+														 std::memory_order_release);
+			}
+		}
+	};
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::Bucket::Insert(K &&key, V &&value, uint32_t hash, StashBucket *stash_bucket) -> bool {
-	TupleStatus status;
-	int mask;
-	uint8_t idx, pos;
+	// Destroys the values in the slab, before the table is cleared or destroyed; the caller must hold all locks
+	void DestroyValues() {
+		if constexpr (slab_value && !std::is_trivially_destructible<V>::value) {
+			auto destroy = [this](const K &, StoredValue &handle) { std::destroy_at(&slab_.At(handle)); };
+			ForEachIn(destroy, 0, 1);
+		}
+	}
 
-	pos = FindPos(key, hash, stash_bucket, status);
-	switch (status) {  // If found a duplicate, overwrite it
-	 case TupleStatus::IN_BUCKET:
-		tuples_[pos].value = value;
-		return true;
+	// Wraps a callback of `for_each`, which takes values, to take what slots hold
+	template <class Fn>
+	auto ValueFn(Fn &fn) {
+		if constexpr (slab_value) {
+			return [this, &fn](const K &key, StoredValue &handle) { fn(key, slab_.At(handle)); };
+		} else {
+			return [&fn](const K &key, V &value) { fn(key, value); };
+		}
+	}
 
-	 case TupleStatus::MINOR_OVERFLOW:
-	 	stash_bucket->tuples_[overflow_pos_[pos]].value = value;
-		return true;
+	enum class InsertStatus { INSERTED, EXISTED, FAILED };
 
-	 UNLIKELY( case TupleStatus::MAJOR_OVERFLOW: )
-	 	stash_bucket->tuples_[stash_bucket->position_[pos]].value = value;
-		return true;
+	// Check for duplicate key in a bucket; If found, return `true` and overwrite the value if `upsert`
+	template<bool upsert = true, class Value>
+	auto CheckDuplicate(const LookupKey &, Value &&, idx_t, uint32_t) -> bool;
 
-	 default:  // Otherwise find an empty slot and insert
-	 	assert(status == TupleStatus::NOT_FOUND);
-	  return Append(std::forward<K>(key), std::forward<V>(value), hash, stash_bucket);
-	}
-}
+	// Try to insert a kv pair into bucket, without duplicate check
+	template <class Value>
+	auto TryInsert(StoredKey &&, Value &&, idx_t, uint32_t) -> bool;
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::Bucket::Append(K &&key, V &&value, uint32_t hash, StashBucket *stash_bucket) -> bool {
-	int mask;
-	uint8_t idx, pos;
+	// Try to move one key in a bucket to its alternative bucket
+	// Returns the index of the moved key; If no key can be moved, return `invalid_pos`
+	auto OneMove(idx_t) -> uint8_t;
 
-	pos = __builtin_ctz(~validity_);
-	if (pos < bucket_capacity) {  // If bucket has a free slot, insert there
-		InsertAt(std::forward<K>(key), std::forward<V>(value), pos, hash);
-		return true;
-	}  // Otherwise insert into the stash bucket
+	// Searches breadth-first for the shortest chain of at most `max_moves` moves that frees a slot in one of the
+	// `n` full candidate buckets `idxs`, each move taking a key from a full bucket to another of its candidates, and
+	// the last one to a bucket with a free slot; then makes the moves, from the last one back
+	// Returns the slot freed, and sets `choice` to its bucket's index in `idxs` and `length` to the number of moves;
+	// returns `invalid_pos` if there is no such chain among the first `displacement_search_size` buckets searched
+	// The caller must hold all locks in concurrent mode, as the chain may go through any bucket
+	auto Displace(const idx_t *, int, int &choice, int &length) -> uint8_t;
 
-	if (stash_bucket == nullptr) {
-		return false;
-	}
+	// Longest chain of moves searched for by `Displace` (see `DleftPolicy`)
+	static constexpr int max_moves = Policy::max_moves;
 
-	if (LIKELY( GetMinorOverflowCount() < max_minor_overflows )) {  // Insert as a minor overflow
-		pos = stash_bucket->InsertMinorOverflow(std::forward<K>(key), std::forward<V>(value));
-		if (pos == StashBucket::invalid_pos) {
-			return false;
-		}
+	static_assert(max_moves <= DleftStats::max_path_length, "path lengths are counted up to `max_path_length`");
 
-		// Insert minor overflow metadata
-		idx = __builtin_ctz(~GetMinorOverflowValidity());
-		overflow_count_++;
-		overflow_fp_[idx] = FINGERPRINT16(hash);
-		overflow_pos_[idx] = pos;
-		SET_BIT(overflow_info_, idx);
-		DEBUG_DLEFT(
-			printf("Minor overflow from bucket %ld to stash bucket %ld\n",
-					 	 this - reinterpret_cast<Bucket *>(buckets),
-					 	 stash_bucket - reinterpret_cast<StashBucket *>(stash_buckets));
-		)
+	// Maximum number of full buckets `Displace` searches through; 256 buckets of 16 keys cover every chain of 2
+	// moves, and a sample of longer ones
+	static constexpr int displacement_search_size = 256;
 
-		return true;
-	}
+	// Inserts a key into the hash table; If a duplicate is found, the value is overwritten
+	// Returns `INSERTED` if insertion was successful, `EXISTED` if a duplicate key is found,
+	// and `FAILED` if the insertion failed (e.g. when running out of space)
+	// template argument `upsert` defines whether to overwrite duplicates
+	template<bool upsert = true, class Value>
+  auto Insert(K &&, Value &&, uint32_t, uint32_t) -> InsertStatus;
 
-	// Minor overflow slots used up; Insert as a major overflow
-	if (stash_bucket->AppendMajorOverflow(std::forward<K>(key), std::forward<V>(value), hash)) {
-		overflow_count_++;
-		DEBUG_DLEFT(
-			printf("Major overflow from bucket %ld to stash bucket %ld\n",
-					 	 this - reinterpret_cast<Bucket *>(buckets),
-					 	 stash_bucket - reinterpret_cast<StashBucket *>(stash_buckets));
-		)
-		return true;
-	}
-	return false;
-}
+	// Inserts a key into the hash table without duplicate checks; a variable-length key is in the arena already
+	// Returns `true` if insertion is successful and `false` otherwise (e.g. when running out of space)
+	template <class Value>
+	auto Append(StoredKey &&, Value &&, uint32_t, uint32_t) -> bool;
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::Bucket::Erase(const K &key, uint32_t hash, StashBucket *stash_bucket) -> bool {
-	TupleStatus status;
-	uint8_t pos;
+	// Backs the public insertions: `Insert`, growing the table until the key fits; `value` is a value or `InPlace`
+	template <bool upsert, class Value>
+	auto Emplace(K &&, Value &&) -> bool;
 
-	pos = FindPos(key, hash, stash_bucket, status);
-	switch (status) {  // Remove `key` depending on its position
-	 case TupleStatus::IN_BUCKET:
-		CLEAR_BIT(validity_, pos);
-		return true;
+	// Removes a key from the hash table
+	// Returns `true` if found and `false` otherwise
+  auto Erase(const K &, uint32_t, uint32_t) -> bool;
 
-	 case TupleStatus::MINOR_OVERFLOW:
-	 	CLEAR_BIT_256(stash_bucket->validity_, overflow_pos_[pos]);
-	 	CLEAR_BIT(overflow_info_, pos);
-		overflow_count_--;
-		// TODO: may consider bringing back a major overflow if there is one
-		return true;
+	// Same as above, but leaves the value's block in slab mode to the caller
+	auto EraseSlot(const K &, uint32_t, uint32_t) -> bool;
 
-	 case TupleStatus::MAJOR_OVERFLOW:
-	 	CLEAR_BIT_256(stash_bucket->validity_, stash_bucket->position_[pos]);
-		stash_bucket->position_[pos] = StashBucket::invalid_pos;
-		overflow_count_--;
-		return true;
+	// Try to remove a key from a bucket (including its overflows)
+	auto TryErase(const LookupKey &, idx_t, uint32_t) -> bool;
 
-	 default:
-	 	assert(status == TupleStatus::NOT_FOUND);
-	  return false;
-	}
-}
+	// Moves overflows of a bucket back to where lookups find them sooner, as far as room allows: into free slots of
+	// the bucket, major overflows first (as they are the slowest to find), then major overflows into free minor
+	// overflow slots; the caller must hold the locks of the bucket and of its stash bucket
+	// Returns the number of overflows moved
+	auto Promote(idx_t, StashBucket *) -> size_t;
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::Bucket::Find(const K &key, V *value, uint32_t hash, const StashBucket *stash_bucket) const -> bool {
-	TupleStatus status;
-	uint8_t pos;
+	// Returns the index (in `fingerprints_` and `position_`) of a major overflow of the bucket in its stash bucket,
+	// or `invalid_pos` if there is none that surely belongs to it; stash buckets do not record which bucket their
+	// major overflows come from, so the keys are rehashed
+	auto FindOwnMajorOverflow(idx_t, const StashBucket *) const -> uint8_t;
 
-	pos = FindPos(key, hash, stash_bucket, status);
-	switch (status) {  // Store `key`'s associate value depending on its position
-	 case TupleStatus::IN_BUCKET:
-		*value = tuples_[pos].value;
-		return true;
+	// Searches for a key from the hash table (and from the old arrays, if they are being migrated)
+	// Returns `true` if found and `false` otherwise; value is stored in the second argument
+  auto Find(const K &, V *, uint32_t, uint32_t) const -> bool;
 
-	 case TupleStatus::MINOR_OVERFLOW:
-	 	*value = stash_bucket->tuples_[overflow_pos_[pos]].value;
-		return true;
-
-	 case TupleStatus::MAJOR_OVERFLOW:
-	 	*value = stash_bucket->tuples_[stash_bucket->position_[pos]].value;
-		return true;
-
-	 default:
-	 	assert(status == TupleStatus::NOT_FOUND);
-	  return false;
+	// Same as above, but stores what the key's slot holds, i.e. the value's handle in slab mode
+	auto FindStored(const K &, StoredValue *, uint32_t, uint32_t) const -> bool;
+
+	// Probes both candidate buckets of a key with the selected kernel; with `compare_key`, the key is compared
+	// with the keys of each bucket instead of its fingerprints
+	static auto Probe(const LookupKey &key, const Bucket *bucket1, const Bucket *bucket2, uint32_t hash1, uint32_t hash2)
+			-> typename Bucket::ProbeMasks {
+		typename Bucket::ProbeMasks masks;
+		if constexpr (compare_key) {
+			masks.fingerprints = bucket1->MatchSlots(key, hash1) | (bucket2->MatchSlots(key, hash2) << 16);
+			masks.overflows = bucket1->MatchOverflows(hash1) | (bucket2->MatchOverflows(hash2) << 8);
+			return masks;
+		}
+		switch (probe_kernel_) {
+		 case ProbeKernel::AVX512:
+			Bucket::ProbeAVX512(bucket1, bucket2, hash1, hash2, masks);
+			break;
+		 case ProbeKernel::AVX2:
+			Bucket::ProbeAVX2(bucket1, bucket2, hash1, hash2, masks);
+			break;
+		 default:
+			Bucket::ProbeSSE2(bucket1, bucket2, hash1, hash2, masks);
+		}
+		return masks;
 	}
-}
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::Bucket::FindPos(const K &key, uint32_t hash, const StashBucket *stash_bucket, TupleStatus &status) const -> uint8_t {
-	int mask;
-	uint8_t idx, pos;
+	static inline ProbeKernel probe_kernel_ = DetectProbeKernel();
 
-	SEARCH_8_128(FINGERPRINT8(hash), fingerprints_, mask);  // Search normal keys, filtering out unlikely slots using fingerprints
-	mask &= validity_;
-	while (mask != 0) {
-		pos = __builtin_ctz(mask);
-		if (LIKELY( tuples_[pos].key == key )) {
-			status = TupleStatus::IN_BUCKET;
-			return pos;
-		}
-	 #ifdef __COUNT_FALSE_POSITIVES__
-		false_positive++;
-	 #endif
-		mask &= ~(1 << pos);
-	}
+	// Searches for a key in the given bucket and stash bucket arrays
+	static auto FindIn(const LookupKey &, StoredValue *, uint32_t, uint32_t, Bucket *, StashBucket *, size_t, size_t,
+										 StatsShard * = nullptr) -> bool;
 
-	if (stash_bucket == nullptr) {
-		goto not_found;
-	}
+	// Same as above, but returns where the key's value is stored, or null if the key is not found
+	static auto FindValueIn(const LookupKey &, uint32_t, uint32_t, Bucket *, StashBucket *, size_t, size_t)
+			-> StoredValue *;
 
-	SEARCH_16_128(FINGERPRINT16(hash), overflow_fp_, mask);  // Search minor overflows, again using fingerprints
-	while (mask != 0) {
-		idx = __builtin_ctz(mask) / 2;
-		if (GET_BIT(overflow_info_, idx)) {
-			if (LIKELY( stash_bucket->tuples_[overflow_pos_[idx]].key == key )) {
-				status = TupleStatus::MINOR_OVERFLOW;
-				return idx;
-			}
-		 #ifdef __COUNT_FALSE_POSITIVES__
-			false_positive++;
-		 #endif
+	// Removes every key; the caller must hold all locks
+	void Clear() {
+		if constexpr (slab_value) {
+			DestroyValues();
+			slab_.Clear();
 		}
-		mask &= ~(3 << (idx * 2));
+		if (Migrating()) {  // Keys that are not migrated yet are simply dropped
+			Retire(old_buckets_, old_stash_buckets_, old_num_buckets_, old_num_stash_buckets_);
+			old_buckets_ = nullptr;
+			old_stash_buckets_ = nullptr;
+		}
+		for (size_t i = 0; i < num_buckets_; i++) {
+			buckets_[i].Clear();
+		}
+		for (size_t i = 0; i < num_stash_buckets_; i++) {
+			stash_buckets_[i].Clear();
+		}
+		RetireKeys(arena_);  // Concurrent readers may still be comparing against the old keys
+		old_arena_.Clear();
+		key_bytes_ = 0;
+		compact_keys_ = false;
+		size_ = 0;
 	}
 
-	if (UNLIKELY( overflow_count_ > GetMinorOverflowCount() )) {  // Search major overflows in stash bucket
-		idx = stash_bucket->FindMajorOverflowIdx(key, hash);
-		if (idx != StashBucket::invalid_pos) {
-			status = TupleStatus::MAJOR_OVERFLOW;
-			return idx;
+	// Runs `fn(0)`, ..., `fn(num_threads - 1)` on as many threads, the calling thread running `fn(0)`
+	template <class Fn>
+	static void RunParallel(size_t num_threads, Fn fn) {
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < num_threads; i++) {
+			threads.emplace_back(fn, i);
+		}
+		fn(0);
+		for (auto &thread : threads) {
+			thread.join();
 		}
 	}
 
- not_found:
-	status = TupleStatus::NOT_FOUND;
-	return StashBucket::invalid_pos;
-}
+	// A key-value pair passed to `build` (or a slot rehashed by `Resize`, with the key it holds), partitioned along
+	// with its hashes
+	template <class Key>
+	struct BuildEntry {
+		Key key;
+		StoredValue value;
+		uint32_t hash1;
+		uint32_t hash2;
+	};
 
-DLEFT_TEMPLATE
-void DLEFT_TYPE::Bucket::InsertAt(K &&key, V &&value, uint8_t pos, uint32_t hash) {
-	tuples_[pos].key = key;
-	tuples_[pos].value = value;
-	fingerprints_[pos] = FINGERPRINT8(hash);
-	SET_BIT(validity_, pos);
-}
+	// Places about `n` pairs into the buckets with up to `num_threads` threads, as described in `build`; `source(slice,
+	// num_slices, fn)` must call `fn(key, value)` on the pairs of a slice, in the same order every time
+	// `rehash` places the slots of the table being resized, whose keys are distinct and already in the arena; it then
+	// returns `false` if some key cannot be placed, and otherwise grows the table until every key is placed
+	template <bool rehash, class Source>
+	auto BulkPlace(Source, size_t, size_t) -> bool;
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::StashBucket::InsertMajorOverflow(K &&key, V &&value, uint32_t hash) -> bool {
-	uint8_t idx, pos;
+	// Places the pairs of `BulkPlace` whose indexes are `pending` into their first (or second) buckets, if those have
+	// room and hold no more keys than `sizes` gives for their other buckets, marking them in `done`, and returns how
+	// many new keys were placed; `pending` keeps the other pairs, along with those whose second bucket is their
+	// first, under whose hash lookups find them
+	// Variable-length keys are copied into `block`, the calling thread's own block of the arena
+	template <bool rehash, class Entry>
+	auto BuildPlace(Entry *, std::vector<size_t> &, bool, const uint8_t *, uint8_t *, KeyBlock &) -> size_t;
 
-	idx = FindMajorOverflowIdx(key, hash);
-	if (idx != invalid_pos) {  // Overwrite duplicate if found
-		tuples_[position_[idx]].value = value;
-		return true;
-	}
+	// Number of parts `build` splits the buckets into, so that each part's buckets fit in the L2 cache of large
+	// tables, while the radix partition still writes to few enough places at once
+	static constexpr size_t build_num_parts = 1024;
 
-	return AppendMajorOverflow(std::forward<K>(key), std::forward<V>(value), hash);  // Insert at an empty slot
-}
+	// Calls `fn(key, value)` on the keys in the `part`-th of `num_parts` equal slices of each bucket array, passing
+	// keys as `K` and values as slots hold them
+	template <class Fn>
+	void ForEachIn(Fn &, size_t, size_t);
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::StashBucket::AppendMajorOverflow(K &&key, V &&value, uint32_t hash) -> bool {
-	uint8_t idx, pos;
+	// Same as above, but only over the given arrays, passing keys as slots hold them
+	template <class Fn>
+	static void ForEachIn(Fn &, Bucket *, StashBucket *, size_t, size_t, size_t, size_t);
 
-	if ((pos = FindFreeSlot()) == invalid_pos) {  // No free slots, so insertion fails
-		return false;
-	}
+	// Maximum number of lookups in flight in `find_batch`
+	static constexpr size_t prefetch_batch_size = 16;
 
-	if (position_[0] == invalid_pos) {
-		idx = 0;
-	} else if (position_[1] == invalid_pos) {
-		idx = 1;
-	} else {  // Major overflow metadata used up, so insertion fails
-		return false;
-	}
+	// Thread-safe counterparts of `Insert`, `Erase` and `Find` for concurrent mode
+	template <bool upsert, class Value>
+	auto InsertConcurrent(K &&, Value &&, uint32_t, uint32_t) -> bool;
 
-	tuples_[pos].key = key;
-	tuples_[pos].value = value;
-	position_[idx] = pos;
-	fingerprints_[idx] = FINGERPRINT16(hash);
-	SET_BIT_256(validity_, pos);
- #ifdef __COUNT_OVERFLOWS__
-	major_overflows++;
- #endif
+	auto EraseConcurrent(const K &, uint32_t, uint32_t) -> bool;
 
-	return true;
-}
+	auto FindConcurrent(const K &, V *, uint32_t, uint32_t) const -> bool;
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::StashBucket::EraseMajorOverflow(const K &key, uint32_t hash) -> bool {
-	uint8_t idx = FindMajorOverflowIdx(key, hash);
-	if (idx == invalid_pos) {
-		return false;
-	}
-	CLEAR_BIT_256(validity_, position_[idx]);
-	position_[idx] = invalid_pos;
-	return true;
-}
+	// Locks the stripes of all candidate buckets, lower stripe first to avoid deadlocks
+	// Returns the number of buckets, which cannot change until they are unlocked
+	auto LockCandidates(uint32_t, uint32_t) -> size_t;
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::StashBucket::FindMajorOverflow(const K &key, V *value, uint32_t hash) const -> bool {
-	uint8_t idx = FindMajorOverflowIdx(key, hash);
-	if (idx == invalid_pos) {
-		return false;
-	}
-	if (value != nullptr) {
-		*value = tuples_[position_[idx]].value;
-	}
-	return true;
-}
+	void UnlockCandidates(uint32_t, uint32_t);
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::StashBucket::FindMajorOverflowIdx(const K &key, uint32_t hash) const -> uint8_t {
-	uint8_t idx;
+	// Gets the distinct stripes of the candidate buckets of a key in a table of `num_buckets` buckets, in
+	// increasing order; returns their number
+	static auto CandidateLocks(uint32_t, uint32_t, size_t num_buckets, size_t *) -> int;
 
-	if (position_[0] != invalid_pos && fingerprints_[0] == FINGERPRINT16(hash)) {
-		if (LIKELY( tuples_[position_[0]].key == key )) {
-			return 0;
-		}
-   #ifdef __COUNT_FALSE_POSITIVES__
-		false_positive++;
-   #endif
-	}
-	if (position_[1] != invalid_pos && fingerprints_[1] == FINGERPRINT16(hash)) {
-		if (LIKELY( tuples_[position_[1]].key == key )) {
-			return 1;
-		}
-	 #ifdef __COUNT_FALSE_POSITIVES__
-		false_positive++;
-	 #endif
-	}
-	return invalid_pos;
-}
+	// Locks every stripe, so that the caller can resize or clear the table
+	void LockAll();
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::StashBucket::InsertMinorOverflow(K &&key, V &&value) -> uint8_t {
-	uint8_t pos;
+	void UnlockAll();
 
-	// Find an empty slot and insert
-	if ((pos = FindFreeSlot()) == invalid_pos) {
-		return invalid_pos;
-	}
-	tuples_[pos].key = key;
-	tuples_[pos].value = value;
-	SET_BIT_256(validity_, pos);
- #ifdef __COUNT_OVERFLOWS__
-	minor_overflows++;
- #endif
+	// Frees bucket arrays that are no longer used; in concurrent mode, optimistic readers may still be reading them,
+	// so they are only freed by `Reclaim` once those readers are done
+	void Retire(Bucket *, StashBucket *, size_t, size_t);
 
-	return pos;
-}
+	// Same as above, for the chunks of a key arena, which is left empty
+	void RetireKeys(KeyArena &);
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::StashBucket::EraseMinorOverflow(const K &key, uint8_t pos) -> bool {
-	assert(GET_BIT_256(validity_, pos));
-	if (LIKELY( tuples_[pos].key == key )) {
-		CLEAR_BIT_256(validity_, pos);
-		return true;
-	}
-	return false;
-}
+	// Frees the memory retired at least two epochs ago, after advancing the epoch as far as readers allow: the epoch
+	// only advances once no reader of the epoch before is left, so none of the readers that may have seen memory
+	// retired in epoch `e` is left by epoch `e + 2`. Never waits, as readers may be waiting for the caller's locks;
+	// what is still in use is freed by a later call. The caller must hold `reclaim_lock_`
+	void Reclaim();
 
-DLEFT_TEMPLATE
-auto DLEFT_TYPE::StashBucket::FindMinorOverflow(const K &key, V *value, uint8_t pos) const -> bool {
-	assert(GET_BIT_256(validity_, pos));
-	if (LIKELY( tuples_[pos].key == key )) {
-		if (value != nullptr) {
-			*value = tuples_[pos].value;
+	// Calls `Reclaim` unless another thread is already doing so; writers call it after each operation for as long as
+	// memory is retired, so that memory readers held on to is freed even if no other resize follows
+	void TryReclaim() {
+		if (reclaim_lock_.TryLock()) {
+			if (!retired_.empty()) {
+				Reclaim();
+			}
+			reclaim_lock_.Unlock();
 		}
-		return true;
 	}
-	return false;
-}
 
-#ifdef __TEST_DLEFT__
+	// Allocates and constructs bucket arrays with `Allocator`; there is no stash bucket array if its size is 0
+	static auto AllocateBuckets(size_t) -> Bucket *;
+
+	static auto AllocateStashBuckets(size_t) -> StashBucket *;
+
+	// Destroys and frees bucket arrays, given their sizes (either array may be null); arrays mapped by
+	// `open_mapped` are unmapped instead
+	void FreeArrays(Bucket *, StashBucket *, size_t, size_t);
+
+	// Snapshot file layout: this header, then the bucket array and the stash bucket array, each starting at a
+	// page boundary so that the mapped arrays are as aligned as allocated ones
+	struct SnapshotHeader {
+		char magic_[8];
+		uint32_t version_;
+		uint32_t flags_;               // `buffered`, `partial_key` and the policy's `max_minor_overflows`,
+		                               // `soa_buckets` and `num_choices`, which change where keys are
+		uint64_t tuple_size_;
+		uint64_t bucket_size_;
+		uint64_t stash_bucket_size_;
+		uint64_t hash_check_;          // hashes of a default key, to tell apart tables using other hashers
+		uint64_t num_buckets_;
+		uint64_t num_stash_buckets_;
+		uint64_t size_;
+	};
 
-#include "xxhash.h"
-#include <map>
+	static constexpr char snapshot_magic[8] = "DLEFTFP";
 
-class DleftTest {
- public:
- 	static void RunAllTests() {
-		TestStashBucket();
-    TestBucket();
-    TestDleft();
+	static constexpr uint32_t snapshot_version = 1;
+
+	static constexpr size_t snapshot_alignment = 4096;
+
+	// Get a header describing this table type, without its geometry
+	static auto SnapshotType() -> SnapshotHeader;
+
+	static auto SnapshotStashBucketsOffset(size_t num_buckets) -> size_t {
+		return snapshot_alignment + ROUND_UP(num_buckets * sizeof(Bucket), snapshot_alignment) * snapshot_alignment;
 	}
- private:
-	static constexpr uint32_t seed1 = 0x5d445e6e;
-	static constexpr uint32_t seed2 = 0xf09ad611;
 
-	template<class K, uint64_t seed>
-	class Hasher {
-	public:
-		auto operator()(const K &key) const -> uint32_t {
-			return XXH32(&key, sizeof(K), seed);
-		}
+	// Snapshots mapped by `open_mapped`, whose arrays are still in use
+	struct Mapping {
+		void *addr;
+		size_t size;
 	};
 
-	using Hasher1 = Hasher<uint32_t, seed1>;
-	using Hasher2 = Hasher<uint32_t, seed2>;
+	std::vector<Mapping> mappings_;
 
-	using DleftType = DleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2>;
+	static auto LockIndex(idx_t idx) -> size_t { return idx & (num_locks - 1); }
 
-	static void TestStashBucket() {
-    TestStashBucketInsertMinorOverflow();
-    TestStashBucketEraseMinorOverflow();
-    TestStashBucketFindMinorOverflow();
+	static auto StashLockIndex(size_t stash_idx) -> size_t { return stash_idx & (num_stash_locks - 1); }
 
-    TestStashBucketAppendMajorOverflow();
-    TestStashBucketEraseMajorOverflow();
-    TestStashBucketFindMajorOverflow();
-    TestStashBucketInsertMajorOverflow();
-  }
+	static constexpr size_t num_locks = 1 << 14;
 
-  static void TestBucket() {
-    TestBucketAppend();
-    TestBucketErase();
-    TestBucketFind();
+	static constexpr size_t num_stash_locks = 1 << 8;
 
-    TestBucketAppendWithOverflow();
-    TestBucketEraseWithOverflow();
-    TestBucketFindWithOverflow();
-    TestBucketInsertWithOverflow();
-  }
+	// Resize the table; may fail if the new size is smaller than current size
+	// Returns `true` if resize is successful and false otherwise
+	// With more than one thread, the keys are rehashed in parallel by `BulkPlace`
+	auto Resize(size_t, size_t num_threads = 1) -> bool;
 
-  static void TestDleft() {
-    TestDleftAppend();
-    TestDleftErase();
-    TestDleftFind();
-    TestDleftInsert();
-    TestDleftResize();
+	// Makes room after an insertion failure: resizes the table at once, or in incremental mode, starts
+	// migrating to larger arrays (or finishes the ongoing migration, which frees up its old buckets)
+	void Grow();
 
-		TestDleftFalsePositives();
-		TestDleftMaxLoadFactor();
-  }
+	// Halves the table once removals bring it below `shrink_size_`, the same way as `Grow` doubles it; the caller
+	// must hold all locks
+	void Shrink();
 
-  static void TestStashBucketInsertMinorOverflow() {
-    printf("[TEST STASH BUCKET INSERT MINOR OVERFLOW]\n");
+	// Sets `shrink_size_` from `shrink_load_factor_` and the current capacity
+	void UpdateShrinkSize() { shrink_size_ = static_cast<size_t>(capacity() * shrink_load_factor_); }
 
-    DleftType::StashBucket bucket;
+	// Allocates larger arrays and makes the current ones the old arrays, to be migrated bucket by bucket
+	void StartMigration(size_t);
 
-    for (int i = 0; i < bucket.bucket_capacity; i++) {
-      assert(bucket.InsertMinorOverflow(i, i) != bucket.invalid_pos);
-    }
-    assert(bucket.InsertMinorOverflow(2023u, 2023u) == bucket.invalid_pos);
+	// Migrates all old candidate buckets of a key, so that the key can only be in the new arrays
+	void MigrateKey(uint32_t, uint32_t);
 
-    printf("[PASSED]\n");
-  }
+	// Migrates the next `n` old buckets; frees the old arrays once all of them are migrated
+	void Migrate(size_t);
 
-  static void TestStashBucketEraseMinorOverflow() {
-    printf("[TEST STASH BUCKET ERASE MINOR OVERFLOW]\n");
+	// Moves every key of an old bucket, including its overflows, into the new arrays
+	void MigrateBucket(idx_t);
 
-    DleftType::StashBucket bucket;
-    uint8_t pos[bucket.bucket_capacity];
+	void FinishMigration() { Migrate(old_num_buckets_); }
 
-    for (int i = 0; i < bucket.bucket_capacity; i++) {
-      pos[i] = bucket.InsertMinorOverflow(i, i);
-      assert(pos[i] != bucket.invalid_pos);
-    }
+	auto Migrating() const -> bool { return incremental && old_buckets_ != nullptr; }
 
-    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
-      assert(!bucket.EraseMinorOverflow(i+1, pos[i]));
-      assert(bucket.EraseMinorOverflow(i, pos[i]));
-    }
+	// Number of old buckets migrated by every insertion or removal; since the table grows when it is nearly
+	// full, migrating one bucket (16 keys) per insertion finishes long before the new arrays fill up
+	static constexpr size_t migration_batch_size = 1;
 
-    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
-      assert(bucket.InsertMinorOverflow(i, i) != bucket.invalid_pos);
-    }
+	auto BucketCapacity() const -> size_t { return Bucket::bucket_capacity * num_buckets_; }
 
-    printf("[PASSED]\n");
-  }
+	auto StashBucketCapacity() const -> size_t { return StashBucket::bucket_capacity * num_stash_buckets_; }
 
-  static void TestStashBucketFindMinorOverflow() {
-    printf("[TEST STASH BUCKET FIND MINOR OVERFLOW]\n");
+	// The lowest 16 bits of a hash are fingerprints, and the bits above them index the bucket; past 65,536
+	// buckets, the index takes the extra bits from the top of the 16-bit fingerprint instead, which only weakens
+	// the fingerprints of overflows (those of in-bucket keys stay intact up to 2^24 buckets)
+	static auto BucketIdx(uint32_t hash, size_t num_buckets) -> idx_t {
+		return (hash >> std::min(16, 32 - __builtin_ctzll(num_buckets))) & (num_buckets - 1);
+	}
 
-    DleftType::StashBucket bucket;
-    uint8_t pos[bucket.bucket_capacity];
+	// In partial-key mode, the second hash is the first one with its index bits XORed with an offset derived
+	// from the 8-bit fingerprint; both candidate buckets then store the same fingerprints, and since
+	// `BucketIdx` is linear in XOR, each of them can be computed from the other and the fingerprint
+	static auto Hash2(const K &key, uint32_t hash1) -> uint32_t {
+		return partial_key ? hash1 ^ AltOffset(FINGERPRINT8(hash1)) : H2()(key);
+	}
 
-    for (int i = 0; i < bucket.bucket_capacity; i++) {
-      pos[i] = bucket.InsertMinorOverflow(i, i);
-      assert(pos[i] != bucket.invalid_pos);
-    }
+	// Only sets bits above the 16 fingerprint bits, so that the fingerprints of both hashes stay the same
+	static auto AltOffset(uint8_t fp) -> uint32_t { return ((fp + 1u) * 0x5bd1e995u) & 0xffff0000u; }
 
-    for (int i = 0; i < bucket.bucket_capacity; i++) {
-      uint32_t value;
-      assert(!bucket.FindMinorOverflow(i+1, &value, pos[i]));
-      assert(bucket.FindMinorOverflow(i, &value, pos[i]));
-      assert(value == i);
-    }
+	// Hash of the `i`-th candidate bucket of a key; past the first two, it is derived from them by double hashing
+	static auto ChoiceHash(uint32_t hash1, uint32_t hash2, int i) -> uint32_t {
+		return i == 0 ? hash1 : i == 1 ? hash2 : hash1 + static_cast<uint32_t>(i) * hash2;
+	}
 
-    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
-      assert(bucket.EraseMinorOverflow(i, pos[i]));
-    }
+	// Gets the distinct candidate buckets of a key and their hashes, in order of choice, and returns their number.
+	// When candidates coincide, the bucket stores the key under the hash of the first one, which is the only one
+	// lookups use.
+	static auto Candidates(uint32_t hash1, uint32_t hash2, size_t num_buckets, uint32_t *hashes, idx_t *idxs) -> int {
+		hashes[0] = hash1;
+		idxs[0] = BucketIdx(hash1, num_buckets);
+		int n = 1;
+		for (int i = 1; i < num_choices; i++) {
+			uint32_t hash = ChoiceHash(hash1, hash2, i);
+			idx_t idx = BucketIdx(hash, num_buckets);
+			bool repeated = false;
+			for (int j = 0; j < n; j++) {
+				repeated |= idxs[j] == idx;
+			}
+			if (!repeated) {
+				hashes[n] = hash;
+				idxs[n++] = idx;
+			}
+		}
+		return n;
+	}
 
-    for (int i = bucket.bucket_capacity - 2; i >= 0; i -= 2) {
-      uint32_t value;
-      pos[i] = bucket.InsertMinorOverflow(i, i*2);
-      assert(pos[i] != bucket.invalid_pos);
-      assert(bucket.FindMinorOverflow(i, &value, pos[i]));
-      assert(value == i*2);
-    }
+	// Throws if a table of `num_buckets` buckets cannot be indexed by `idx_t`
+	static void CheckNumBuckets(size_t num_buckets) {
+		if (num_buckets - 1 > std::numeric_limits<idx_t>::max()) {
+			throw std::length_error("DleftFpStash: table is too large");
+		}
+	}
 
-    printf("[PASSED]\n");
-  }
+	static auto GetStride(idx_t idx) -> size_t { return static_cast<size_t>(idx) * idx + 7 * idx + 457; }
 
-  static void TestStashBucketAppendMajorOverflow() {
+	size_t num_buckets_;
+
+	size_t num_stash_buckets_;
+
+	std::conditional_t<concurrent, std::atomic<size_t>, size_t> size_{0};
+
+	size_t overflow_count_{0};
+
+	Bucket *buckets_;
+
+	StashBucket *stash_buckets_;
+
+	// Striped locks over buckets and stash buckets (concurrent mode only)
+	VersionLock *locks_{nullptr};
+
+	VersionLock *stash_locks_{nullptr};
+
+	// Held (along with all stripes) while the table is resized or cleared, so that readers can tell
+	// whether they have read a consistent table geometry
+	VersionLock resize_lock_;
+
+	// Set while a writer holds every lock, so that it does not try to take any of them again
+	bool all_locked_{false};
+
+	size_t resize_threads_{1};
+
+	// See `set_shrink_load_factor`; `shrink_size_` is the size below which a removal halves the table, read by
+	// removals without locking in concurrent mode
+	double shrink_load_factor_{0};
+
+	std::conditional_t<concurrent, std::atomic<size_t>, size_t> shrink_size_{0};
+
+	// Bytes of variable-length keys (unused otherwise), and the lock of concurrent writers copying into it
+	KeyArena arena_;
+
+	VersionLock arena_lock_;
+
+	// Bytes of the keys in `arena_`, and whether erased keys take enough of it to compact the keys
+	std::conditional_t<concurrent, std::atomic<size_t>, size_t> key_bytes_{0};
+
+	std::conditional_t<concurrent, std::atomic<bool>, bool> compact_keys_{false};
+
+	// Bytes of the keys in the old arrays while migrating; freed along with the old arrays
+	KeyArena old_arena_;
+
+	// Values in slab mode (unused otherwise)
+	std::conditional_t<slab_value, ValueSlab, char> slab_;
+
+	// Memory retired in concurrent mode and not freed yet: bucket arrays replaced by `Resize` (or emptied chunks of
+	// the key arena, with null arrays), in the order they were retired
+	struct Retired {
+		uint64_t epoch;  // `epoch_` when retired
+		Bucket *buckets;
+		StashBucket *stash_buckets;
+		size_t num_buckets;
+		size_t num_stash_buckets;
+		std::unique_ptr<KeyArena> keys;
+	};
+
+	std::vector<Retired> retired_;
+
+	std::atomic<size_t> retired_bytes_{0};
+
+	// Held while adding to or freeing `retired_`, which writers also do without holding all locks
+	VersionLock reclaim_lock_;
+
+	// Advanced by `Reclaim`, and read by readers as they start (concurrent mode only)
+	std::atomic<uint64_t> epoch_{0};
+
+	// `num_reader_shards` shards of reader counts in concurrent mode, null otherwise
+	ReaderShard *reader_shards_{nullptr};
+
+	// `num_stats_shards` shards of counters with `with_stats`, null otherwise
+	StatsShard *stats_shards_{nullptr};
+
+	// Arrays being migrated by an incremental resize; `old_buckets_` is null when no migration is going on
+	Bucket *old_buckets_{nullptr};
+
+	StashBucket *old_stash_buckets_{nullptr};
+
+	size_t old_num_buckets_{0};
+
+	size_t old_num_stash_buckets_{0};
+
+	// Old buckets before this one are migrated (those after it may be too, if they were a key's candidate)
+	size_t migrate_idx_{0};
+
+	static_assert(!(concurrent && incremental), "incremental resizing is not supported in concurrent mode");
+
+#ifdef __TEST_DLEFT__
+	friend class DleftTest;
+#endif
+};
+
+// Tables in a single mode, with any policy, so that their types need not spell out every flag before the policy:
+// `PolicyDleftFpStash` in none of the modes, and the others each in the mode of the flag they are named after
+template <class K, class V, class H1, class H2, class Policy = DleftPolicy<>>
+using PolicyDleftFpStash = DleftFpStash<K, V, H1, H2, false, false, false, false, AlignedAllocator, Policy>;
+
+template <class K, class V, class H1, class H2, class Policy = DleftPolicy<>>
+using BufferedDleftFpStash = DleftFpStash<K, V, H1, H2, true, false, false, false, AlignedAllocator, Policy>;
+
+template <class K, class V, class H1, class H2, class Policy = DleftPolicy<>>
+using ConcurrentDleftFpStash = DleftFpStash<K, V, H1, H2, false, true, false, false, AlignedAllocator, Policy>;
+
+template <class K, class V, class H1, class H2, class Policy = DleftPolicy<>>
+using IncrementalDleftFpStash = DleftFpStash<K, V, H1, H2, false, false, true, false, AlignedAllocator, Policy>;
+
+template <class K, class V, class H1, class H2, class Policy = DleftPolicy<>>
+using PartialKeyDleftFpStash = DleftFpStash<K, V, H1, H2, false, false, false, true, AlignedAllocator, Policy>;
+
+#define DLEFT_TEMPLATE \
+	template <class K, class V, class H1, class H2, bool buffered, bool concurrent, bool incremental, bool partial_key, \
+						class Allocator, class Policy, bool with_stats>
+#define DLEFT_TYPE DleftFpStash<K, V, H1, H2, buffered, concurrent, incremental, partial_key, Allocator, Policy, with_stats>
+
+DLEFT_TEMPLATE
+DLEFT_TYPE::DleftFpStash(size_t size)
+		: num_buckets_(ROUNDUP_POWER_2(size / Bucket::bucket_capacity)),
+			num_stash_buckets_(num_buckets_ / Policy::stash_ratio) {
+	CheckNumBuckets(num_buckets_);
+
+	buckets = buckets_ = AllocateBuckets(num_buckets_);
+	stash_buckets = stash_buckets_ = AllocateStashBuckets(num_stash_buckets_);
+
+	if (concurrent) {
+		locks_ = new VersionLock[num_locks];
+		stash_locks_ = new VersionLock[num_stash_locks];
+		reader_shards_ = new ReaderShard[num_reader_shards];
+	}
+	if (with_stats) {
+		stats_shards_ = new StatsShard[num_stats_shards];
+	}
+}
+
+DLEFT_TEMPLATE
+DLEFT_TYPE::~DleftFpStash() {
+	DestroyValues();
+	FreeArrays(buckets_, stash_buckets_, num_buckets_, num_stash_buckets_);
+	FreeArrays(old_buckets_, old_stash_buckets_, old_num_buckets_, old_num_stash_buckets_);
+	for (auto &retired : retired_) {
+		FreeArrays(retired.buckets, retired.stash_buckets, retired.num_buckets, retired.num_stash_buckets);
+	}
+	delete[] locks_;
+	delete[] stash_locks_;
+	delete[] reader_shards_;
+	delete[] stats_shards_;
+}
+
+DLEFT_TEMPLATE
+template<bool upsert, class Value>
+auto DLEFT_TYPE::CheckDuplicate(const LookupKey &key, Value &&value, idx_t idx, uint32_t hash) -> bool {
+	using TupleStatus = typename Bucket::TupleStatus;
+	Bucket *bucket = &buckets_[idx];
+	TupleStatus status;
+	StashBucket *stash_bucket = nullptr;
+	uint8_t pos;
+
+	if (stash_buckets_ != nullptr && bucket->overflow_count_ > 0) {
+		stash_bucket = &stash_buckets_[bucket->GetStashBucketIndex(idx, num_stash_buckets_)];
+	}
+	StashGuard guard(this, stash_bucket);
+
+	pos = bucket->FindPos(key, hash, stash_bucket, status, ThreadStats());
+	if (status == TupleStatus::IN_BUCKET) {
+		if (upsert) {
+			AssignValue(bucket->tuples_[pos].value, std::forward<Value>(value));
+		}
+		return true;
+	} else if (status == TupleStatus::MINOR_OVERFLOW) {
+		if (upsert) {
+			AssignValue(stash_bucket->tuples_[bucket->overflow_pos_[pos]].value, std::forward<Value>(value));
+		}
+		return true;
+	} else if (UNLIKELY( status == TupleStatus::MAJOR_OVERFLOW )) {
+		if (upsert) {
+			AssignValue(stash_bucket->tuples_[stash_bucket->position_[pos]].value, std::forward<Value>(value));
+		}
+		return true;
+	}
+	return false;
+}
+
+DLEFT_TEMPLATE
+template <class Value>
+auto DLEFT_TYPE::TryInsert(StoredKey &&key, Value &&value, idx_t idx, uint32_t hash) -> bool {
+	Bucket *bucket = &buckets_[idx];
+	StashBucket *stash_bucket = nullptr;
+
+	if (bucket->overflow_count_ == 0) {  // No stash bucket yet
+		if (bucket->Append(std::forward<StoredKey>(key), std::forward<Value>(value), hash, nullptr)) {
+			size_++;
+			return true;
+		}  // Bucket is full; need a stash bucket
+		if (stash_buckets_ == nullptr) {  // No usable stash bucket, so insertion fails
+			return false;
+		}
+
+		size_t stash_idx = (idx / Policy::stash_ratio) & (num_stash_buckets_ - 1);
+		uint8_t min_stash_num = 0;
+		uint8_t min_stash_size = 0xff;
+		for (uint8_t stash_num = 0; stash_num < 4; stash_num++) {  // Bind bucket to its most underfull candidate stash bucket
+			stash_idx = (stash_idx + GetStride(idx)) & (num_stash_buckets_ - 1);
+			StashGuard guard(this, &stash_buckets_[stash_idx]);
+			uint8_t size = stash_buckets_[stash_idx].GetSize();
+			if (size < min_stash_size) {
+				min_stash_num = stash_num;
+				min_stash_size = size;
+			}
+		}
+		bucket->SetStashBucketNum(min_stash_num);
+		assert(bucket->GetStashBucketNum() == min_stash_num);
+		DEBUG_DLEFT(
+			printf("Bucket %u bound with stash bucket %lu(%d)\n", idx,
+						 bucket->GetStashBucketIndex(idx, num_stash_buckets_), min_stash_num);
+		)
+	}
+
+	// Retry insertion with stash bucket
+	assert(stash_buckets_ != nullptr);
+	stash_bucket = &stash_buckets_[bucket->GetStashBucketIndex(idx, num_stash_buckets_)];
+	StashGuard guard(this, stash_bucket);
+	uint8_t overflow_count = bucket->overflow_count_, minor_overflow_count = bucket->GetMinorOverflowCount();
+	if (bucket->Append(std::forward<StoredKey>(key), std::forward<Value>(value), hash, stash_bucket)) {
+		if (bucket->overflow_count_ > overflow_count) {  // Not placed in the bucket, where a slot may have been freed
+			Count(ThreadStats(), bucket->GetMinorOverflowCount() > minor_overflow_count ? minor_overflows : major_overflows);
+		}
+		size_++;
+		return true;
+	}
+	return false;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::OneMove(idx_t idx) -> uint8_t {
+	Bucket *bucket = &buckets_[idx];
+
+	// @note Computing (potentially) two hashes for each key seems a bit expensive here;
+	//       We should consider using one additional bit for each key to indicate which hash
+	//       function to use, or simply store the other hash as fingerprint (in which case
+	//       the distance between the two buckets must be limited).
+	//       (Edit: in partial-key mode, the fingerprint is enough to find the other bucket)
+	assert(bucket->GetSize() == Bucket::bucket_capacity);
+	// Moves the key in slot `i` to another of its candidate buckets, if it has free space
+	auto move_to = [&](int i, idx_t alt_idx, uint32_t hash) -> bool {
+		if (UNLIKELY( alt_idx == idx )) {
+			return false;
+		}
+		// In concurrent mode, the stripe of `alt_bucket` must be locked too; it is only tried, since waiting for it
+		// while holding other stripes may deadlock
+		VersionLock *alt_lock = nullptr;
+		if (concurrent && !all_locked_ && LockIndex(alt_idx) != LockIndex(idx)) {
+			alt_lock = &locks_[LockIndex(alt_idx)];
+			if (!alt_lock->TryLock()) {
+				return false;
+			}
+		}
+		Bucket *alt_bucket = &buckets_[alt_idx];
+		if (alt_bucket->GetSize() == Bucket::bucket_capacity) {
+			if (alt_lock != nullptr) {
+				alt_lock->Unlock();
+			}
+			return false;
+		}  // `alt_bucket` has free space, so move the key there
+		alt_bucket->Append(std::move(bucket->tuples_[i].key), std::move(bucket->tuples_[i].value), hash, nullptr);
+		if (alt_lock != nullptr) {
+			alt_lock->Unlock();
+		}
+		return true;
+	};
+	for (int i = 0; i < Bucket::bucket_capacity; i++) {
+		if (partial_key) {  // The key keeps its fingerprint, which is all `Append` needs without a stash bucket
+			if (move_to(i, idx ^ BucketIdx(AltOffset(bucket->fingerprints_[i]), num_buckets_), bucket->fingerprints_[i])) {
+				return static_cast<uint8_t>(i);
+			}
+			continue;
+		}
+		auto &&key = View(bucket->tuples_[i].key, arena_);
+		uint32_t hash1 = H1()(key);
+		if (num_choices == 2 && BucketIdx(hash1, num_buckets_) != idx) {  // The key is in its second bucket
+			if (move_to(i, BucketIdx(hash1, num_buckets_), hash1)) {
+				return static_cast<uint8_t>(i);
+			}
+			continue;
+		}
+		uint32_t hashes[num_choices];
+		idx_t idxs[num_choices];
+		int n = Candidates(hash1, H2()(key), num_buckets_, hashes, idxs);
+		for (int j = 0; j < n; j++) {
+			if (move_to(i, idxs[j], hashes[j])) {
+				return static_cast<uint8_t>(i);
+			}
+		}
+	}
+	return StashBucket::invalid_pos;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::Displace(const idx_t *idxs, int n, int &choice, int &length) -> uint8_t {
+	// A full bucket reached by the search; the first `n` are the candidate buckets, and each other one is reached by
+	// moving the key in slot `parent_slot` of its parent there, under `hash`
+	struct Node {
+		idx_t idx;
+		int16_t parent;
+		uint8_t parent_slot;
+		uint8_t depth;
+		uint32_t hash;
+	};
+	Node nodes[displacement_search_size];
+	int num_nodes = n;
+	for (int i = 0; i < n; i++) {
+		nodes[i] = {idxs[i], -1, 0, 0, 0};
+	}
+
+	for (int head = 0; head < num_nodes; head++) {
+		const Node &node = nodes[head];
+		Bucket *bucket = &buckets_[node.idx];
+		for (int i = 0; i < Bucket::bucket_capacity; i++) {
+			uint32_t hashes[num_choices];
+			idx_t alt_idxs[num_choices];
+			int num_alts;
+			if (partial_key) {  // The key keeps its fingerprint, as in `OneMove`
+				hashes[0] = bucket->fingerprints_[i];
+				alt_idxs[0] = node.idx ^ BucketIdx(AltOffset(bucket->fingerprints_[i]), num_buckets_);
+				num_alts = 1;
+			} else {
+				auto &&key = View(bucket->tuples_[i].key, arena_);
+				uint32_t hash1 = H1()(key);
+				num_alts = Candidates(hash1, H2()(key), num_buckets_, hashes, alt_idxs);
+			}
+
+			for (int j = 0; j < num_alts; j++) {
+				idx_t alt_idx = alt_idxs[j];
+				if (alt_idx == node.idx) {
+					continue;
+				}
+				Bucket *alt_bucket = &buckets_[alt_idx];
+				if (alt_bucket->GetSize() < Bucket::bucket_capacity) {  // Found a chain; make its moves from the last one
+					alt_bucket->Append(std::move(bucket->tuples_[i].key), std::move(bucket->tuples_[i].value), hashes[j],
+														 nullptr);
+					length = node.depth + 1;
+					int at = head;
+					uint8_t slot = static_cast<uint8_t>(i);
+					while (nodes[at].parent >= 0) {
+						const Node &child = nodes[at];
+						Bucket *parent = &buckets_[nodes[child.parent].idx];
+						buckets_[child.idx].InsertAt(std::move(parent->tuples_[child.parent_slot].key),
+																				 std::move(parent->tuples_[child.parent_slot].value), slot, child.hash);
+						slot = child.parent_slot;
+						at = child.parent;
+					}
+					choice = at;
+					return slot;
+				}
+
+				// Go through `alt_bucket` in a longer chain, unless the chain already does
+				if (node.depth + 1 == max_moves || num_nodes == displacement_search_size) {
+					continue;
+				}
+				bool on_chain = false;
+				for (int ancestor = head; ancestor >= 0 && !on_chain; ancestor = nodes[ancestor].parent) {
+					on_chain = nodes[ancestor].idx == alt_idx;
+				}
+				for (int k = 0; k < n && !on_chain; k++) {  // Nor through another candidate bucket, where it ends
+					on_chain = idxs[k] == alt_idx;
+				}
+				if (!on_chain) {
+					nodes[num_nodes++] = {alt_idx, static_cast<int16_t>(head), static_cast<uint8_t>(i),
+																static_cast<uint8_t>(node.depth + 1), hashes[j]};
+				}
+			}
+		}
+	}
+	return StashBucket::invalid_pos;
+}
+
+DLEFT_TEMPLATE
+template<bool upsert, class Value>
+auto DLEFT_TYPE::Insert(K &&key, Value &&value, uint32_t hash1, uint32_t hash2) -> InsertStatus {
+	uint32_t hashes[num_choices];
+	idx_t idxs[num_choices];
+	int n = Candidates(hash1, hash2, num_buckets_, hashes, idxs);
+
+	// Check for duplicates
+	for (int i = 0; i < n; i++) {
+		if (CheckDuplicate<upsert>(Lookup(key, arena_), std::forward<Value>(value), idxs[i], hashes[i])) {
+			return InsertStatus::EXISTED;
+		}
+	} // If not found, insert
+	if constexpr (var_key) {  // The bytes are copied once the key is known to be new, and taken back if it does not fit
+		KeyRef stored_key = StoreKey(key);
+		if (!Append(KeyRef(stored_key), std::forward<Value>(value), hash1, hash2)) {
+			ReleaseKey(stored_key);  // So that retries after growing the table copy it only once
+			return InsertStatus::FAILED;
+		}
+		return InsertStatus::INSERTED;
+	} else {
+		return Append(std::forward<K>(key), std::forward<Value>(value), hash1, hash2) ?
+					 InsertStatus::INSERTED : InsertStatus::FAILED;
+	}
+}
+
+DLEFT_TEMPLATE
+template <bool upsert, class Value>
+auto DLEFT_TYPE::Emplace(K &&key, Value &&value) -> bool {
+	if constexpr (slab_value && !IsSlabArg<std::decay_t<Value>>::value) {  // The value goes into the slab
+		return Emplace<upsert>(std::move(key), SlabArg<Value>{&slab_, std::forward<Value>(value)});
+	} else {
+		uint32_t hash1 = H1()(key), hash2 = Hash2(key, hash1);
+		if (concurrent) {
+			return InsertConcurrent<upsert>(std::move(key), std::forward<Value>(value), hash1, hash2);
+		}
+		if (Migrating()) {  // `Insert` only checks the new arrays for duplicates
+			if (upsert) {  // Move the key over, if it is in the old arrays, for `Insert` to assign to it
+				MigrateKey(hash1, hash2);
+			} else if (FindIn(Lookup(key, old_arena_), nullptr, hash1, hash2, old_buckets_, old_stash_buckets_,
+												old_num_buckets_, old_num_stash_buckets_, ThreadStats())) {
+				return false;
+			}
+			Migrate(migration_batch_size);
+		}
+		InsertStatus status = Insert<upsert>(std::move(key), std::forward<Value>(value), hash1, hash2);
+		while (status == InsertStatus::FAILED) {
+			Grow();
+			status = Insert<upsert>(std::move(key), std::forward<Value>(value), hash1, hash2);
+		}
+		if constexpr (var_key) {
+			CompactKeysIfNeeded();
+		}
+		return status == InsertStatus::INSERTED;
+	}
+}
+
+DLEFT_TEMPLATE
+template <class Value>
+auto DLEFT_TYPE::Append(StoredKey &&key, Value &&value, uint32_t hash1, uint32_t hash2) -> bool {
+	uint32_t hashes[num_choices];
+	idx_t idxs[num_choices];
+	int n = Candidates(hash1, hash2, num_buckets_, hashes, idxs);
+
+	// Try inserting into the more underfull candidate buckets first, and the earlier choice among equally full ones
+	int order[num_choices];
+	uint8_t totals[num_choices];
+	for (int i = 0; i < n; i++) {
+		totals[i] = buckets_[idxs[i]].GetTotal();
+		int j = i;
+		for (; j > 0 && totals[order[j - 1]] > totals[i]; j--) {
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+	for (int i = 0; i < n; i++) {
+		if (TryInsert(std::forward<StoredKey>(key), std::forward<Value>(value), idxs[order[i]], hashes[order[i]])) {
+			return true;
+		}
+	}
+
+	// Insertion failed; do one move on each bucket
+	StatsShard *stats_shard = ThreadStats();
+	Count(stats_shard, one_move_attempts);
+	for (int i = 0; i < n; i++) {
+		uint8_t pos = OneMove(idxs[i]);
+		if (pos != StashBucket::invalid_pos) {
+			buckets_[idxs[i]].InsertAt(std::forward<StoredKey>(key), std::forward<Value>(value), pos, hashes[i]);
+			Count(stats_shard, one_move_successes);
+			Count(stats_shard, static_cast<Stat>(path_lengths + 1));
+			size_++;
+			return true;
+		}
+	}
+
+	// Then look for a longer chain, which may go through any bucket, so only with all of them locked
+	bool searched = max_moves == 1 || !concurrent || all_locked_;
+	if (max_moves > 1 && searched) {
+		int choice, length;
+		uint8_t pos = Displace(idxs, n, choice, length);
+		if (pos != StashBucket::invalid_pos) {
+			buckets_[idxs[choice]].InsertAt(std::forward<StoredKey>(key), std::forward<Value>(value), pos,
+																			hashes[choice]);
+			Count(stats_shard, static_cast<Stat>(path_lengths + length));
+			size_++;
+			return true;
+		}
+	}
+	if (searched) {
+		Count(stats_shard, path_lengths);
+	}
+	return false;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::Erase(const K &key, uint32_t hash1, uint32_t hash2) -> bool {
+	if constexpr (slab_value) {  // The slot is found once more to free the value's block along with it
+		StoredValue *stored = FindValueIn(Lookup(key, arena_), hash1, hash2, buckets_, stash_buckets_, num_buckets_,
+																			num_stash_buckets_);
+		if (stored == nullptr) {
+			return false;
+		}
+		StoredValue handle = *stored;
+		if (EraseSlot(key, hash1, hash2)) {
+			slab_.Delete(handle);
+			return true;
+		}
+		return false;
+	} else {
+		return EraseSlot(key, hash1, hash2);
+	}
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::EraseSlot(const K &key, uint32_t hash1, uint32_t hash2) -> bool {
+	uint32_t hashes[num_choices];
+	idx_t idxs[num_choices];
+	int n = Candidates(hash1, hash2, num_buckets_, hashes, idxs);
+
+	for (int i = 0; i < n; i++) {  // Try remove from each candidate bucket in turn
+		if (TryErase(Lookup(key, arena_), idxs[i], hashes[i])) {
+			size_--;
+			if constexpr (var_key) {
+				key_bytes_ -= key.size();
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::TryErase(const LookupKey &key, idx_t idx, uint32_t hash) -> bool {
+	Bucket *bucket = &buckets_[idx];
+	StashBucket *stash_bucket = nullptr;
+
+	if (bucket->overflow_count_ > 0 && stash_buckets_ != nullptr) {
+		stash_bucket = &stash_buckets_[bucket->GetStashBucketIndex(idx, num_stash_buckets_)];
+	}
+	StashGuard guard(this, stash_bucket);
+	if (!bucket->Erase(key, hash, stash_bucket, ThreadStats())) {
+		return false;
+	}
+	if (bucket->overflow_count_ > 0) {  // The removal may have made room for an overflow
+		Promote(idx, stash_bucket);
+	}
+	return true;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::Promote(idx_t idx, StashBucket *stash_bucket) -> size_t {
+	Bucket *bucket = &buckets_[idx];
+	size_t promoted = 0;
+
+	if (bucket->FindFreeSlot() < Bucket::bucket_capacity) {  // Bring one overflow back into the bucket
+		// The low bits of the 16-bit fingerprint of an overflow are its 8-bit fingerprint in the bucket
+		uint8_t major_idx = bucket->overflow_count_ > bucket->GetMinorOverflowCount() ?
+												FindOwnMajorOverflow(idx, stash_bucket) : StashBucket::invalid_pos;
+		if (major_idx != StashBucket::invalid_pos) {
+			uint8_t pos = stash_bucket->position_[major_idx];
+			bucket->InsertAt(std::move(stash_bucket->tuples_[pos].key), std::move(stash_bucket->tuples_[pos].value),
+											 bucket->FindFreeSlot(), stash_bucket->fingerprints_[major_idx]);
+			CLEAR_BIT_256(stash_bucket->validity_, pos);
+			stash_bucket->position_[major_idx] = StashBucket::invalid_pos;
+			bucket->overflow_count_--;
+			promoted++;
+		} else if (bucket->GetMinorOverflowCount() > 0) {
+			uint8_t minor_idx = __builtin_ctz(bucket->GetMinorOverflowValidity());
+			uint8_t pos = bucket->overflow_pos_[minor_idx];
+			bucket->InsertAt(std::move(stash_bucket->tuples_[pos].key), std::move(stash_bucket->tuples_[pos].value),
+											 bucket->FindFreeSlot(), bucket->overflow_fp_[minor_idx]);
+			CLEAR_BIT_256(stash_bucket->validity_, pos);
+			CLEAR_BIT(bucket->overflow_info_, minor_idx);
+			bucket->overflow_count_--;
+			promoted++;
+		}
+	}
+
+	// A major overflow becomes a minor one without moving, as only its fingerprint and position move to the bucket
+	while (bucket->overflow_count_ > bucket->GetMinorOverflowCount() &&
+				 bucket->GetMinorOverflowCount() < Bucket::max_minor_overflows) {
+		uint8_t major_idx = FindOwnMajorOverflow(idx, stash_bucket);
+		if (major_idx == StashBucket::invalid_pos) {
+			break;
+		}
+		uint8_t minor_idx = __builtin_ctz(~bucket->GetMinorOverflowValidity());
+		bucket->overflow_fp_[minor_idx] = stash_bucket->fingerprints_[major_idx];
+		bucket->overflow_pos_[minor_idx] = stash_bucket->position_[major_idx];
+		SET_BIT(bucket->overflow_info_, minor_idx);
+		stash_bucket->position_[major_idx] = StashBucket::invalid_pos;
+		promoted++;
+	}
+	return promoted;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::promote_overflows() -> size_t {
+	size_t promoted = 0;
+	LockAll();
+	for (idx_t idx = 0; idx < num_buckets_; idx++) {
+		Bucket *bucket = &buckets_[idx];
+		if (bucket->overflow_count_ > 0 && stash_buckets_ != nullptr) {
+			promoted += Promote(idx, &stash_buckets_[bucket->GetStashBucketIndex(idx, num_stash_buckets_)]);
+		}
+	}
+	UnlockAll();
+	return promoted;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::FindOwnMajorOverflow(idx_t idx, const StashBucket *stash_bucket) const -> uint8_t {
+	size_t stash_idx = stash_bucket - stash_buckets_;
+
+	for (uint8_t i = 0; i < StashBucket::max_major_overflows; i++) {
+		if (stash_bucket->position_[i] == StashBucket::invalid_pos) {
+			continue;
+		}
+		auto &&key = View(stash_bucket->tuples_[stash_bucket->position_[i]].key, arena_);
+		uint32_t hash1 = H1()(key), hash2 = Hash2(key, hash1);
+		uint32_t hashes[num_choices];
+		idx_t idxs[num_choices];
+		int n = Candidates(hash1, hash2, num_buckets_, hashes, idxs), own = 0;
+		while (own < n && !(idxs[own] == idx && FINGERPRINT16(hashes[own]) == stash_bucket->fingerprints_[i])) {
+			own++;
+		}
+		if (own == n) {
+			continue;
+		}
+		// The key may be a major overflow of another of its buckets instead, if that one overflows into the same stash
+		// bucket; as that takes the lock of this stash bucket, it cannot change meanwhile, even in concurrent mode
+		bool shared = false;
+		for (int j = 0; j < n; j++) {
+			const Bucket *other = &buckets_[idxs[j]];
+			shared |= j != own && other->overflow_count_ > other->GetMinorOverflowCount() &&
+								other->GetStashBucketIndex(idxs[j], num_stash_buckets_) == stash_idx;
+		}
+		if (shared) {
+			continue;
+		}
+		return i;
+	}
+	return StashBucket::invalid_pos;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::Find(const K &key, V *value, uint32_t hash1, uint32_t hash2) const -> bool {
+	if constexpr (slab_value) {  // Find the handle, then the value
+		StoredValue handle;
+		if (!FindStored(key, &handle, hash1, hash2)) {
+			return false;
+		}
+		*value = slab_.At(handle);
+		return true;
+	} else {
+		return FindStored(key, value, hash1, hash2);
+	}
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::FindStored(const K &key, StoredValue *value, uint32_t hash1, uint32_t hash2) const -> bool {
+	StatsShard *stats_shard = ThreadStats();
+	if (FindIn(Lookup(key, arena_), value, hash1, hash2, buckets_, stash_buckets_, num_buckets_, num_stash_buckets_,
+						 stats_shard)) {
+		return true;
+	}  // Keys that are not migrated yet are still in the old arrays, and their bytes in the old arena
+	return Migrating() && FindIn(Lookup(key, old_arena_), value, hash1, hash2, old_buckets_, old_stash_buckets_,
+															 old_num_buckets_, old_num_stash_buckets_, stats_shard);
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::FindIn(const LookupKey &key, StoredValue *value, uint32_t hash1, uint32_t hash2, Bucket *buckets,
+												StashBucket *stash_buckets, size_t num_buckets, size_t num_stash_buckets,
+												StatsShard *stats_shard) -> bool {
+	uint32_t hashes[num_choices];
+	idx_t idxs[num_choices];
+	int n = Candidates(hash1, hash2, num_buckets, hashes, idxs);
+	if constexpr (num_choices > 2) {  // Fetch the other candidate buckets while the first two are probed
+		for (int i = 2; i < n; i++) {
+			buckets[idxs[i]].Prefetch();
+		}
+	}
+	Bucket *bucket1 = &buckets[idxs[0]], *bucket2 = &buckets[idxs[n > 1]];
+	StashBucket *stash_bucket1{nullptr}, *stash_bucket2{nullptr};
+
+	// Probe the first two buckets at once; with two choices, most negative lookups end here, without any key
+	// comparison
+	auto masks = Probe(key, bucket1, bucket2, hashes[0], hashes[n > 1]);
+	masks.fingerprints &= n > 1 ? 0xffffffff : 0xffff;
+	if (masks.fingerprints != 0 || (bucket1->overflow_count_ | bucket2->overflow_count_) != 0) {
+		if (bucket1->overflow_count_ > 0 && stash_buckets != nullptr) {
+			stash_bucket1 = &stash_buckets[bucket1->GetStashBucketIndex(idxs[0], num_stash_buckets)];
+		}
+		// Search the first bucket
+		if (bucket1->Find(key, value, hashes[0], masks.fingerprints, masks.overflows, stash_bucket1, stats_shard)) {
+			return true;
+		}
+
+		if (n > 1) {
+			if (bucket2->overflow_count_ > 0 && stash_buckets != nullptr) {
+				stash_bucket2 = &stash_buckets[bucket2->GetStashBucketIndex(idxs[1], num_stash_buckets)];
+			}  // If not found, search the second bucket
+			if (bucket2->Find(key, value, hashes[1], masks.fingerprints >> 16, masks.overflows >> 8, stash_bucket2,
+												stats_shard)) {
+				return true;
+			}
+		}
+	}
+
+	if constexpr (num_choices > 2) {  // Then the other candidate buckets
+		for (int i = 2; i < n; i++) {
+			Bucket *bucket = &buckets[idxs[i]];
+			StashBucket *stash_bucket = nullptr;
+			if (bucket->overflow_count_ > 0 && stash_buckets != nullptr) {
+				stash_bucket = &stash_buckets[bucket->GetStashBucketIndex(idxs[i], num_stash_buckets)];
+			}
+			if (bucket->Find(key, value, hashes[i], stash_bucket, stats_shard)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::FindValueIn(const LookupKey &key, uint32_t hash1, uint32_t hash2, Bucket *buckets,
+														 StashBucket *stash_buckets, size_t num_buckets, size_t num_stash_buckets)
+		-> StoredValue * {
+	using TupleStatus = typename Bucket::TupleStatus;
+	uint32_t hashes[num_choices];
+	idx_t idxs[num_choices];
+	int n = Candidates(hash1, hash2, num_buckets, hashes, idxs);
+	for (int i = 0; i < n; i++) {
+		uint32_t hash = hashes[i];
+		idx_t idx = idxs[i];
+		Bucket *bucket = &buckets[idx];
+		StashBucket *stash_bucket = nullptr;
+		if (bucket->overflow_count_ > 0 && stash_buckets != nullptr) {
+			stash_bucket = &stash_buckets[bucket->GetStashBucketIndex(idx, num_stash_buckets)];
+		}
+		TupleStatus status;
+		uint8_t pos = bucket->FindPos(key, hash, stash_bucket, status);
+		if (status == TupleStatus::IN_BUCKET) {
+			return &bucket->tuples_[pos].value;
+		} else if (status == TupleStatus::MINOR_OVERFLOW) {
+			return &stash_bucket->tuples_[bucket->overflow_pos_[pos]].value;
+		} else if (status == TupleStatus::MAJOR_OVERFLOW) {
+			return &stash_bucket->tuples_[stash_bucket->position_[pos]].value;
+		}
+	}
+	return nullptr;
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::find_batch(const K *keys, V *values, bool *found, size_t n) const {
+	uint32_t hash1[prefetch_batch_size], hash2[prefetch_batch_size];
+
+	for (size_t begin = 0; begin < n; begin += prefetch_batch_size) {
+		size_t end = std::min(n, begin + prefetch_batch_size);
+
+		// Stage 1: hash all keys and prefetch all their candidate buckets
+		// (in concurrent mode, the geometry may be changing, but prefetching a wrong address is harmless)
+		for (size_t i = begin; i < end; i++) {
+			hash1[i - begin] = H1()(keys[i]);
+			hash2[i - begin] = Hash2(keys[i], hash1[i - begin]);
+			for (int j = 0; j < num_choices; j++) {
+				buckets_[BucketIdx(ChoiceHash(hash1[i - begin], hash2[i - begin], j), num_buckets_)].Prefetch();
+			}
+		}
+
+		// Stage 2: the bucket headers tell which stash buckets are bound, so prefetch those
+		// (skipped in concurrent mode, where headers cannot be read without validation)
+		if (!concurrent && stash_buckets_ != nullptr) {
+			for (size_t i = begin; i < end; i++) {
+				uint32_t hashes[num_choices];
+				idx_t idxs[num_choices];
+				int num_candidates = Candidates(hash1[i - begin], hash2[i - begin], num_buckets_, hashes, idxs);
+				for (int j = 0; j < num_candidates; j++) {
+					const Bucket *bucket = &buckets_[idxs[j]];
+					if (bucket->overflow_count_ > 0) {
+						bucket->PrefetchOverflows(hashes[j],
+																			&stash_buckets_[bucket->GetStashBucketIndex(idxs[j], num_stash_buckets_)]);
+					}
+				}
+			}
+		}
+
+		// Stage 3: resolve the lookups, which should now mostly hit the cache
+		for (size_t i = begin; i < end; i++) {
+			found[i] = concurrent ? FindConcurrent(keys[i], &values[i], hash1[i - begin], hash2[i - begin])
+														: Find(keys[i], &values[i], hash1[i - begin], hash2[i - begin]);
+		}
+	}
+}
+
+DLEFT_TEMPLATE
+template <class Fn>
+void DLEFT_TYPE::for_each(Fn fn) {
+	auto value_fn = ValueFn(fn);
+	LockAll();
+	ForEachIn(value_fn, 0, 1);
+	UnlockAll();
+}
+
+DLEFT_TEMPLATE
+template <class Fn>
+void DLEFT_TYPE::parallel_for_each(Fn fn, size_t num_threads) {
+	num_threads = std::max<size_t>(num_threads, 1);
+	auto value_fn = ValueFn(fn);
+	LockAll();
+	RunParallel(num_threads, [this, &value_fn, num_threads](size_t i) { ForEachIn(value_fn, i, num_threads); });
+	UnlockAll();
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::build(const K *keys, const V *values, size_t n, size_t num_threads) {
+	if constexpr (var_key) {  // Checked up front, as the keys are copied by other threads
+		for (size_t i = 0; i < n; i++) {
+			KeyArena::CheckLength(keys[i]);
+		}
+	}
+	LockAll();
+	Clear();
+	if (capacity() < n * 100 / MAX_LOAD_FACTOR_100) {
+		Resize(n * 100 / MAX_LOAD_FACTOR_100, num_threads);
+	}
+	if constexpr (slab_value) {  // The handle of each pair is its index, so that values are copied once placed
+		slab_.Reserve(n);
+		BulkPlace<false>([keys, n](size_t slice, size_t num_slices, auto &&fn) {
+			for (size_t i = n * slice / num_slices; i < n * (slice + 1) / num_slices; i++) {
+				fn(keys[i], static_cast<StoredValue>(i));
+			}
+		}, n, num_threads);
+
+		// Duplicate keys leave the blocks of the values they replaced unused
+		std::vector<char> used(n);
+		auto copy = [this, values, &used](const K &, StoredValue &handle) {
+			::new (static_cast<void *>(&slab_.At(handle))) V(values[handle]);
+			used[handle] = 1;
+		};
+		num_threads = std::max<size_t>(num_threads, 1);
+		RunParallel(num_threads, [&](size_t i) { ForEachIn(copy, i, num_threads); });
+		for (size_t i = 0; i < n; i++) {
+			if (!used[i]) {
+				slab_.Free(static_cast<StoredValue>(i));
+			}
+		}
+	} else {
+		BulkPlace<false>([keys, values, n](size_t slice, size_t num_slices, auto &&fn) {
+			for (size_t i = n * slice / num_slices; i < n * (slice + 1) / num_slices; i++) {
+				fn(keys[i], values[i]);
+			}
+		}, n, num_threads);
+	}
+	UnlockAll();
+}
+
+DLEFT_TEMPLATE
+template <bool rehash, class Source>
+auto DLEFT_TYPE::BulkPlace(Source source, size_t n, size_t num_threads) -> bool {
+	num_threads = std::max<size_t>(std::min(num_threads, ROUND_UP(n, 1 << 16)), 1);  // Few keys get one thread
+
+	// The buckets are split into `num_parts` equal parts, and each thread owns a contiguous range of parts; a part
+	// is small enough for its buckets to stay in cache while its keys are placed
+	const size_t num_parts = std::max(num_threads, std::min(build_num_parts, num_buckets_));
+	auto part_of = [this, num_parts](uint32_t hash) -> size_t {
+		return static_cast<size_t>(BucketIdx(hash, num_buckets_)) * num_parts / num_buckets_;
+	};
+	auto first_part = [num_parts, num_threads](size_t thread) { return num_parts * thread / num_threads; };
+
+	// Rehashed slots hold their keys as stored, so variable-length ones are viewed in the arena to be hashed
+	using Key = std::conditional_t<rehash, StoredKey, K>;
+	auto hashed = [this](const Key &key) -> decltype(auto) {
+		if constexpr (rehash) {
+			return View(key, arena_);
+		} else {
+			return key;
+		}
+	};
+
+	// Pass 1: hash the keys, each thread taking a slice of them, and count how many fall into each part, by their
+	// first and by their second bucket
+	std::vector<std::vector<uint32_t>> hashes(num_threads);  // both hashes of each pair in a slice, one after another
+	std::vector<size_t> offsets[2];                          // `offsets[choice][slice * num_parts + part]`
+	offsets[0].resize(num_threads * num_parts);
+	offsets[1].resize(num_threads * num_parts);
+	RunParallel(num_threads, [&](size_t slice) {
+		source(slice, num_threads, [&](const Key &key, const StoredValue &) {
+			auto &&view = hashed(key);
+			uint32_t hash1 = H1()(view), hash2 = Hash2(view, hash1);
+			hashes[slice].push_back(hash1);
+			hashes[slice].push_back(hash2);
+			offsets[0][slice * num_parts + part_of(hash1)]++;
+			offsets[1][slice * num_parts + part_of(hash2)]++;
+		});
+	});
+
+	// Pass 2: radix-partition the pairs by the part of their first bucket, copying them along with their hashes, so
+	// that placing them reads memory sequentially, and their indexes by the part of their second bucket; the
+	// partitions are stable, so that duplicates keep their order, and pairs of a part are not ordered by their other
+	// bucket, which would let those whose other bucket comes first take the room
+	std::vector<size_t> part_begin[2];
+	size_t num_entries = 0;
+	for (int choice = 0; choice < 2; choice++) {
+		part_begin[choice].resize(num_parts + 1);
+		num_entries = 0;
+		for (size_t part = 0; part < num_parts; part++) {
+			part_begin[choice][part] = num_entries;
+			for (size_t slice = 0; slice < num_threads; slice++) {
+				size_t count = offsets[choice][slice * num_parts + part];
+				offsets[choice][slice * num_parts + part] = num_entries;
+				num_entries += count;
+			}
+		}
+		part_begin[choice][num_parts] = num_entries;
+	}
+	std::vector<BuildEntry<Key>> entries(num_entries);
+	std::vector<size_t> by_second(num_entries);
+	RunParallel(num_threads, [&](size_t slice) {
+		const uint32_t *hash = hashes[slice].data();
+		// Rehashed pairs are copied rather than moved, as a failed resize falls back to the old arrays
+		source(slice, num_threads, [&](const Key &key, const StoredValue &value) {
+			size_t i = offsets[0][slice * num_parts + part_of(hash[0])]++;
+			entries[i] = {key, value, hash[0], hash[1]};
+			by_second[offsets[1][slice * num_parts + part_of(hash[1])]++] = i;
+			hash += 2;
+		});
+		std::vector<uint32_t>().swap(hashes[slice]);
+	});
+
+	// Pass 3: place the pairs into the less loaded of their two buckets, as `Append` does, in steps that alternately
+	// place the pairs left into their first and their second buckets, each thread those of its parts; the other
+	// bucket may belong to another thread, so each step compares with its load as the step began
+	// A bucket only gets fuller, so a key is either placed in a step or left over with all its duplicates
+	std::vector<size_t> placed(num_threads);
+	std::vector<KeyBlock> blocks(num_threads);  // Each thread copies keys into its own, so as not to wait for the others
+	std::vector<uint8_t> sizes(num_buckets_), done(num_entries);
+	std::vector<std::vector<size_t>> pending[2];  // Indexes of the pairs of each thread, by first and second bucket
+	for (int choice = 0; choice < 2; choice++) {
+		pending[choice].resize(num_threads);
+	}
+	RunParallel(num_threads, [&](size_t thread) {
+		size_t begin = part_begin[0][first_part(thread)], end = part_begin[0][first_part(thread + 1)];
+		pending[0][thread].resize(end - begin);
+		std::iota(pending[0][thread].begin(), pending[0][thread].end(), begin);
+		pending[1][thread].assign(by_second.begin() + part_begin[1][first_part(thread)],
+															by_second.begin() + part_begin[1][first_part(thread + 1)]);
+	});
+	std::vector<size_t>().swap(by_second);
+	for (size_t step = 0, idle_steps = 0; idle_steps < 2; step++) {
+		bool second_bucket = step % 2 == 1;
+		RunParallel(num_threads, [&](size_t thread) {
+			for (size_t i = num_buckets_ * thread / num_threads; i < num_buckets_ * (thread + 1) / num_threads; i++) {
+				sizes[i] = buckets_[i].GetSize();
+			}
+		});
+		std::vector<size_t> step_placed(num_threads);
+		RunParallel(num_threads, [&](size_t thread) {
+			step_placed[thread] = BuildPlace<rehash>(entries.data(), pending[second_bucket][thread], second_bucket,
+																							 sizes.data(), done.data(), blocks[thread]);
+		});
+		size_t num_placed = 0;
+		for (size_t thread = 0; thread < num_threads; thread++) {
+			placed[thread] += step_placed[thread];
+			num_placed += step_placed[thread];
+		}
+		idle_steps = num_placed > 0 ? 0 : idle_steps + 1;
+	}
+	for (size_t count : placed) {
+		size_ += count;
+	}
+	for (const KeyBlock &block : blocks) {
+		key_bytes_ += block.key_bytes;
+	}
+
+	// Pass 4: insert the rest serially, in the order of the partition, binding stash buckets as needed; when
+	// rehashing, there is no duplicate, and running out of space fails the resize, as a serial rehash would
+	for (size_t i = 0; i < num_entries; i++) {
+		if (done[i]) {
+			continue;
+		}
+		auto &entry = entries[i];
+		if constexpr (rehash) {
+			if (!Append(std::move(entry.key), std::move(entry.value), entry.hash1, entry.hash2)) {
+				return false;
+			}
+		} else {
+			while (Insert(std::move(entry.key), std::move(entry.value), entry.hash1, entry.hash2) == InsertStatus::FAILED) {
+				Resize(BucketCapacity() * 2, num_threads);
+			}
+		}
+	}
+	return true;
+}
+
+DLEFT_TEMPLATE
+template <bool rehash, class Entry>
+auto DLEFT_TYPE::BuildPlace(Entry *entries, std::vector<size_t> &pending, bool second_bucket, const uint8_t *sizes,
+														uint8_t *done, KeyBlock &block) -> size_t {
+	using TupleStatus = typename Bucket::TupleStatus;
+	size_t placed = 0;
+
+	size_t num_pending = 0;
+	for (size_t i : pending) {
+		if (done[i]) {  // Placed by the other kind of step
+			continue;
+		}
+		Entry &entry = entries[i];
+		uint32_t hash = second_bucket ? entry.hash2 : entry.hash1;
+		idx_t idx = BucketIdx(hash, num_buckets_);
+		idx_t other_idx = BucketIdx(second_bucket ? entry.hash1 : entry.hash2, num_buckets_);
+		if (second_bucket && idx == other_idx) {
+			pending[num_pending++] = i;
+			continue;
+		}
+		Bucket *bucket = &buckets_[idx];
+		done[i] = true;
+		if constexpr (!rehash) {
+			TupleStatus status;
+			uint8_t pos = bucket->FindPos(Lookup(entry.key, arena_), hash, nullptr, status);
+			if (status == TupleStatus::IN_BUCKET) {  // A duplicate placed earlier
+				bucket->tuples_[pos].value = std::move(entry.value);
+				continue;
+			}
+		}
+		uint8_t pos = bucket->FindFreeSlot();
+		if (pos == Bucket::bucket_capacity || bucket->GetSize() > sizes[other_idx]) {
+			done[i] = false;
+			pending[num_pending++] = i;
+			continue;
+		}
+		if constexpr (var_key && !rehash) {  // Rehashed keys are in the arena already
+			bucket->InsertAt(CopyKey(entry.key, block), std::move(entry.value), pos, hash);
+		} else {
+			bucket->InsertAt(std::move(entry.key), std::move(entry.value), pos, hash);
+		}
+		placed++;
+	}
+	pending.resize(num_pending);
+	return placed;
+}
+
+DLEFT_TEMPLATE
+template <class Fn>
+void DLEFT_TYPE::ForEachIn(Fn &fn, size_t part, size_t num_parts) {
+	auto in_arena = [&fn](const KeyArena &arena) {  // Variable-length keys are viewed in the arena of their arrays
+		return [&fn, &arena](StoredKey &key, StoredValue &value) { fn(View(key, arena), value); };
+	};
+	auto new_fn = in_arena(arena_);
+	ForEachIn(new_fn, buckets_, stash_buckets_, num_buckets_, num_stash_buckets_, part, num_parts);
+	if (Migrating()) {  // Migrated buckets and overflows are cleared, so each key is only seen once
+		auto old_fn = in_arena(old_arena_);
+		ForEachIn(old_fn, old_buckets_, old_stash_buckets_, old_num_buckets_, old_num_stash_buckets_, part, num_parts);
+	}
+}
+
+DLEFT_TEMPLATE
+template <class Fn>
+void DLEFT_TYPE::ForEachIn(Fn &fn, Bucket *buckets, StashBucket *stash_buckets, size_t num_buckets,
+													 size_t num_stash_buckets, size_t part, size_t num_parts) {
+	for (size_t i = num_buckets * part / num_parts; i < num_buckets * (part + 1) / num_parts; i++) {
+		Bucket &bucket = buckets[i];
+		for (uint32_t mask = bucket.validity_; mask != 0; mask &= mask - 1) {
+			auto &&tuple = bucket.tuples_[__builtin_ctz(mask)];
+			fn(tuple.key, tuple.value);
+		}
+	}
+	// Every valid slot of a stash bucket holds an overflow, minor or major, of exactly one bucket
+	for (size_t i = num_stash_buckets * part / num_parts; i < num_stash_buckets * (part + 1) / num_parts; i++) {
+		StashBucket &stash_bucket = stash_buckets[i];
+		for (int word = 0; word < StashBucket::validity_words; word++) {
+			for (uint64_t mask = stash_bucket.validity_[word]; mask != 0; mask &= mask - 1) {
+				Tuple &tuple = stash_bucket.tuples_[word * 64 + __builtin_ctzll(mask)];
+				fn(tuple.key, tuple.value);
+			}
+		}
+	}
+}
+
+DLEFT_TEMPLATE
+class DLEFT_TYPE::iterator {
+	// In slab mode, a pair is made of the key in its slot and the value in its block; with `soa_buckets`, of the
+	// key and value in their arrays; with variable-length keys, of the key viewed in the arena
+	struct Entry {
+		std::conditional_t<var_key, K, const K &> key;
+		V &value;
+	};
+
+	struct EntryPointer {
+		Entry entry;
+
+		auto operator->() -> Entry * { return &entry; }
+	};
+
+ public:
+	using iterator_category = std::forward_iterator_tag;
+	using value_type = std::conditional_t<slab_value || soa_bucket || var_key, Entry, Tuple>;
+	using difference_type = std::ptrdiff_t;
+	using pointer = std::conditional_t<slab_value || soa_bucket || var_key, EntryPointer, Tuple *>;
+	using reference = std::conditional_t<slab_value || soa_bucket || var_key, Entry, Tuple &>;
+
+	iterator() = default;
+
+	auto operator*() const -> reference {
+		size_t slot = word_ * 64 + __builtin_ctzll(bits_);
+		if (segment_ % 2 == 0) {
+			return Dereference(Buckets()[idx_].tuples_[slot]);
+		}
+		return Dereference(StashBuckets()[idx_].tuples_[slot]);
+	}
+
+	auto operator->() const -> pointer {
+		if constexpr (slab_value || soa_bucket || var_key) {
+			return {**this};
+		} else {
+			return &**this;
+		}
+	}
+
+	auto operator++() -> iterator & {
+		bits_ &= bits_ - 1;
+		Next();
+		return *this;
+	}
+
+	auto operator++(int) -> iterator {
+		iterator old = *this;
+		++*this;
+		return old;
+	}
+
+	auto operator==(const iterator &other) const -> bool {
+		return segment_ == other.segment_ && idx_ == other.idx_ && word_ == other.word_ && bits_ == other.bits_;
+	}
+
+	auto operator!=(const iterator &other) const -> bool { return !(*this == other); }
+
+ private:
+	friend class DleftFpStash;
+
+	// The arrays are walked in the order of `ForEachIn`: buckets, stash buckets, old buckets, old stash buckets
+	static constexpr int num_segments = 4;
+
+	// Starts at the first key, or at the end if `table` is null
+	explicit iterator(DleftFpStash *table) : table_(table), segment_(table == nullptr ? num_segments : 0) {
+		if (table != nullptr) {
+			word_ = -1;
+			Next();
+		}
+	}
+
+	template <class Slot>
+	auto Dereference(Slot &&tuple) const -> reference {
+		if constexpr (slab_value) {
+			return {Key(tuple.key), table_->slab_.At(tuple.value)};
+		} else if constexpr (soa_bucket || var_key) {
+			return {Key(tuple.key), tuple.value};
+		} else {
+			return tuple;
+		}
+	}
+
+	auto Key(const StoredKey &key) const -> decltype(auto) {
+		return View(key, segment_ < 2 ? table_->arena_ : table_->old_arena_);
+	}
+
+	auto Buckets() const -> Bucket * { return segment_ == 0 ? table_->buckets_ : table_->old_buckets_; }
+
+	auto StashBuckets() const -> StashBucket * {
+		return segment_ == 1 ? table_->stash_buckets_ : table_->old_stash_buckets_;
+	}
+
+	auto NumBuckets() const -> size_t {
+		if (segment_ >= 2 && !table_->Migrating()) {
+			return 0;
+		}
+		switch (segment_) {
+		 case 0: return table_->num_buckets_;
+		 case 1: return table_->stash_buckets_ != nullptr ? table_->num_stash_buckets_ : 0;
+		 case 2: return table_->old_num_buckets_;
+		 default: return table_->old_stash_buckets_ != nullptr ? table_->old_num_stash_buckets_ : 0;
+		}
+	}
+
+	auto NumWords() const -> int { return segment_ % 2 == 0 ? 1 : StashBucket::validity_words; }
+
+	auto Bits() const -> uint64_t {
+		return segment_ % 2 == 0 ? Buckets()[idx_].validity_ : StashBuckets()[idx_].validity_[word_];
+	}
+
+	// Moves to the next key, unless the current bitmap word still has one
+	void Next() {
+		while (bits_ == 0) {
+			if (++word_ == NumWords()) {
+				word_ = 0;
+				idx_++;
+			}
+			while (idx_ == NumBuckets()) {
+				idx_ = 0;
+				if (++segment_ == num_segments) {
+					return;
+				}
+			}
+			bits_ = Bits();
+		}
+	}
+
+	DleftFpStash *table_{nullptr};
+	int segment_{num_segments};
+	size_t idx_{0};
+	int word_{0};
+	uint64_t bits_{0};
+};
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::begin() -> iterator { return iterator(this); }
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::end() -> iterator { return iterator(nullptr); }
+
+DLEFT_TEMPLATE
+template <bool upsert, class Value>
+auto DLEFT_TYPE::InsertConcurrent(K &&key, Value &&value, uint32_t hash1, uint32_t hash2) -> bool {
+	InsertStatus status;
+	size_t num_buckets;
+
+	while (true) {
+		num_buckets = LockCandidates(hash1, hash2);
+		status = Insert<upsert>(std::forward<K>(key), std::forward<Value>(value), hash1, hash2);
+		UnlockCandidates(hash1, hash2);
+		if (status != InsertStatus::FAILED) {
+			if (UNLIKELY( retired_bytes_.load(std::memory_order_relaxed) != 0 )) {
+				TryReclaim();
+			}
+			if constexpr (var_key) {
+				if (UNLIKELY( compact_keys_ )) {
+					LockAll();
+					CompactKeysIfNeeded();
+					UnlockAll();
+				}
+			}
+			return status == InsertStatus::INSERTED;
+		}
+
+		// Out of space; grow the table unless another writer has done so in the meantime, or, with longer chains of
+		// moves enabled, one is found now that every bucket is locked
+		LockAll();
+		if (num_buckets_ == num_buckets) {
+			if (max_moves > 1) {
+				status = Insert<upsert>(std::forward<K>(key), std::forward<Value>(value), hash1, hash2);
+			}
+			if (status == InsertStatus::FAILED) {
+				Resize(BucketCapacity() * 2, resize_threads_);
+			}
+		}
+		UnlockAll();
+		if (status != InsertStatus::FAILED) {
+			return status == InsertStatus::INSERTED;
+		}
+	}
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::EraseConcurrent(const K &key, uint32_t hash1, uint32_t hash2) -> bool {
+	LockCandidates(hash1, hash2);
+	bool erased = Erase(key, hash1, hash2);
+	UnlockCandidates(hash1, hash2);
+	if (UNLIKELY( size_ < shrink_size_ )) {
+		LockAll();
+		if (size_ < shrink_size_) {  // Another removal may have shrunk the table already
+			Shrink();
+		}
+		UnlockAll();
+	} else if (UNLIKELY( retired_bytes_.load(std::memory_order_relaxed) != 0 )) {
+		TryReclaim();
+	}
+	return erased;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::FindConcurrent(const K &key, V *value, uint32_t hash1, uint32_t hash2) const -> bool {
+	const VersionLock *locks[num_choices], *stash_locks[num_choices];
+	uint64_t resize_version, versions[num_choices], stash_versions[num_choices];
+	StatsShard *stats_shard = ThreadStats();
+	bool found;
+	std::conditional_t<slab_value, StoredValue, char> handle;  // In slab mode, the value is read through its handle
+	StoredValue *stored;
+	if constexpr (slab_value) {
+		stored = &handle;
+	} else {
+		stored = value;
+	}
+	ReadGuard guard(this);
+	auto &&lookup = Lookup(key, arena_);
+
+	while (true) {
+		// The geometry is only trusted if no resize started while reading it; old bucket arrays are not freed
+		// while the guard counts this reader in, so reading a stale one is safe and caught by validation
+		resize_version = resize_lock_.ReadBegin();
+		uint32_t hashes[num_choices];
+		idx_t idxs[num_choices];
+		int n = Candidates(hash1, hash2, num_buckets_, hashes, idxs);
+		const Bucket *bucket_array = buckets_;
+		const StashBucket *stash_array = stash_buckets_;
+		size_t num_stash_buckets = num_stash_buckets_;
+		if (!resize_lock_.ReadValidate(resize_version)) {
+			continue;
+		}
+
+		for (int i = 0; i < n; i++) {
+			locks[i] = &locks_[LockIndex(idxs[i])];
+			stash_locks[i] = nullptr;
+			versions[i] = locks[i]->ReadBegin();
+		}
+		if constexpr (num_choices > 2) {  // Fetch the other candidate buckets while the first two are probed
+			for (int i = 2; i < n; i++) {
+				bucket_array[idxs[i]].Prefetch();
+			}
+		}
+
+		auto masks = Probe(lookup, &bucket_array[idxs[0]], &bucket_array[idxs[n > 1]], hashes[0], hashes[n > 1]);
+
+		// Search each candidate bucket in turn, until the key is found
+		found = false;
+		for (int i = 0; i < n && !found; i++) {
+			const Bucket *bucket = &bucket_array[idxs[i]];
+			const StashBucket *stash_bucket{nullptr};
+			if (bucket->overflow_count_ > 0 && stash_array != nullptr) {
+				size_t stash_idx = bucket->GetStashBucketIndex(idxs[i], num_stash_buckets);
+				stash_bucket = &stash_array[stash_idx];
+				stash_locks[i] = &stash_locks_[StashLockIndex(stash_idx)];
+				stash_versions[i] = stash_locks[i]->ReadBegin();
+			}
+			found = i < 2 ? bucket->Find(lookup, stored, hashes[i], masks.fingerprints >> (16 * i),
+																	 masks.overflows >> (8 * i), stash_bucket, stats_shard)
+										: bucket->Find(lookup, stored, hashes[i], stash_bucket, stats_shard);
+		}
+		if constexpr (slab_value) {  // A torn handle may point nowhere, but then validation fails below
+			const V *block = found ? slab_.TryAt(handle) : nullptr;
+			if (block != nullptr) {
+				*value = *block;
+			}
+		}
+
+		bool valid = true;
+		for (int i = 0; i < n; i++) {
+			valid = valid && locks[i]->ReadValidate(versions[i]) &&
+							(stash_locks[i] == nullptr || stash_locks[i]->ReadValidate(stash_versions[i]));
+		}
+		if (valid && resize_lock_.ReadValidate(resize_version)) {
+			return found;
+		}
+	}
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::LockCandidates(uint32_t hash1, uint32_t hash2) -> size_t {
+	size_t locks[num_choices];
+	while (true) {
+		size_t num_buckets = num_buckets_;
+		int n = CandidateLocks(hash1, hash2, num_buckets, locks);
+		for (int i = 0; i < n; i++) {
+			locks_[locks[i]].Lock();
+		}
+
+		// Resizing requires all stripes, so the number of buckets cannot change from now on
+		if (num_buckets_ == num_buckets) {
+			return num_buckets;
+		}
+		for (int i = 0; i < n; i++) {
+			locks_[locks[i]].Unlock();
+		}
+	}
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::UnlockCandidates(uint32_t hash1, uint32_t hash2) {
+	size_t locks[num_choices];
+	int n = CandidateLocks(hash1, hash2, num_buckets_, locks);
+	for (int i = 0; i < n; i++) {
+		locks_[locks[i]].Unlock();
+	}
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::CandidateLocks(uint32_t hash1, uint32_t hash2, size_t num_buckets, size_t *locks) -> int {
+	uint32_t hashes[num_choices];
+	idx_t idxs[num_choices];
+	int n = Candidates(hash1, hash2, num_buckets, hashes, idxs), count = 0;
+	for (int i = 0; i < n; i++) {  // Insertion sort, as there are at most 4
+		size_t lock = LockIndex(idxs[i]);
+		if (std::find(locks, locks + count, lock) != locks + count) {
+			continue;
+		}
+		int j = count++;
+		for (; j > 0 && locks[j - 1] > lock; j--) {
+			locks[j] = locks[j - 1];
+		}
+		locks[j] = lock;
+	}
+	return count;
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::LockAll() {
+	if (!concurrent) {
+		return;
+	}
+	resize_lock_.Lock();
+	for (size_t i = 0; i < num_locks; i++) {
+		locks_[i].Lock();
+	}
+	all_locked_ = true;
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::UnlockAll() {
+	if (!concurrent) {
+		return;
+	}
+	if (retired_bytes_ != 0) {
+		TryReclaim();
+	}
+	all_locked_ = false;
+	for (size_t i = 0; i < num_locks; i++) {
+		locks_[i].Unlock();
+	}
+	resize_lock_.Unlock();
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::Retire(Bucket *old_buckets, StashBucket *old_stash_buckets, size_t old_num_buckets,
+											 size_t old_num_stash_buckets) {
+	if (concurrent) {
+		reclaim_lock_.Lock();
+		retired_.push_back({epoch_, old_buckets, old_stash_buckets, old_num_buckets, old_num_stash_buckets, {}});
+		retired_bytes_ += old_num_buckets * sizeof(Bucket) + old_num_stash_buckets * sizeof(StashBucket);
+		reclaim_lock_.Unlock();
+	} else {
+		FreeArrays(old_buckets, old_stash_buckets, old_num_buckets, old_num_stash_buckets);
+	}
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::RetireKeys(KeyArena &arena) {
+	if (concurrent && arena.Bytes() > 0) {
+		reclaim_lock_.Lock();
+		retired_bytes_ += arena.Bytes();
+		retired_.push_back({epoch_, nullptr, nullptr, 0, 0, std::make_unique<KeyArena>()});
+		retired_.back().keys->Swap(arena);
+		reclaim_lock_.Unlock();
+	}
+	arena.Clear();
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::Reclaim() {
+	auto readers_in = [this](uint64_t epoch) {
+		for (size_t i = 0; i < num_reader_shards; i++) {
+			if (reader_shards_[i].counts_[epoch & 1].load() != 0) {
+				return true;
+			}
+		}
+		return false;
+	};
+
+	// Readers of the current epoch share their counts with those of the epoch after next, so the epoch advances
+	// only as far as memory retired so far needs
+	uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+	while (retired_.back().epoch + 2 > epoch && !readers_in(epoch + 1)) {
+		epoch_.store(++epoch);
+	}
+
+	size_t n = 0;
+	for (; n < retired_.size() && retired_[n].epoch + 2 <= epoch; n++) {
+		Retired &retired = retired_[n];
+		FreeArrays(retired.buckets, retired.stash_buckets, retired.num_buckets, retired.num_stash_buckets);
+		retired_bytes_ -= retired.num_buckets * sizeof(Bucket) + retired.num_stash_buckets * sizeof(StashBucket) +
+											(retired.keys != nullptr ? retired.keys->Bytes() : 0);
+	}
+	retired_.erase(retired_.begin(), retired_.begin() + n);
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::AllocateBuckets(size_t num_buckets) -> Bucket * {
+	static_assert(alignof(Bucket) <= CACHELINE_SIZE && alignof(StashBucket) <= CACHELINE_SIZE);
+	Bucket *buckets = static_cast<Bucket *>(Allocator::Allocate(num_buckets * sizeof(Bucket)));
+	std::uninitialized_default_construct_n(buckets, num_buckets);
+	return buckets;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::AllocateStashBuckets(size_t num_stash_buckets) -> StashBucket * {
+	if (num_stash_buckets == 0) {
+		return nullptr;
+	}
+	StashBucket *stash_buckets = static_cast<StashBucket *>(Allocator::Allocate(num_stash_buckets * sizeof(StashBucket)));
+	std::uninitialized_default_construct_n(stash_buckets, num_stash_buckets);
+	return stash_buckets;
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::FreeArrays(Bucket *buckets, StashBucket *stash_buckets, size_t num_buckets, size_t num_stash_buckets) {
+	for (auto it = mappings_.begin(); it != mappings_.end(); it++) {
+		if (reinterpret_cast<char *>(buckets) == static_cast<char *>(it->addr) + snapshot_alignment) {
+			munmap(it->addr, it->size);
+			mappings_.erase(it);
+			return;
+		}
+	}
+
+	if (buckets != nullptr) {
+		std::destroy_n(buckets, num_buckets);
+		Allocator::Deallocate(buckets, num_buckets * sizeof(Bucket));
+	}
+	if (stash_buckets != nullptr) {
+		std::destroy_n(stash_buckets, num_stash_buckets);
+		Allocator::Deallocate(stash_buckets, num_stash_buckets * sizeof(StashBucket));
+	}
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::SnapshotType() -> SnapshotHeader {
+	static_assert(sizeof(SnapshotHeader) <= snapshot_alignment);
+	SnapshotHeader header{};
+	memcpy(header.magic_, snapshot_magic, sizeof(snapshot_magic));
+	header.version_ = snapshot_version;
+	header.flags_ = (buffered ? 1 : 0) | (partial_key ? 2 : 0) | (Policy::max_minor_overflows << 2) |
+									(soa_bucket ? 32 : 0) | ((num_choices - 2) << 6);
+	header.tuple_size_ = sizeof(Tuple);
+	header.bucket_size_ = sizeof(Bucket);
+	header.stash_bucket_size_ = sizeof(StashBucket);
+	uint32_t hash1 = H1()(K());
+	header.hash_check_ = (static_cast<uint64_t>(hash1) << 32) | Hash2(K(), hash1);
+	return header;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::stats() const -> DleftStats {
+	DleftStats snapshot;
+	uint64_t counts[num_stats] = {};
+	if (with_stats) {
+		for (size_t i = 0; i < num_stats_shards; i++) {
+			for (int stat = 0; stat < num_stats; stat++) {
+				counts[stat] += stats_shards_[i].counts_[stat].load(std::memory_order_relaxed);
+			}
+		}
+	}
+	snapshot.false_positives = counts[false_positives];
+	snapshot.minor_overflows = counts[minor_overflows];
+	snapshot.major_overflows = counts[major_overflows];
+	snapshot.one_move_attempts = counts[one_move_attempts];
+	snapshot.one_move_successes = counts[one_move_successes];
+	snapshot.resizes = counts[resizes];
+	snapshot.resize_ns = counts[resize_ns];
+	std::copy(counts + path_lengths, counts + num_stats, snapshot.path_lengths);
+	snapshot.bytes_in_use = memory_usage();
+	return snapshot;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::save(const char *path) -> bool {
+	static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value && !var_key && !slab_value,
+								"snapshots store keys and values as raw bytes, so they cannot point into a key arena or a slab");
+	LockAll();
+	FinishMigration();  // Keys that are not migrated yet would be lost otherwise
+
+	FILE *file = fopen(path, "wb");
+	if (file == nullptr) {
+		UnlockAll();
+		return false;
+	}
+
+	SnapshotHeader header = SnapshotType();
+	header.num_buckets_ = num_buckets_;
+	header.num_stash_buckets_ = num_stash_buckets_;
+	header.size_ = size_;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+						fseek(file, snapshot_alignment, SEEK_SET) == 0 &&  // Leaves a hole up to the arrays
+						fwrite(buckets_, sizeof(Bucket), num_buckets_, file) == num_buckets_ &&
+						fseek(file, SnapshotStashBucketsOffset(num_buckets_), SEEK_SET) == 0 &&
+						fwrite(stash_buckets_, sizeof(StashBucket), num_stash_buckets_, file) == num_stash_buckets_;
+	ok = (fclose(file) == 0) && ok;
+
+	UnlockAll();
+	return ok;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::open_mapped(const char *path) -> bool {
+	static_assert(std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value && !var_key && !slab_value,
+								"snapshots store keys and values as raw bytes, so they cannot point into a key arena or a slab");
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) < snapshot_alignment) {
+		close(fd);
+		return false;
+	}
+	size_t file_size = file_stat.st_size;
+	void *addr = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);  // The mapping stays valid
+	if (addr == MAP_FAILED) {
+		return false;
+	}
+
+	// Check that the snapshot was saved by a table of the same type, and that its arrays are all there
+	const SnapshotHeader *header = static_cast<const SnapshotHeader *>(addr);
+	SnapshotHeader type = SnapshotType();
+	size_t num_buckets = header->num_buckets_;
+	size_t num_stash_buckets = header->num_stash_buckets_;
+	if (memcmp(header, &type, offsetof(SnapshotHeader, num_buckets_)) != 0 ||
+			num_buckets == 0 || ROUNDUP_POWER_2(num_buckets) != num_buckets ||
+			num_buckets - 1 > std::numeric_limits<idx_t>::max() ||
+			num_stash_buckets != num_buckets / Policy::stash_ratio ||
+			file_size < SnapshotStashBucketsOffset(num_buckets) + num_stash_buckets * sizeof(StashBucket)) {
+		munmap(addr, file_size);
+		return false;
+	}
+
+	LockAll();
+	if (Migrating()) {  // Drop the current contents, as `clear` does
+		Retire(old_buckets_, old_stash_buckets_, old_num_buckets_, old_num_stash_buckets_);
+		old_buckets_ = nullptr;
+		old_stash_buckets_ = nullptr;
+	}
+	Retire(buckets_, stash_buckets_, num_buckets_, num_stash_buckets_);
+
+	mappings_.push_back({addr, file_size});
+	buckets_ = reinterpret_cast<Bucket *>(static_cast<char *>(addr) + snapshot_alignment);
+	stash_buckets_ = num_stash_buckets == 0 ? nullptr : reinterpret_cast<StashBucket *>(
+			static_cast<char *>(addr) + SnapshotStashBucketsOffset(num_buckets));
+	num_buckets_ = num_buckets;
+	num_stash_buckets_ = num_stash_buckets;
+	size_ = header->size_;
+	UpdateShrinkSize();
+	UnlockAll();
+
+	return true;
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::CompactKeys() {
+	KeyArena arena;
+	size_t key_bytes = 0;
+	auto copy = [this, &arena, &key_bytes](StoredKey &key, StoredValue &) {
+		key = arena.Copy(View(key, arena_));  // Only the offset changes; the key stays in its slot
+		key_bytes += key.size();
+	};
+	ForEachIn(copy, buckets_, stash_buckets_, num_buckets_, num_stash_buckets_, 0, 1);
+	RetireKeys(arena_);
+	arena_.Swap(arena);
+	key_bytes_ = key_bytes;
+	compact_keys_ = false;
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::CompactKeysIfNeeded() {
+	if (!compact_keys_ || Migrating()) {  // A migration copies the keys anyway
+		return;
+	}
+	if (incremental) {
+		StartMigration(BucketCapacity());
+	} else {
+		CompactKeys();
+	}
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::Grow() {
+	if (!incremental) {
+		Resize(BucketCapacity() * 2, resize_threads_);
+	} else if (Migrating()) {
+		FinishMigration();
+	} else {
+		StartMigration(BucketCapacity() * 2);
+	}
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::Shrink() {
+	if (Migrating() || num_buckets_ == 1) {  // An incremental shrink waits for the ongoing migration to end
+		return;
+	}
+	if (incremental) {  // Keys that do not fit into the smaller arrays as they migrate grow them again
+		StartMigration(BucketCapacity() / 2);
+	} else if (!Resize(BucketCapacity() / 2, resize_threads_)) {
+		shrink_size_ = shrink_size_ / 2;
+	}
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::shrink_to_fit() {
+	LockAll();
+	FinishMigration();
+	size_t num_buckets = ROUNDUP_POWER_2(ROUND_UP(size_ * 100, MAX_LOAD_FACTOR_100 * Bucket::bucket_capacity));
+	while (num_buckets < num_buckets_ && !Resize(num_buckets * Bucket::bucket_capacity, resize_threads_)) {
+		num_buckets *= 2;
+	}
+	UnlockAll();
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::StartMigration(size_t new_size) {
+	const auto start = StatsClock();
+	size_t new_capacity = ROUNDUP_POWER_2(new_size / Bucket::bucket_capacity);
+
+	CheckNumBuckets(new_capacity);
+	old_buckets_ = buckets_;
+	old_stash_buckets_ = stash_buckets_;
+	old_num_buckets_ = num_buckets_;
+	old_num_stash_buckets_ = num_stash_buckets_;
+	migrate_idx_ = 0;
+
+	num_buckets_ = new_capacity;
+	num_stash_buckets_ = num_buckets_ / Policy::stash_ratio;
+	buckets_ = AllocateBuckets(num_buckets_);
+	stash_buckets_ = AllocateStashBuckets(num_stash_buckets_);
+	if constexpr (var_key) {  // Keys are copied into a new arena as they migrate
+		old_arena_.Swap(arena_);
+		key_bytes_ = 0;
+		compact_keys_ = false;
+	}
+	UpdateShrinkSize();
+	CountResize(start);
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::MigrateKey(uint32_t hash1, uint32_t hash2) {
+	uint32_t hashes[num_choices];
+	idx_t idxs[num_choices];
+	for (int i = 0, n = Candidates(hash1, hash2, old_num_buckets_, hashes, idxs); i < n; i++) {
+		MigrateBucket(idxs[i]);
+	}
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::Migrate(size_t n) {
+	if (!Migrating()) {
+		return;
+	}
+	for (size_t end = std::min(old_num_buckets_, migrate_idx_ + n); migrate_idx_ < end; migrate_idx_++) {
+		MigrateBucket(migrate_idx_);
+	}
+	if (migrate_idx_ == old_num_buckets_) {
+		Retire(old_buckets_, old_stash_buckets_, old_num_buckets_, old_num_stash_buckets_);
+		old_buckets_ = nullptr;
+		old_stash_buckets_ = nullptr;
+		old_arena_.Clear();
+	}
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::MigrateBucket(idx_t idx) {
+	Bucket *bucket = &old_buckets_[idx];
+	StashBucket *stash_bucket = nullptr;
+
+	// Moves a key into the new arrays, growing them in the unlikely case that they are full already
+	auto migrate = [this](auto &&tuple) {
+		auto &&key = View(tuple.key, old_arena_);
+		uint32_t hash1 = H1()(key), hash2 = Hash2(key, hash1);
+		if constexpr (var_key) {  // Its bytes move into the new arena, as the old one goes with the old arrays
+			tuple.key = StoreKey(key);
+		}
+		while (!Append(std::move(tuple.key), std::move(tuple.value), hash1, hash2)) {
+			Resize(BucketCapacity() * 2);
+		}
+		size_--;  // `Append` counts it, but it has been counted already
+	};
+
+	for (int i = 0; i < Bucket::bucket_capacity; i++) {
+		if (GET_BIT(bucket->validity_, i)) {
+			migrate(bucket->tuples_[i]);
+		}
+	}
+
+	if (bucket->overflow_count_ > 0 && old_stash_buckets_ != nullptr) {
+		stash_bucket = &old_stash_buckets_[bucket->GetStashBucketIndex(idx, old_num_stash_buckets_)];
+		for (int i = 0; i < Bucket::max_minor_overflows; i++) {
+			if (GET_BIT(bucket->overflow_info_, i)) {
+				migrate(stash_bucket->tuples_[bucket->overflow_pos_[i]]);
+				CLEAR_BIT_256(stash_bucket->validity_, bucket->overflow_pos_[i]);
+			}
+		}
+
+		// Major overflows do not record their bucket, but one that hashes here belongs either to this bucket or to
+		// another candidate bound to the same stash bucket; either way it is fine to migrate it now
+		for (int i = 0; i < StashBucket::max_major_overflows; i++) {
+			uint8_t pos = stash_bucket->position_[i];
+			if (bucket->overflow_count_ == bucket->GetMinorOverflowCount() || pos == StashBucket::invalid_pos) {
+				continue;
+			}
+			auto &&key = View(stash_bucket->tuples_[pos].key, old_arena_);
+			uint32_t hash1 = H1()(key), hash2 = Hash2(key, hash1);
+			uint32_t hashes[num_choices];
+			idx_t idxs[num_choices];
+			int n = Candidates(hash1, hash2, old_num_buckets_, hashes, idxs);
+			if (std::find(idxs, idxs + n, idx) != idxs + n) {
+				migrate(stash_bucket->tuples_[pos]);
+				CLEAR_BIT_256(stash_bucket->validity_, pos);
+				stash_bucket->position_[i] = StashBucket::invalid_pos;
+			}
+		}
+	}
+
+	bucket->Clear();
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::Resize(size_t new_size, size_t num_threads) -> bool {
+	size_t old_num_buckets = num_buckets_;
+	size_t old_num_stash_buckets = num_stash_buckets_;
+	Bucket *old_buckets = buckets_;
+	StashBucket *old_stash_buckets = stash_buckets_;
+	size_t old_size = size_;  // `Append` counts the rehashed keys again, so the size is restored afterwards
+	size_t new_capacity = ROUNDUP_POWER_2(new_size / Bucket::bucket_capacity);
+
+	if (num_buckets_ == new_capacity) {
+		return true;
+	}
+	const auto start = StatsClock();
+
+	CheckNumBuckets(new_capacity);
+	num_buckets_ = new_capacity;
+	num_stash_buckets_ = num_buckets_ / Policy::stash_ratio;
+	buckets_ = AllocateBuckets(num_buckets_);
+	stash_buckets_ = AllocateStashBuckets(num_stash_buckets_);
+
+	if (num_threads > 1) {  // Each thread rehashes a slice of both old arrays
+		auto source = [=](size_t slice, size_t num_slices, auto &&fn) {
+			ForEachIn(fn, old_buckets, old_stash_buckets, old_num_buckets, old_num_stash_buckets, slice, num_slices);
+		};
+		if (!BulkPlace<true>(source, old_size, num_threads)) {
+			goto resize_failed;
+		}
+		goto resize_done;
+	}
+
+	for (size_t i = 0; i < old_num_buckets; i++) {  // Iterate over normal buckets and rehash the keys
+		for (auto j = 0; j < Bucket::bucket_capacity; j++) {
+			if (!GET_BIT(old_buckets[i].validity_, j)) {
+				continue;
+			}
+			auto &slot_key = old_buckets[i].tuples_[j].key;
+			auto &value = old_buckets[i].tuples_[j].value;
+			auto &&key = View(slot_key, arena_);
+			uint32_t hash1 = H1()(key);
+			if (!Append(StoredKey(slot_key), std::move(value), hash1, Hash2(key, hash1))) {
+				goto resize_failed;
+			}
+		}
+	}
+	for (size_t i = 0; i < old_num_stash_buckets; i++) {  // Iterate over stash buckets and rehash the keys
+		for (auto j = 0; j < StashBucket::bucket_capacity; j++) {
+			if (!GET_BIT_256(old_stash_buckets[i].validity_, j)) {
+				continue;
+			}
+			auto &slot_key = old_stash_buckets[i].tuples_[j].key;
+			auto &value = old_stash_buckets[i].tuples_[j].value;
+			auto &&key = View(slot_key, arena_);
+			uint32_t hash1 = H1()(key);
+			if (!Append(StoredKey(slot_key), std::move(value), hash1, Hash2(key, hash1))) {
+				goto resize_failed;
+			}
+		}
+	}
+
+ resize_done:
+	Retire(old_buckets, old_stash_buckets, old_num_buckets, old_num_stash_buckets);
+	if constexpr (var_key) {  // Every key has just been rehashed, so copying its bytes as well costs little more
+		if (!Migrating()) {
+			CompactKeys();
+		}
+	}
+	size_ = old_size;
+	UpdateShrinkSize();
+	CountResize(start);
+
+	return true;
+
+ resize_failed:  // If any insertion fails, resize fails
+	if (num_threads <= 1) {  // The keys were copied, so the values moved so far can be found and moved back
+		auto move_back = [&](StoredKey &slot_key, StoredValue &value) {
+			auto &&key = View(slot_key, arena_);
+			uint32_t hash1 = H1()(key);
+			*FindValueIn(Lookup(key, arena_), hash1, Hash2(key, hash1), old_buckets, old_stash_buckets, old_num_buckets,
+									 old_num_stash_buckets) = std::move(value);
+		};
+		ForEachIn(move_back, buckets_, stash_buckets_, num_buckets_, num_stash_buckets_, 0, 1);
+	}
+ 	Retire(buckets_, stash_buckets_, num_buckets_, num_stash_buckets_);
+
+	num_buckets_ = old_num_buckets;
+	num_stash_buckets_ = old_num_stash_buckets;
+	buckets_ = old_buckets;
+	stash_buckets_ = old_stash_buckets;
+	size_ = old_size;
+
+	return false;
+}
+
+DLEFT_TEMPLATE
+template <class Value>
+auto DLEFT_TYPE::Bucket::Insert(StoredKey &&key, Value &&value, uint32_t hash, StashBucket *stash_bucket) -> bool {
+	TupleStatus status;
+	int mask;
+	uint8_t idx, pos;
+
+	pos = FindPos(key, hash, stash_bucket, status);
+	switch (status) {  // If found a duplicate, overwrite it
+	 case TupleStatus::IN_BUCKET:
+		AssignValue(tuples_[pos].value, std::forward<Value>(value));
+		return true;
+
+	 case TupleStatus::MINOR_OVERFLOW:
+	 	AssignValue(stash_bucket->tuples_[overflow_pos_[pos]].value, std::forward<Value>(value));
+		return true;
+
+	 UNLIKELY( case TupleStatus::MAJOR_OVERFLOW: )
+	 	AssignValue(stash_bucket->tuples_[stash_bucket->position_[pos]].value, std::forward<Value>(value));
+		return true;
+
+	 default:  // Otherwise find an empty slot and insert
+	 	assert(status == TupleStatus::NOT_FOUND);
+	  return Append(std::forward<StoredKey>(key), std::forward<Value>(value), hash, stash_bucket);
+	}
+}
+
+DLEFT_TEMPLATE
+template <class Value>
+auto DLEFT_TYPE::Bucket::Append(StoredKey &&key, Value &&value, uint32_t hash, StashBucket *stash_bucket) -> bool {
+	int mask;
+	uint8_t idx, pos;
+
+	pos = FindFreeSlot();
+	if (pos < bucket_capacity) {  // If bucket has a free slot, insert there
+		InsertAt(std::forward<StoredKey>(key), std::forward<Value>(value), pos, hash);
+		return true;
+	}  // Otherwise insert into the stash bucket
+
+	if (stash_bucket == nullptr) {
+		return false;
+	}
+
+	if (LIKELY( GetMinorOverflowCount() < max_minor_overflows )) {  // Insert as a minor overflow
+		pos = stash_bucket->InsertMinorOverflow(std::forward<StoredKey>(key), std::forward<Value>(value));
+		if (pos == StashBucket::invalid_pos) {
+			return false;
+		}
+
+		// Insert minor overflow metadata
+		idx = __builtin_ctz(~GetMinorOverflowValidity());
+		overflow_count_++;
+		overflow_fp_[idx] = FINGERPRINT16(hash);
+		overflow_pos_[idx] = pos;
+		SET_BIT(overflow_info_, idx);
+		DEBUG_DLEFT(
+			printf("Minor overflow from bucket %ld to stash bucket %ld\n",
+					 	 this - reinterpret_cast<Bucket *>(buckets),
+					 	 stash_bucket - reinterpret_cast<StashBucket *>(stash_buckets));
+		)
+
+		return true;
+	}
+
+	// Minor overflow slots used up; Insert as a major overflow
+	if (stash_bucket->AppendMajorOverflow(std::forward<StoredKey>(key), std::forward<Value>(value), hash)) {
+		overflow_count_++;
+		DEBUG_DLEFT(
+			printf("Major overflow from bucket %ld to stash bucket %ld\n",
+					 	 this - reinterpret_cast<Bucket *>(buckets),
+					 	 stash_bucket - reinterpret_cast<StashBucket *>(stash_buckets));
+		)
+		return true;
+	}
+	return false;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::Bucket::Erase(const LookupKey &key, uint32_t hash, StashBucket *stash_bucket, StatsShard *stats_shard)
+		-> bool {
+	TupleStatus status;
+	uint8_t pos;
+
+	pos = FindPos(key, hash, stash_bucket, status, stats_shard);
+	switch (status) {  // Remove `key` depending on its position
+	 case TupleStatus::IN_BUCKET:
+		CLEAR_BIT(validity_, pos);
+		return true;
+
+	 case TupleStatus::MINOR_OVERFLOW:
+	 	CLEAR_BIT_256(stash_bucket->validity_, overflow_pos_[pos]);
+	 	CLEAR_BIT(overflow_info_, pos);
+		overflow_count_--;  // The table then promotes a major overflow, if any, into the freed slot (see `Promote`)
+		return true;
+
+	 case TupleStatus::MAJOR_OVERFLOW:
+	 	CLEAR_BIT_256(stash_bucket->validity_, stash_bucket->position_[pos]);
+		stash_bucket->position_[pos] = StashBucket::invalid_pos;
+		overflow_count_--;
+		return true;
+
+	 default:
+	 	assert(status == TupleStatus::NOT_FOUND);
+	  return false;
+	}
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::Bucket::Find(const LookupKey &key, StoredValue *value, uint32_t hash, const StashBucket *stash_bucket,
+															StatsShard *stats_shard) const -> bool {
+	return Find(key, value, hash, MatchSlots(key, hash), MatchOverflows(hash), stash_bucket, stats_shard);
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::Bucket::Find(const LookupKey &key, StoredValue *value, uint32_t hash, uint16_t fp_mask,
+															uint8_t overflow_mask, const StashBucket *stash_bucket, StatsShard *stats_shard) const
+		-> bool {
+	TupleStatus status;
+	uint8_t pos;
+
+	pos = FindPos(key, hash, fp_mask, overflow_mask, stash_bucket, status, stats_shard);
+	if (value == nullptr) {  // Only a membership test
+		return status != TupleStatus::NOT_FOUND;
+	}
+	switch (status) {  // Store `key`'s associate value depending on its position
+	 case TupleStatus::IN_BUCKET:
+		*value = tuples_[pos].value;
+		return true;
+
+	 case TupleStatus::MINOR_OVERFLOW:
+	 	*value = stash_bucket->tuples_[overflow_pos_[pos]].value;
+		return true;
+
+	 case TupleStatus::MAJOR_OVERFLOW:
+	 	*value = stash_bucket->tuples_[stash_bucket->position_[pos]].value;
+		return true;
+
+	 default:
+	 	assert(status == TupleStatus::NOT_FOUND);
+	  return false;
+	}
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::Bucket::FindPos(const LookupKey &key, uint32_t hash, const StashBucket *stash_bucket,
+																 TupleStatus &status, StatsShard *stats_shard) const -> uint8_t {
+	return FindPos(key, hash, MatchSlots(key, hash), MatchOverflows(hash), stash_bucket, status, stats_shard);
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::Bucket::FindPos(const LookupKey &key, uint32_t hash, uint16_t fp_mask, uint8_t overflow_mask,
+																 const StashBucket *stash_bucket, TupleStatus &status,
+																 StatsShard *stats_shard) const -> uint8_t {
+	int mask;
+	uint8_t idx, pos;
+
+	mask = fp_mask;  // Search normal keys, filtering out unlikely slots using fingerprints
+	if constexpr (compare_key) {  // The keys were compared already
+		if (mask != 0) {
+			status = TupleStatus::IN_BUCKET;
+			return __builtin_ctz(mask);
+		}
+	} else {
+		while (mask != 0) {
+			pos = __builtin_ctz(mask);
+			if (LIKELY( tuples_[pos].key == key )) {
+				status = TupleStatus::IN_BUCKET;
+				return pos;
+			}
+			Count(stats_shard, false_positives);
+			mask &= ~(1 << pos);
+		}
+	}
+
+	if (stash_bucket == nullptr) {
+		goto not_found;
+	}
+
+	mask = overflow_mask;  // Search minor overflows, again using fingerprints
+	while (mask != 0) {
+		idx = __builtin_ctz(mask) / 2;
+		if (GET_BIT(overflow_info_, idx)) {
+			if (LIKELY( stash_bucket->tuples_[overflow_pos_[idx]].key == key )) {
+				status = TupleStatus::MINOR_OVERFLOW;
+				return idx;
+			}
+			Count(stats_shard, false_positives);
+		}
+		mask &= ~(3 << (idx * 2));
+	}
+
+	if (UNLIKELY( overflow_count_ > GetMinorOverflowCount() )) {  // Search major overflows in stash bucket
+		idx = stash_bucket->FindMajorOverflowIdx(key, hash, stats_shard);
+		if (idx != StashBucket::invalid_pos) {
+			status = TupleStatus::MAJOR_OVERFLOW;
+			return idx;
+		}
+	}
+
+ not_found:
+	status = TupleStatus::NOT_FOUND;
+	return StashBucket::invalid_pos;
+}
+
+DLEFT_TEMPLATE
+template <class Value>
+void DLEFT_TYPE::Bucket::InsertAt(StoredKey &&key, Value &&value, uint8_t pos, uint32_t hash) {
+	tuples_[pos].key = std::move(key);
+	StoreValue(tuples_[pos].value, std::forward<Value>(value));
+	fingerprints_[pos] = FINGERPRINT8(hash);
+	SET_BIT(validity_, pos);
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::Bucket::FindFreeSlot() -> uint8_t {
+	if (buffered && (validity_ & buf_mask) == buf_mask) {
+		Flush();
+	}
+	return __builtin_ctz(~validity_);  // Lowest free slot, which is in the write buffer if it has room
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::Bucket::Flush() {
+	uint16_t free_slots = ~validity_ & ~buf_mask & slot_mask;
+	uint8_t dst;
+
+	for (uint8_t pos = 0; pos < buf_capacity && free_slots != 0; pos++) {
+		if (!GET_BIT(validity_, pos)) {
+			continue;
+		}
+		dst = __builtin_ctz(free_slots);
+		free_slots &= free_slots - 1;
+		tuples_[dst] = std::move(tuples_[pos]);
+		fingerprints_[dst] = fingerprints_[pos];
+		SET_BIT(validity_, dst);
+		CLEAR_BIT(validity_, pos);
+	}
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::Bucket::PrefetchOverflows(uint32_t hash, const StashBucket *stash_bucket) const {
+	int mask;
+	uint8_t idx;
+
+	PREFETCH(stash_bucket);  // Header of the stash bucket, needed for major overflows
+
+	mask = MatchOverflows(hash);  // Only minor overflows with matching fingerprints are read
+	while (mask != 0) {
+		idx = __builtin_ctz(mask) / 2;
+		if (GET_BIT(overflow_info_, idx)) {
+			PREFETCH(&stash_bucket->tuples_[overflow_pos_[idx]]);
+		}
+		mask &= ~(3 << (idx * 2));
+	}
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::Bucket::MatchKeysSSE2(const K &key) const -> uint16_t {
+	uint32_t mask = 0;
+	if constexpr (sizeof(K) == 4) {
+		__m128i val_vec = _mm_set1_epi32(static_cast<int32_t>(key));
+		for (int i = 0; i < bucket_capacity; i += 4) {
+			__m128i src_vec = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&tuples_.keys_[i]));
+			mask |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(val_vec, src_vec))) << i;
+		}
+	} else {  // SSE2 has no 64-bit compare, so both halves of a key must match
+		__m128i val_vec = _mm_set1_epi64x(static_cast<int64_t>(key));
+		for (int i = 0; i < bucket_capacity; i += 2) {
+			__m128i src_vec = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&tuples_.keys_[i]));
+			__m128i result = _mm_cmpeq_epi32(val_vec, src_vec);
+			result = _mm_and_si128(result, _mm_shuffle_epi32(result, _MM_SHUFFLE(2, 3, 0, 1)));
+			mask |= _mm_movemask_pd(_mm_castsi128_pd(result)) << i;
+		}
+	}
+	return mask & validity_;
+}
+
+DLEFT_TEMPLATE
+TARGET_AVX2 auto DLEFT_TYPE::Bucket::MatchKeysAVX2(const K &key) const -> uint16_t {
+	uint32_t mask = 0;
+	if constexpr (sizeof(K) == 4) {
+		__m256i val_vec = _mm256_set1_epi32(static_cast<int32_t>(key));
+		for (int i = 0; i < bucket_capacity; i += 8) {
+			__m256i src_vec = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&tuples_.keys_[i]));
+			mask |= _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(val_vec, src_vec))) << i;
+		}
+	} else {
+		__m256i val_vec = _mm256_set1_epi64x(static_cast<int64_t>(key));
+		for (int i = 0; i < bucket_capacity; i += 4) {
+			__m256i src_vec = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&tuples_.keys_[i]));
+			mask |= _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(val_vec, src_vec))) << i;
+		}
+	}
+	return mask & validity_;
+}
+
+DLEFT_TEMPLATE
+void DLEFT_TYPE::Bucket::ProbeSSE2(const Bucket *bucket1, const Bucket *bucket2, uint32_t hash1, uint32_t hash2,
+																	 ProbeMasks &masks) {
+	masks.fingerprints = bucket1->MatchFingerprints(hash1) | (bucket2->MatchFingerprints(hash2) << 16);
+	masks.overflows = bucket1->MatchOverflows(hash1) | (bucket2->MatchOverflows(hash2) << 8);
+}
+
+DLEFT_TEMPLATE
+TARGET_AVX2 void DLEFT_TYPE::Bucket::ProbeAVX2(const Bucket *bucket1, const Bucket *bucket2, uint32_t hash1,
+																							 uint32_t hash2, ProbeMasks &masks) {
+	// Fingerprints of the first bucket in the low lane, and of the second bucket in the high lane
+	__m256i src_vec = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(bucket1->fingerprints_))),
+			_mm_loadu_si128(reinterpret_cast<const __m128i *>(bucket2->fingerprints_)), 1);
+	__m256i val_vec = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_set1_epi8(static_cast<uint8_t>(FINGERPRINT8(hash1)))),
+			_mm_set1_epi8(static_cast<uint8_t>(FINGERPRINT8(hash2))), 1);
+	uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(val_vec, src_vec));
+
+	masks.fingerprints = mask & (bucket1->validity_ | (static_cast<uint32_t>(bucket2->validity_) << 16));
+	masks.overflows = bucket1->MatchOverflows(hash1) | (bucket2->MatchOverflows(hash2) << 8);
+}
+
+DLEFT_TEMPLATE
+TARGET_AVX512 void DLEFT_TYPE::Bucket::ProbeAVX512(const Bucket *bucket1, const Bucket *bucket2, uint32_t hash1,
+																									 uint32_t hash2, ProbeMasks &masks) {
+	static_assert(offsetof(Bucket, fingerprints_) == 0 && offsetof(Bucket, overflow_fp_) == 20,
+								"the AVX-512 kernel relies on the header layout");
+	constexpr __mmask64 second_bucket = 0xffffffff00000000ull;
+	constexpr __mmask64 overflow_fps = 0x0ff000000ff00000ull;  // bytes 20-27 of each header
+
+	// Headers of both buckets, each compared with 8-bit fingerprints in `fingerprints_`, and with
+	// 16-bit fingerprints in `overflow_fp_`
+	__m512i src_vec = _mm512_mask_broadcast_i64x4(
+			_mm512_maskz_broadcast_i64x4(0x0f, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bucket1))), 0xf0,
+			_mm256_loadu_si256(reinterpret_cast<const __m256i *>(bucket2)));
+	__m512i fp8_vec = _mm512_mask_blend_epi8(second_bucket,
+			_mm512_set1_epi8(static_cast<uint8_t>(FINGERPRINT8(hash1))),
+			_mm512_set1_epi8(static_cast<uint8_t>(FINGERPRINT8(hash2))));
+	__m512i fp16_vec = _mm512_mask_blend_epi8(second_bucket,
+			_mm512_set1_epi16(static_cast<uint16_t>(FINGERPRINT16(hash1))),
+			_mm512_set1_epi16(static_cast<uint16_t>(FINGERPRINT16(hash2))));
+	__m512i val_vec = _mm512_mask_blend_epi8(overflow_fps, fp8_vec, fp16_vec);
+	uint64_t mask = _mm512_cmpeq_epi8_mask(val_vec, src_vec);
+	uint64_t mask16 = mask & (mask >> 1);  // A 16-bit fingerprint matches if both of its bytes match
+
+	masks.fingerprints = ((mask & 0xffff) | ((mask >> 16) & 0xffff0000)) &
+											 (bucket1->validity_ | (static_cast<uint32_t>(bucket2->validity_) << 16));
+	masks.overflows = ((mask16 >> 20) & 0x55) | (((mask16 >> 52) & 0x55) << 8);
+}
+
+DLEFT_TEMPLATE
+template <class Value>
+auto DLEFT_TYPE::StashBucket::InsertMajorOverflow(StoredKey &&key, Value &&value, uint32_t hash) -> bool {
+	uint8_t idx, pos;
+
+	idx = FindMajorOverflowIdx(key, hash);
+	if (idx != invalid_pos) {  // Overwrite duplicate if found
+		AssignValue(tuples_[position_[idx]].value, std::forward<Value>(value));
+		return true;
+	}
+
+	return AppendMajorOverflow(std::forward<StoredKey>(key), std::forward<Value>(value), hash);  // Insert at an empty slot
+}
+
+DLEFT_TEMPLATE
+template <class Value>
+auto DLEFT_TYPE::StashBucket::AppendMajorOverflow(StoredKey &&key, Value &&value, uint32_t hash) -> bool {
+	uint8_t idx, pos;
+
+	if ((pos = FindFreeSlot()) == invalid_pos) {  // No free slots, so insertion fails
+		return false;
+	}
+
+	if (position_[0] == invalid_pos) {
+		idx = 0;
+	} else if (position_[1] == invalid_pos) {
+		idx = 1;
+	} else {  // Major overflow metadata used up, so insertion fails
+		return false;
+	}
+
+	tuples_[pos].key = std::move(key);
+	StoreValue(tuples_[pos].value, std::forward<Value>(value));
+	position_[idx] = pos;
+	fingerprints_[idx] = FINGERPRINT16(hash);
+	SET_BIT_256(validity_, pos);
+
+	return true;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::StashBucket::EraseMajorOverflow(const LookupKey &key, uint32_t hash) -> bool {
+	uint8_t idx = FindMajorOverflowIdx(key, hash);
+	if (idx == invalid_pos) {
+		return false;
+	}
+	CLEAR_BIT_256(validity_, position_[idx]);
+	position_[idx] = invalid_pos;
+	return true;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::StashBucket::FindMajorOverflow(const LookupKey &key, StoredValue *value, uint32_t hash) const -> bool {
+	uint8_t idx = FindMajorOverflowIdx(key, hash);
+	if (idx == invalid_pos) {
+		return false;
+	}
+	if (value != nullptr) {
+		*value = tuples_[position_[idx]].value;
+	}
+	return true;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::StashBucket::FindMajorOverflowIdx(const LookupKey &key, uint32_t hash, StatsShard *stats_shard) const
+		-> uint8_t {
+	uint8_t idx;
+
+	if (position_[0] != invalid_pos && fingerprints_[0] == FINGERPRINT16(hash)) {
+		if (LIKELY( tuples_[position_[0]].key == key )) {
+			return 0;
+		}
+		Count(stats_shard, false_positives);
+	}
+	if (position_[1] != invalid_pos && fingerprints_[1] == FINGERPRINT16(hash)) {
+		if (LIKELY( tuples_[position_[1]].key == key )) {
+			return 1;
+		}
+		Count(stats_shard, false_positives);
+	}
+	return invalid_pos;
+}
+
+DLEFT_TEMPLATE
+template <class Value>
+auto DLEFT_TYPE::StashBucket::InsertMinorOverflow(StoredKey &&key, Value &&value) -> uint8_t {
+	uint8_t pos;
+
+	// Find an empty slot and insert
+	if ((pos = FindFreeSlot()) == invalid_pos) {
+		return invalid_pos;
+	}
+	tuples_[pos].key = std::move(key);
+	StoreValue(tuples_[pos].value, std::forward<Value>(value));
+	SET_BIT_256(validity_, pos);
+
+	return pos;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::StashBucket::EraseMinorOverflow(const LookupKey &key, uint8_t pos) -> bool {
+	assert(GET_BIT_256(validity_, pos));
+	if (LIKELY( tuples_[pos].key == key )) {
+		CLEAR_BIT_256(validity_, pos);
+		return true;
+	}
+	return false;
+}
+
+DLEFT_TEMPLATE
+auto DLEFT_TYPE::StashBucket::FindMinorOverflow(const LookupKey &key, StoredValue *value, uint8_t pos) const -> bool {
+	assert(GET_BIT_256(validity_, pos));
+	if (LIKELY( tuples_[pos].key == key )) {
+		if (value != nullptr) {
+			*value = tuples_[pos].value;
+		}
+		return true;
+	}
+	return false;
+}
+
+// Splits the keys among `num_shards` independent tables, each guarded by its own lock, as an alternative to
+// the striped locks of concurrent mode: writers to different shards never contend, and a shard that fills up
+// resizes on its own, blocking only the threads that use it. A key goes to the shard given by the top bits of its
+// (remixed) first hash, and readers share a shard's lock, while writers take it exclusively.
+// `Table` is a `DleftFpStash`, which should not be concurrent itself, as it is only ever used under a lock.
+template <class K, class V, class H1, class H2, size_t num_shards = 64, class Table = DleftFpStash<K, V, H1, H2>>
+class ShardedDleft {
+ public:
+	ShardedDleft(size_t size = 0) : shards_(num_shards) {
+		if (size > 0) {
+			reserve(size);
+		}
+	}
+
+	auto insert(K &&key, V &&value) -> bool {
+		Shard &shard = shards_[ShardIdx(key)];
+		shard.lock.Lock();
+		bool inserted = shard.table.insert(std::forward<K>(key), std::forward<V>(value));
+		shard.lock.Unlock();
+		return inserted;
+	}
+
+	auto insert(const K &key, const V &value) -> bool {
+		Shard &shard = shards_[ShardIdx(key)];
+		shard.lock.Lock();
+		bool inserted = shard.table.insert(key, value);
+		shard.lock.Unlock();
+		return inserted;
+	}
+
+	// See `DleftFpStash::try_emplace` and `DleftFpStash::insert_or_assign`
+	template <class Key, class... Args>
+	auto try_emplace(Key &&key, Args &&...args) -> bool {
+		Shard &shard = shards_[ShardIdx(key)];
+		shard.lock.Lock();
+		bool inserted = shard.table.try_emplace(std::forward<Key>(key), std::forward<Args>(args)...);
+		shard.lock.Unlock();
+		return inserted;
+	}
+
+	template <class Key, class Value>
+	auto insert_or_assign(Key &&key, Value &&value) -> bool {
+		Shard &shard = shards_[ShardIdx(key)];
+		shard.lock.Lock();
+		bool inserted = shard.table.insert_or_assign(std::forward<Key>(key), std::forward<Value>(value));
+		shard.lock.Unlock();
+		return inserted;
+	}
+
+	auto erase(const K &key) -> bool {
+		Shard &shard = shards_[ShardIdx(key)];
+		shard.lock.Lock();
+		bool erased = shard.table.erase(key);
+		shard.lock.Unlock();
+		return erased;
+	}
+
+	auto find(const K &key, V &value) const -> bool {
+		const Shard &shard = shards_[ShardIdx(key)];
+		shard.lock.LockShared();
+		bool found = shard.table.find(key, value);
+		shard.lock.UnlockShared();
+		return found;
+	}
+
+	// Searches for `n` keys like `DleftFpStash::find_batch`, but groups them by shard first, so that each shard is
+	// locked once per batch, and its lookups still overlap their cache misses
+	void find_batch(const K *keys, V *values, bool *found, size_t n) const;
+
+	// Inserts `n` keys, grouped by shard like in `find_batch`, and returns how many of them were new
+	// Of duplicate keys, the first one wins, as if they were inserted one by one
+	auto insert_batch(const K *keys, const V *values, size_t n) -> size_t;
+
+	// Calls `fn(key, value)` on every key, one shard after another, each under its lock
+	template <class Fn>
+	void for_each(Fn fn) {
+		for (auto &shard : shards_) {
+			shard.lock.Lock();
+			shard.table.for_each(fn);
+			shard.lock.Unlock();
+		}
+	}
+
+	void clear() { ForEachShard([](Table &table) { table.clear(); }); }
+
+	void reserve(size_t size) { ForEachShard([size](Table &table) { table.reserve(size / num_shards); }); }
+
+	auto load_factor() const -> double { return 1.0 * size() / capacity(); }
+
+	auto capacity() const -> size_t { return Sum([](const Table &table) { return table.capacity(); }); }
+
+	auto size() const -> size_t { return Sum([](const Table &table) { return table.size(); }); }
+
+	// Bytes taken by the bucket arrays of every shard, and by the shards themselves
+	auto memory_usage() const -> size_t {
+		return num_shards * sizeof(Shard) + Sum([](const Table &table) { return table.memory_usage(); });
+	}
+
+	// Sums the counters of every shard (see `DleftFpStash::stats`)
+	auto stats() const -> DleftStats {
+		DleftStats sum;
+		for (const auto &shard : shards_) {
+			shard.lock.LockShared();
+			sum += shard.table.stats();
+			shard.lock.UnlockShared();
+		}
+		return sum;
+	}
+
+ private:
+	static_assert(num_shards > 0 && (num_shards & (num_shards - 1)) == 0, "the number of shards must be a power of 2");
+
+	static constexpr int shard_bits = __builtin_ctzll(num_shards);
+
+	// A spinlock shared by readers; a writer announces itself first, so that new readers wait for it
+	struct alignas(CACHELINE_SIZE) ShardLock {
+		static constexpr uint32_t writer = 1u << 31;
+
+		std::atomic<uint32_t> state_{0};  // The writer bit, and the number of readers
+
+		void Lock() {
+			while (state_.fetch_or(writer, std::memory_order_acquire) & writer) {
+				_mm_pause();
+			}
+			while (state_.load(std::memory_order_acquire) != writer) {
+				_mm_pause();
+			}
+		}
+
+		void Unlock() { state_.fetch_and(~writer, std::memory_order_release); }
+
+		void LockShared() {
+			uint32_t state = state_.load(std::memory_order_relaxed);
+			while ((state & writer) || !state_.compare_exchange_weak(state, state + 1, std::memory_order_acquire)) {
+				_mm_pause();
+				state = state_.load(std::memory_order_relaxed);
+			}
+		}
+
+		void UnlockShared() { state_.fetch_sub(1, std::memory_order_release); }
+	};
+
+	// Padded to cachelines, so that neighboring shards do not share any
+	struct alignas(CACHELINE_SIZE) Shard {
+		mutable ShardLock lock;
+		Table table;
+	};
+
+	// The tables use every bit of the first hash for bucket indexes and fingerprints, so its bits are mixed (with
+	// the finalizer of MurmurHash3, which is a bijection) before its top bits pick the shard; otherwise all keys of a
+	// shard would share their top bits, and crowd into a fraction of the shard's buckets
+	static auto ShardIdx(const K &key) -> size_t {
+		if (num_shards == 1) {
+			return 0;
+		}
+		uint32_t hash = H1()(key);
+		hash ^= hash >> 16;
+		hash *= 0x85ebca6b;
+		hash ^= hash >> 13;
+		hash *= 0xc2b2ae35;
+		hash ^= hash >> 16;
+		return hash >> (32 - shard_bits);
+	}
+
+	// Sorts the indexes of `n` keys by shard into `order`, and returns where each shard's indexes begin
+	static auto GroupByShard(const K *keys, size_t n, std::vector<size_t> &order) -> std::vector<size_t>;
+
+	template <class Fn>
+	void ForEachShard(Fn fn) {
+		for (auto &shard : shards_) {
+			shard.lock.Lock();
+			fn(shard.table);
+			shard.lock.Unlock();
+		}
+	}
+
+	template <class Fn>
+	auto Sum(Fn fn) const -> size_t {
+		size_t sum = 0;
+		for (const auto &shard : shards_) {
+			shard.lock.LockShared();
+			sum += fn(shard.table);
+			shard.lock.UnlockShared();
+		}
+		return sum;
+	}
+
+	std::vector<Shard> shards_;
+
+#ifdef __TEST_DLEFT__
+	friend class DleftTest;
+#endif
+};
+
+template <class K, class V, class H1, class H2, size_t num_shards, class Table>
+auto ShardedDleft<K, V, H1, H2, num_shards, Table>::GroupByShard(const K *keys, size_t n, std::vector<size_t> &order)
+		-> std::vector<size_t> {
+	std::vector<size_t> shard_of(n), shard_begin(num_shards + 1);
+	for (size_t i = 0; i < n; i++) {
+		shard_of[i] = ShardIdx(keys[i]);
+		shard_begin[shard_of[i] + 1]++;
+	}
+	for (size_t shard = 0; shard < num_shards; shard++) {
+		shard_begin[shard + 1] += shard_begin[shard];
+	}
+	std::vector<size_t> next(shard_begin.begin(), shard_begin.end() - 1);
+	order.resize(n);
+	for (size_t i = 0; i < n; i++) {  // Stable, so that keys of a shard keep their order
+		order[next[shard_of[i]]++] = i;
+	}
+	return shard_begin;
+}
+
+template <class K, class V, class H1, class H2, size_t num_shards, class Table>
+void ShardedDleft<K, V, H1, H2, num_shards, Table>::find_batch(const K *keys, V *values, bool *found, size_t n) const {
+	std::vector<size_t> order;
+	std::vector<size_t> shard_begin = GroupByShard(keys, n, order);
+
+	// `find_batch` takes contiguous arrays, so the keys of each shard are gathered, and the results scattered back
+	std::vector<K> shard_keys(n);
+	std::vector<V> shard_values(n);
+	std::unique_ptr<bool[]> shard_found(new bool[n]);
+	for (size_t i = 0; i < n; i++) {
+		shard_keys[i] = keys[order[i]];
+	}
+	for (size_t shard = 0; shard < num_shards; shard++) {
+		size_t begin = shard_begin[shard], end = shard_begin[shard + 1];
+		if (begin == end) {
+			continue;
+		}
+		shards_[shard].lock.LockShared();
+		shards_[shard].table.find_batch(&shard_keys[begin], &shard_values[begin], &shard_found[begin], end - begin);
+		shards_[shard].lock.UnlockShared();
+	}
+	for (size_t i = 0; i < n; i++) {
+		found[order[i]] = shard_found[i];
+		if (shard_found[i]) {
+			values[order[i]] = shard_values[i];
+		}
+	}
+}
+
+template <class K, class V, class H1, class H2, size_t num_shards, class Table>
+auto ShardedDleft<K, V, H1, H2, num_shards, Table>::insert_batch(const K *keys, const V *values, size_t n) -> size_t {
+	std::vector<size_t> order;
+	std::vector<size_t> shard_begin = GroupByShard(keys, n, order);
+
+	size_t inserted = 0;
+	for (size_t shard = 0; shard < num_shards; shard++) {
+		size_t begin = shard_begin[shard], end = shard_begin[shard + 1];
+		if (begin == end) {
+			continue;
+		}
+		shards_[shard].lock.Lock();
+		for (size_t i = begin; i < end; i++) {
+			inserted += shards_[shard].table.insert(keys[order[i]], values[order[i]]);
+		}
+		shards_[shard].lock.Unlock();
+	}
+	return inserted;
+}
+
+#ifdef __TEST_DLEFT__
+
+#include "xxhash.h"
+#include <map>
+#include <numeric>
+#include <random>
+#include <thread>
+
+class DleftTest {
+ public:
+ 	static void RunAllTests() {
+		TestStashBucket();
+    TestBucket();
+    TestDleft();
+	}
+ private:
+	static constexpr uint32_t seed1 = 0x5d445e6e;
+	static constexpr uint32_t seed2 = 0xf09ad611;
+
+	template<class K, uint64_t seed>
+	class Hasher {
+	public:
+		auto operator()(const K &key) const -> uint32_t {
+			return XXH32(&key, sizeof(K), seed);
+		}
+	};
+
+	using Hasher1 = Hasher<uint32_t, seed1>;
+	using Hasher2 = Hasher<uint32_t, seed2>;
+
+	// Counts how many times keys are hashed
+	template<class K, uint64_t seed>
+	class CountingHasher {
+	public:
+		static inline size_t calls = 0;
+
+		auto operator()(const K &key) const -> uint32_t {
+			calls++;
+			return Hasher<K, seed>()(key);
+		}
+	};
+
+	using CountingHasher1 = CountingHasher<uint32_t, seed1>;
+	using CountingHasher2 = CountingHasher<uint32_t, seed2>;
+
+	using DleftType = DleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2>;
+	using BufferedDleftType = BufferedDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2>;
+	using ConcurrentDleftType = ConcurrentDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2>;
+	using IncrementalDleftType = IncrementalDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2>;
+	using PartialKeyDleftType = PartialKeyDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2>;
+	template <bool concurrent = false, bool incremental = false>
+	using StringDleftType =
+			DleftFpStash<KeySpan, uint32_t, KeySpanHasher<seed1>, KeySpanHasher<seed2>, false, concurrent, incremental>;
+	template <class Allocator, bool concurrent = false, bool incremental = false>
+	using AllocatorDleftType =
+			DleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2, false, concurrent, incremental, false, Allocator>;
+	template <class Policy, bool buffered = false, bool incremental = false>
+	using PolicyDleftType =
+			DleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2, buffered, false, incremental, false, AlignedAllocator, Policy>;
+	using ShardedDleftType = ShardedDleft<uint32_t, uint32_t, Hasher1, Hasher2, 16>;
+	template <bool concurrent = false, bool incremental = false>
+	using StatsDleftType = DleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2, false, concurrent, incremental, false,
+																			AlignedAllocator, DleftPolicy<>, true>;
+
+	// About the size of per-flow state, too large to keep in buckets
+	struct FlowState {
+		uint32_t key;
+		uint8_t state[196];
+	};
+
+	template <class K, class V, bool concurrent = false, bool incremental = false, bool slab_values = false>
+	using SoaDleftType = DleftFpStash<K, V, Hasher<K, seed1>, Hasher<K, seed2>, false, concurrent, incremental, false,
+																		AlignedAllocator, DleftPolicy<16, 4, 255, 1024, slab_values, true>>;
+
+	template <class K, bool concurrent = false, bool incremental = false>
+	using CompareKeyDleftType = DleftFpStash<K, uint32_t, Hasher<K, seed1>, Hasher<K, seed2>, false, concurrent,
+																					 incremental, false, AlignedAllocator,
+																					 DleftPolicy<16, 4, 255, 1024, false, true, true>>;
+
+	template <int num_choices, bool concurrent = false, bool incremental = false>
+	using ChoiceDleftType = DleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2, false, concurrent, incremental, false,
+																			 AlignedAllocator,
+																			 DleftPolicy<16, 4, 255, 1024, false, false, false, false, num_choices>, true>;
+
+	template <int max_moves, bool concurrent = false, bool incremental = false, bool partial_key = false,
+						int num_choices = 2>
+	using DisplacementDleftType =
+			DleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2, false, concurrent, incremental, partial_key, AlignedAllocator,
+									 DleftPolicy<16, 4, 255, 1024, false, false, false, false, num_choices, max_moves>, true>;
+
+	template <class V, bool buffered = false, bool concurrent = false, bool incremental = false>
+	using SlabDleftType = DleftFpStash<uint32_t, V, Hasher1, Hasher2, buffered, concurrent, incremental, false,
+																		 AlignedAllocator, DleftPolicy<16, 4, 255, 1024, true>>;
+
+	static void TestStashBucket() {
+    TestStashBucketInsertMinorOverflow();
+    TestStashBucketEraseMinorOverflow();
+    TestStashBucketFindMinorOverflow();
+
+    TestStashBucketAppendMajorOverflow();
+    TestStashBucketEraseMajorOverflow();
+    TestStashBucketFindMajorOverflow();
+    TestStashBucketInsertMajorOverflow();
+  }
+
+  static void TestBucket() {
+    TestBucketAppend();
+    TestBucketErase();
+    TestBucketFind();
+
+    TestBucketAppendWithOverflow();
+    TestBucketEraseWithOverflow();
+    TestBucketFindWithOverflow();
+    TestBucketInsertWithOverflow();
+
+    TestBucketWriteBuffer();
+  }
+
+  static void TestDleft() {
+    TestDleftAppend();
+    TestDleftErase();
+    TestDleftFind();
+    TestDleftFindBatch();
+    TestDleftInsert();
+    TestDleftResize();
+    TestDleftParallelResize();
+    TestDleftIncrementalResize();
+    TestDleftLargeTable();
+    TestDleftPartialKey();
+    TestDleftProbeKernels();
+    TestDleftAllocators();
+    TestDleftPolicies();
+    TestDleftIteration();
+    TestDleftBuild();
+    TestDleftSnapshot();
+    TestDleftStringKeys();
+    TestDleftWriteBuffer();
+    TestDleftConcurrent();
+    TestDleftSharded();
+    TestDleftStats();
+    TestDleftPromotion();
+    TestDleftShrink();
+    TestDleftEmplace();
+    TestDleftSlabValues();
+    TestDleftSoaBuckets();
+    TestDleftCompareKeys();
+    TestDleftAlignedBuckets();
+    TestDleftChoices();
+    TestDleftDisplacement();
+
+		TestDleftFalsePositives();
+		TestDleftMaxLoadFactor();
+  }
+
+  static void TestStashBucketInsertMinorOverflow() {
+    printf("[TEST STASH BUCKET INSERT MINOR OVERFLOW]\n");
+
+    DleftType::StashBucket bucket;
+
+    for (int i = 0; i < bucket.bucket_capacity; i++) {
+      assert(bucket.InsertMinorOverflow(i, i) != bucket.invalid_pos);
+    }
+    assert(bucket.InsertMinorOverflow(2023u, 2023u) == bucket.invalid_pos);
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestStashBucketEraseMinorOverflow() {
+    printf("[TEST STASH BUCKET ERASE MINOR OVERFLOW]\n");
+
+    DleftType::StashBucket bucket;
+    uint8_t pos[bucket.bucket_capacity];
+
+    for (int i = 0; i < bucket.bucket_capacity; i++) {
+      pos[i] = bucket.InsertMinorOverflow(i, i);
+      assert(pos[i] != bucket.invalid_pos);
+    }
+
+    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
+      assert(!bucket.EraseMinorOverflow(i+1, pos[i]));
+      assert(bucket.EraseMinorOverflow(i, pos[i]));
+    }
+
+    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
+      assert(bucket.InsertMinorOverflow(i, i) != bucket.invalid_pos);
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestStashBucketFindMinorOverflow() {
+    printf("[TEST STASH BUCKET FIND MINOR OVERFLOW]\n");
+
+    DleftType::StashBucket bucket;
+    uint8_t pos[bucket.bucket_capacity];
+
+    for (int i = 0; i < bucket.bucket_capacity; i++) {
+      pos[i] = bucket.InsertMinorOverflow(i, i);
+      assert(pos[i] != bucket.invalid_pos);
+    }
+
+    for (int i = 0; i < bucket.bucket_capacity; i++) {
+      uint32_t value;
+      assert(!bucket.FindMinorOverflow(i+1, &value, pos[i]));
+      assert(bucket.FindMinorOverflow(i, &value, pos[i]));
+      assert(value == i);
+    }
+
+    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
+      assert(bucket.EraseMinorOverflow(i, pos[i]));
+    }
+
+    for (int i = bucket.bucket_capacity - 2; i >= 0; i -= 2) {
+      uint32_t value;
+      pos[i] = bucket.InsertMinorOverflow(i, i*2);
+      assert(pos[i] != bucket.invalid_pos);
+      assert(bucket.FindMinorOverflow(i, &value, pos[i]));
+      assert(value == i*2);
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestStashBucketAppendMajorOverflow() {
     printf("[TEST STASH BUCKET APPEND MAJOR OVERFLOW]\n");
 
-    {
-      DleftType::StashBucket bucket;
-      for (int i = 0; i < bucket.max_major_overflows; i++) {
-        assert(bucket.AppendMajorOverflow(i, i, Hasher1()(i)));
+    {
+      DleftType::StashBucket bucket;
+      for (int i = 0; i < bucket.max_major_overflows; i++) {
+        assert(bucket.AppendMajorOverflow(i, i, Hasher1()(i)));
+      }
+      assert(!bucket.AppendMajorOverflow(2023u, 2023u, static_cast<uint16_t>(Hasher1()(2023u))));
+    }
+    {
+      DleftType::StashBucket bucket;
+
+      for (int i = 0; i < bucket.bucket_capacity - bucket.max_major_overflows / 2; i++) {
+        assert(bucket.InsertMinorOverflow(i, i) != bucket.invalid_pos);
+      }
+      for (int i = bucket.bucket_capacity - bucket.max_major_overflows / 2; i < bucket.bucket_capacity; i++) {
+        assert(bucket.AppendMajorOverflow(i, i, Hasher1()(i)));
+      }
+      assert(!bucket.AppendMajorOverflow(2023u, 2023u, static_cast<uint16_t>(Hasher1()(2023u))));
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestStashBucketEraseMajorOverflow() {
+    printf("[TEST STASH BUCKET ERASE MAJOR OVERFLOW]\n");
+
+    DleftType::StashBucket bucket;
+
+    for (int i = 0; i < bucket.max_major_overflows; i++) {
+      assert(bucket.AppendMajorOverflow(i, i, Hasher1()(i)));
+    }
+
+    for (int i = 0; i < bucket.max_major_overflows; i += 2) {
+      assert(bucket.EraseMajorOverflow(i, Hasher1()(i)));
+      assert(!bucket.EraseMajorOverflow(i, Hasher1()(i)));
+    }
+
+    for (int i = 0; i < bucket.max_major_overflows; i += 2) {
+      assert(bucket.AppendMajorOverflow(i, i, Hasher1()(i)));
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestStashBucketFindMajorOverflow() {
+    printf("[TEST STASH BUCKET FIND MAJOR OVERFLOW]\n");
+
+    DleftType::StashBucket bucket;
+
+    for (int i = 0; i < bucket.max_major_overflows; i++) {
+      assert(bucket.AppendMajorOverflow(i, i, Hasher1()(i)));
+    }
+    for (int i = 0; i < bucket.max_major_overflows; i++) {
+      uint32_t value;
+      assert(bucket.FindMajorOverflow(i, &value, Hasher1()(i)));
+      assert(!bucket.FindMajorOverflow(i+1, &value, Hasher1()(i)));
+      assert(value == i);
+    }
+
+    for (int i = 0; i < bucket.max_major_overflows; i += 2) {
+      assert(bucket.EraseMajorOverflow(i, Hasher1()(i)));
+      assert(!bucket.FindMajorOverflow(i, nullptr, Hasher1()(i)));
+    }
+
+    for (int i = bucket.max_major_overflows - 2; i >= 0; i -= 2) {
+      uint32_t value;
+      assert(bucket.AppendMajorOverflow(i, i*2, Hasher1()(i)));
+      assert(bucket.FindMajorOverflow(i, &value, Hasher1()(i)));
+      assert(value == i*2);
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestStashBucketInsertMajorOverflow() {
+    printf("[TEST STASH BUCKET INSERT MAJOR OVERFLOW]\n");
+
+    DleftType::StashBucket bucket;
+
+    for (int i = 0; i < bucket.max_major_overflows; i++) {
+      assert(bucket.AppendMajorOverflow(i, i, Hasher1()(i)));
+    }
+    for (int i = 0; i < bucket.max_major_overflows; i += 2) {
+      assert(bucket.InsertMajorOverflow(i, i*2, Hasher1()(i)));
+    }
+    for (int i = 0; i < bucket.max_major_overflows; i += 2) {
+      uint32_t value;
+      assert(bucket.FindMajorOverflow(i, &value, Hasher1()(i)));
+      if (i % 2 == 0) {
+        assert(value == i*2);
+      } else {
+        assert(value == i);
+      }
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestBucketAppend() {
+    printf("[TEST BUCKET APPEND]\n");
+
+    DleftType::Bucket bucket;
+
+    for (int i = 0; i < bucket.bucket_capacity; i++) {
+      assert(bucket.Append(i, i, Hasher1()(i), nullptr));
+    }
+    assert(!bucket.Append(2023u, 2023u, Hasher1()(2023u), nullptr));
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestBucketErase() {
+    printf("[TEST BUCKET ERASE]\n");
+
+    DleftType::Bucket bucket;
+
+    for (int i = 0; i < bucket.bucket_capacity; i++) {
+      assert(bucket.Append(i, i, Hasher1()(i), nullptr));
+    }
+
+    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
+      assert(bucket.Erase(i, Hasher1()(i), nullptr));
+      assert(!bucket.Erase(i, Hasher1()(i), nullptr));
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestBucketFind() {
+    printf("[TEST BUCKET FIND]\n");
+
+    DleftType::Bucket bucket;
+
+    for (int i = 0; i < bucket.bucket_capacity; i++) {
+      assert(bucket.Append(i, i, Hasher1()(i), nullptr));
+    }
+
+    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
+      uint32_t value;
+      assert(bucket.Find(i, &value, Hasher1()(i), nullptr));
+      assert(value == i);
+      assert(bucket.Erase(i, Hasher1()(i), nullptr));
+      assert(!bucket.Find(i, nullptr, Hasher1()(i), nullptr));
+      assert(bucket.Append(i, i*2, Hasher1()(i), nullptr));
+    }
+
+    for (int i = 0; i < bucket.bucket_capacity; i++) {
+      uint32_t value;
+      assert(bucket.Find(i, &value, Hasher1()(i), nullptr));
+      if (i % 2 == 0) {
+        assert(value == i*2);
+      } else {
+        assert(value == i);
       }
-      assert(!bucket.AppendMajorOverflow(2023u, 2023u, static_cast<uint16_t>(Hasher1()(2023u))));
     }
-    {
-      DleftType::StashBucket bucket;
 
-      for (int i = 0; i < bucket.bucket_capacity - bucket.max_major_overflows / 2; i++) {
-        assert(bucket.InsertMinorOverflow(i, i) != bucket.invalid_pos);
+    printf("[PASSED]\n");
+  }
+
+  static void TestBucketInsert() {
+    printf("[TEST BUCKET INSERT]\n");
+
+    DleftType::Bucket bucket;
+
+    for (int i = 0; i < bucket.bucket_capacity; i++) {
+      assert(bucket.Append(i, i, Hasher1()(i), nullptr));
+    }
+
+    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
+      assert(bucket.Insert(i, i*2, Hasher1()(i), nullptr));
+    }
+
+    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
+      uint32_t value;
+      assert(bucket.Find(i, &value, Hasher1()(i), nullptr));
+      if (i % 2 == 0) {
+        assert(value == i*2);
+      } else {
+        assert(value == i);
       }
-      for (int i = bucket.bucket_capacity - bucket.max_major_overflows / 2; i < bucket.bucket_capacity; i++) {
-        assert(bucket.AppendMajorOverflow(i, i, Hasher1()(i)));
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestBucketAppendWithOverflow() {
+    printf("[TEST BUCKET APPEND WITH OVERFLOW]\n");
+
+    DleftType::Bucket bucket;
+    DleftType::StashBucket stash_bucket;
+
+    for (int i = 0; i < bucket.bucket_capacity; i++) {
+      assert(bucket.Append(i, i, Hasher1()(i), &stash_bucket));
+    }
+    assert(bucket.overflow_count_ == 0);
+
+    for (int i = bucket.bucket_capacity; i < bucket.bucket_capacity + bucket.max_minor_overflows; i++) {
+      assert(bucket.Append(i, i, Hasher1()(i), &stash_bucket));
+    }
+    assert(bucket.overflow_count_ == bucket.max_minor_overflows);
+    assert(bucket.GetMinorOverflowCount() == bucket.max_minor_overflows);
+    for (int i = 0; i < stash_bucket.max_major_overflows; i++) {
+      assert(stash_bucket.position_[i] == stash_bucket.invalid_pos);
+    }
+
+    for (int i = bucket.bucket_capacity + bucket.max_minor_overflows;
+         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
+         i++) {
+      assert(bucket.Append(i, i, Hasher1()(i), &stash_bucket));
+    }
+    assert(bucket.overflow_count_ == bucket.max_minor_overflows + stash_bucket.max_major_overflows);
+    assert(bucket.GetMinorOverflowCount() == bucket.max_minor_overflows);
+    for (int i = 0; i < stash_bucket.max_major_overflows; i++) {
+      assert(stash_bucket.position_[i] != stash_bucket.invalid_pos);
+    }
+  
+    assert(!bucket.Append(2023u, 2023u, Hasher1()(2023u), &stash_bucket));
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestBucketEraseWithOverflow() {
+    printf("[TEST BUCKET ERASE WITH OVERFLOW]\n");
+
+    DleftType::Bucket bucket;
+    DleftType::StashBucket stash_bucket;
+
+    for (int i = 0;
+         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
+         i++) {
+      assert(bucket.Append(i, i, Hasher1()(i), &stash_bucket));
+    }
+    assert(bucket.overflow_count_ == bucket.max_minor_overflows + stash_bucket.max_major_overflows);
+    assert(bucket.GetMinorOverflowCount() == bucket.max_minor_overflows);
+    for (int i = 0; i < stash_bucket.max_major_overflows; i++) {
+      assert(stash_bucket.position_[i] != stash_bucket.invalid_pos);
+    }
+
+    for (int i = 0; i < bucket.bucket_capacity; i++) {
+      assert(bucket.Erase(i, Hasher1()(i), &stash_bucket));
+      assert(!bucket.Erase(i, Hasher1()(i), &stash_bucket));
+    }
+    assert(bucket.GetSize() == 0);
+
+    for (int i = bucket.bucket_capacity + bucket.max_minor_overflows;
+         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
+         i++) {
+      assert(bucket.Erase(i, Hasher1()(i), &stash_bucket));
+      assert(!bucket.Erase(i, Hasher1()(i), &stash_bucket));
+    }
+    assert(bucket.overflow_count_ == bucket.max_minor_overflows);
+    assert(bucket.GetMinorOverflowCount() == bucket.max_minor_overflows);
+    for (int i = 0; i < stash_bucket.max_major_overflows; i++) {
+      assert(stash_bucket.position_[i] == stash_bucket.invalid_pos);
+    }
+
+    for (int i = bucket.bucket_capacity; i < bucket.bucket_capacity + bucket.max_minor_overflows; i++) {
+      assert(bucket.Erase(i, Hasher1()(i), &stash_bucket));
+      assert(!bucket.Erase(i, Hasher1()(i), &stash_bucket));
+    }
+    assert(bucket.overflow_count_ == 0);
+    assert(bucket.GetMinorOverflowCount() == 0);
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestBucketFindWithOverflow() {
+    printf("[TEST BUCKET FIND WITH OVERFLOW]\n");
+
+    DleftType::Bucket bucket;
+    DleftType::StashBucket stash_bucket;
+
+    for (int i = 0;
+         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
+         i++) {
+      assert(bucket.Append(i, i, Hasher1()(i), &stash_bucket));
+    }
+    assert(bucket.overflow_count_ == bucket.max_minor_overflows + stash_bucket.max_major_overflows);
+    assert(bucket.GetMinorOverflowCount() == bucket.max_minor_overflows);
+    for (int i = 0; i < stash_bucket.max_major_overflows; i++) {
+      assert(stash_bucket.position_[i] != stash_bucket.invalid_pos);
+    }
+
+    for (int i = 0;
+         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
+         i++) {
+      uint32_t value;
+      assert(bucket.Find(i, &value, Hasher1()(i), &stash_bucket));
+      assert(value == i);
+      
+      assert(bucket.Erase(i, Hasher1()(i), &stash_bucket));
+      assert(!bucket.Find(i, nullptr, Hasher1()(i), &stash_bucket));
+
+      assert(bucket.Append(i, i*2, Hasher1()(i), &stash_bucket));
+      assert(bucket.Find(i, &value, Hasher1()(i), &stash_bucket));
+      assert(value == i*2);
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestBucketInsertWithOverflow() {
+    printf("[TEST BUCKET INSERT WITH OVERFLOW]\n");
+
+    DleftType::Bucket bucket;
+    DleftType::StashBucket stash_bucket;
+
+    for (int i = 0;
+         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
+         i++) {
+      assert(bucket.Append(i, i, Hasher1()(i), &stash_bucket));
+    }
+
+    for (int i = 0;
+         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
+         i += 2) {
+      assert(bucket.Insert(i, i*2, Hasher1()(i), &stash_bucket));
+    }
+
+    for (int i = 0;
+         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
+         i += 2) {
+      uint32_t value;
+      assert(bucket.Find(i, &value, Hasher1()(i), &stash_bucket));
+      if (i % 2 == 0) {
+        assert(value == i*2);
+      } else {
+        assert(value == i);
       }
-      assert(!bucket.AppendMajorOverflow(2023u, 2023u, static_cast<uint16_t>(Hasher1()(2023u))));
     }
 
     printf("[PASSED]\n");
   }
 
-  static void TestStashBucketEraseMajorOverflow() {
-    printf("[TEST STASH BUCKET ERASE MAJOR OVERFLOW]\n");
-
-    DleftType::StashBucket bucket;
+  static void TestBucketWriteBuffer() {
+    printf("[TEST BUCKET WRITE BUFFER]\n");
+
+    using Bucket = BufferedDleftType::Bucket;
+    Bucket bucket;
+    assert(sizeof(Bucket) == sizeof(DleftType::Bucket));  // The buffer is made of ordinary slots, with no padding
+    assert(Bucket::buf_capacity == (CACHELINE_SIZE - Bucket::header_size) / BufferedDleftType::tuple_size);
+
+    for (uint32_t i = 0; i < bucket.bucket_capacity; i++) {
+      assert(bucket.Append(std::forward<uint32_t>(i), std::forward<uint32_t>(i), Hasher1()(i), nullptr));
+      // The latest key always lands in the write buffer until the rest of the bucket fills up
+      if (i < bucket.bucket_capacity - Bucket::buf_capacity) {
+        uint8_t pos = 0;
+        while (!GET_BIT(bucket.validity_, pos) || bucket.tuples_[pos].key != i) {
+          pos++;
+        }
+        assert(pos < Bucket::buf_capacity);
+      }
+    }
+    assert(bucket.GetSize() == bucket.bucket_capacity);
+    assert(!bucket.Append(2023u, 2023u, Hasher1()(2023u), nullptr));
+
+    for (uint32_t i = 0; i < bucket.bucket_capacity; i++) {
+      uint32_t value;
+      assert(bucket.Find(i, &value, Hasher1()(i), nullptr));
+      assert(value == i);
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestDleftWriteBuffer() {
+    printf("[TEST DLEFT WRITE BUFFER]\n");
+
+    const uint32_t testcase_size = 60000;
+    BufferedDleftType hash_table(testcase_size);
+    assert(reinterpret_cast<uintptr_t>(hash_table.buckets_) % CACHELINE_SIZE == 0);
+
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      assert(hash_table.Append(std::forward<uint32_t>(i), std::forward<uint32_t>(i), Hasher1()(i), Hasher2()(i)));
+      uint32_t value;
+      assert(hash_table.Find(i, &value, Hasher1()(i), Hasher2()(i)));
+      assert(value == i);
+    }
+
+    for (uint32_t i = 0; i < testcase_size; i += 2) {
+      assert(hash_table.Erase(i, Hasher1()(i), Hasher2()(i)));
+      assert(hash_table.Append(std::forward<uint32_t>(i), i*2, Hasher1()(i), Hasher2()(i)));
+    }
+
+    assert(hash_table.Resize(testcase_size * 2));
+
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      uint32_t value;
+      assert(hash_table.Find(i, &value, Hasher1()(i), Hasher2()(i)));
+      assert(value == (i % 2 == 0 ? i*2 : i));
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestDleftConcurrent() {
+    printf("[TEST DLEFT CONCURRENT]\n");
+
+    const uint32_t num_writers = 4, num_readers = 4;
+    const uint32_t preloaded_size = 20000, testcase_size = 50000;
+    ConcurrentDleftType hash_table(1024);  // Small enough for writers to resize it many times
+
+    for (uint32_t i = 0; i < preloaded_size; i++) {
+      hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i));
+    }
+
+    std::atomic<bool> done{false};
+    std::vector<std::thread> writers, readers;
+    for (uint32_t t = 0; t < num_writers; t++) {
+      writers.emplace_back([&hash_table, t]() {
+        uint32_t begin = preloaded_size + t * testcase_size;
+        for (uint32_t i = begin; i < begin + testcase_size; i++) {
+          hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i));
+        }
+        for (uint32_t i = begin; i < begin + testcase_size; i += 2) {
+          assert(hash_table.erase(i));
+        }
+      });
+    }
+    for (uint32_t t = 0; t < num_readers; t++) {
+      readers.emplace_back([&hash_table, &done]() {
+        while (!done) {  // Preloaded keys must stay visible while writers insert, erase and resize
+          for (uint32_t i = 0; i < preloaded_size; i++) {
+            uint32_t value;
+            assert(hash_table.find(i, value));
+            assert(value == i);
+          }
+        }
+      });
+    }
+    for (auto &writer : writers) {
+      writer.join();
+    }
+    done = true;
+    for (auto &reader : readers) {
+      reader.join();
+    }
+
+    assert(hash_table.size() == preloaded_size + num_writers * testcase_size / 2);
+    for (uint32_t i = preloaded_size; i < preloaded_size + num_writers * testcase_size; i++) {
+      uint32_t value;
+      assert(hash_table.find(i, value) == (i % 2 == 1));
+      assert(i % 2 == 0 || value == i);
+    }
+
+    // Arrays replaced by resizes are freed once no reader can see them, at the latest by the next writer that
+    // locks the whole table after the readers are done
+    hash_table.promote_overflows();
+    assert(hash_table.retired_.empty());
+    assert(hash_table.memory_usage() == hash_table.num_buckets_ * sizeof(ConcurrentDleftType::Bucket) +
+                                        hash_table.num_stash_buckets_ * sizeof(ConcurrentDleftType::StashBucket));
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestDleftSharded() {
+    printf("[TEST DLEFT SHARDED]\n");
+
+    const uint32_t testcase_size = 200000;
+    ShardedDleftType hash_table;
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      assert(hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+    }
+    assert(!hash_table.insert(0, 1));
+    for (uint32_t i = 0; i < testcase_size; i += 2) {
+      assert(hash_table.erase(i));
+    }
+    assert(!hash_table.erase(0));
+    assert(hash_table.size() == testcase_size / 2);
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      uint32_t value;
+      assert(hash_table.find(i, value) == (i % 2 == 1));
+      assert(i % 2 == 0 || value == i);
+    }
+
+    // Shards get about as many keys each, and spread them over all of their buckets
+    for (const auto &shard : hash_table.shards_) {
+      assert(shard.table.size() > testcase_size / 2 / 16 * 9 / 10 && shard.table.size() < testcase_size / 2 / 16 * 11 / 10);
+    }
+    hash_table.reserve(testcase_size);
+    assert(hash_table.load_factor() > 0.3);
+
+    // Batches mix shards, absent keys and duplicates, of which the first one wins
+    std::vector<uint32_t> keys, values;
+    for (uint32_t i = 0; i < testcase_size * 2; i++) {
+      keys.push_back(i);
+      values.push_back(i + 1);
+    }
+    keys.push_back(testcase_size + 1);
+    values.push_back(0);
+    assert(hash_table.insert_batch(keys.data(), values.data(), keys.size()) == testcase_size * 3 / 2);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(testcase_size));
+    keys.resize(testcase_size * 3);
+    std::iota(keys.begin() + testcase_size * 2, keys.end(), testcase_size * 2);
+    values.resize(keys.size());
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    hash_table.find_batch(keys.data(), values.data(), found.get(), keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+      assert(found[i] == (keys[i] < testcase_size * 2));
+      assert(!found[i] || values[i] == (keys[i] % 2 == 1 && keys[i] < testcase_size ? keys[i] : keys[i] + 1));
+    }
+
+    // Writers to different shards run alongside readers, while their shards resize
+    const int num_writers = 4, num_readers = 4;
+    ShardedDleftType concurrent_hash_table;
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      assert(concurrent_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+    }
+    std::atomic<bool> done{false};
+    std::vector<std::thread> writers, readers;
+    for (int t = 0; t < num_writers; t++) {
+      writers.emplace_back([&concurrent_hash_table, t]() {
+        uint32_t begin = testcase_size * (t + 1);
+        for (uint32_t i = begin; i < begin + testcase_size; i++) {
+          assert(concurrent_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+        }
+        for (uint32_t i = begin; i < begin + testcase_size; i += 2) {
+          assert(concurrent_hash_table.erase(i));
+        }
+      });
+    }
+    for (int t = 0; t < num_readers; t++) {
+      readers.emplace_back([&concurrent_hash_table, &done, t]() {
+        std::vector<uint32_t> keys(1000), values(1000);
+        std::unique_ptr<bool[]> found(new bool[1000]);
+        while (!done) {
+          for (uint32_t begin = 0; begin < testcase_size; begin += 1000) {
+            std::iota(keys.begin(), keys.end(), begin);
+            if (t % 2 == 0) {
+              concurrent_hash_table.find_batch(keys.data(), values.data(), found.get(), keys.size());
+            } else {
+              for (size_t i = 0; i < keys.size(); i++) {
+                found[i] = concurrent_hash_table.find(keys[i], values[i]);
+              }
+            }
+            for (size_t i = 0; i < keys.size(); i++) {
+              assert(found[i] && values[i] == keys[i]);
+            }
+          }
+        }
+      });
+    }
+    for (auto &writer : writers) {
+      writer.join();
+    }
+    done = true;
+    for (auto &reader : readers) {
+      reader.join();
+    }
+    assert(concurrent_hash_table.size() == testcase_size + num_writers * testcase_size / 2);
+
+    // Keys of every shard are copied into that shard's arena
+    ShardedDleft<KeySpan, uint32_t, KeySpanHasher<seed1>, KeySpanHasher<seed2>, 8, StringDleftType<>> string_hash_table;
+    for (uint32_t i = 0; i < 100000; i++) {
+      std::string key = "host" + std::to_string(i) + ".example.com";
+      assert(string_hash_table.insert(KeySpan(key), std::forward<uint32_t>(i)));
+    }
+    for (uint32_t i = 0; i < 100000; i++) {
+      std::string key = "host" + std::to_string(i) + ".example.com";
+      uint32_t value;
+      assert(string_hash_table.find(KeySpan(key), value) && value == i);
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestDleftStats() {
+    printf("[TEST DLEFT STATS]\n");
 
-    for (int i = 0; i < bucket.max_major_overflows; i++) {
-      assert(bucket.AppendMajorOverflow(i, i, Hasher1()(i)));
+    // Without `with_stats`, only the memory in use is reported
+    DleftType plain_hash_table;
+    for (uint32_t i = 0; i < 100000; i++) {
+      assert(plain_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
     }
+    DleftStats stats = plain_hash_table.stats();
+    assert(stats.false_positives == 0 && stats.minor_overflows == 0 && stats.resizes == 0);
+    assert(stats.bytes_in_use == plain_hash_table.memory_usage());
 
-    for (int i = 0; i < bucket.max_major_overflows; i += 2) {
-      assert(bucket.EraseMajorOverflow(i, Hasher1()(i)));
-      assert(!bucket.EraseMajorOverflow(i, Hasher1()(i)));
+    // Each table counts its own events (the table must be large enough to have stash buckets)
+    StatsDleftType<> hash_table(1 << 16), other_hash_table(1 << 16);
+    uint32_t key = 0;
+    while (hash_table.stats().resizes == 0) {
+      assert(hash_table.insert(std::forward<uint32_t>(key), std::forward<uint32_t>(key)));
+      key++;
+    }
+    stats = hash_table.stats();
+    assert(stats.minor_overflows > 0);
+    assert(stats.one_move_attempts > 0 && stats.one_move_successes <= stats.one_move_attempts);
+    assert(stats.resize_ns > 0);
+    assert(stats.bytes_in_use == hash_table.memory_usage());
+    DleftStats other_stats = other_hash_table.stats();
+    assert(other_stats.minor_overflows == 0 && other_stats.one_move_attempts == 0 && other_stats.resizes == 0);
+
+    // A major overflow is a stash bucket key past its bucket's minor overflows; erasing does not count
+    uint64_t overflows = stats.minor_overflows + stats.major_overflows;
+    for (uint32_t i = 0; i < key; i++) {
+      assert(hash_table.erase(i));
+    }
+    stats = hash_table.stats();
+    assert(stats.minor_overflows + stats.major_overflows == overflows);
+
+    // Counts from many threads add up, and lookups count false positives
+    StatsDleftType<true> concurrent_hash_table(1000);
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < 4; t++) {
+      threads.emplace_back([&concurrent_hash_table, t]() {
+        for (uint32_t i = t * 100000; i < (t + 1) * 100000; i++) {
+          assert(concurrent_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+        }
+        for (uint32_t i = 1000000; i < 1100000; i++) {
+          uint32_t value;
+          assert(!concurrent_hash_table.find(i, value));
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
     }
+    stats = concurrent_hash_table.stats();
+    assert(stats.false_positives > 0 && stats.resizes > 0);
 
-    for (int i = 0; i < bucket.max_major_overflows; i += 2) {
-      assert(bucket.AppendMajorOverflow(i, i, Hasher1()(i)));
+    // Incremental migrations count as resizes
+    StatsDleftType<false, true> incremental_hash_table(1000);
+    for (uint32_t i = 0; i < 100000; i++) {
+      assert(incremental_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
     }
+    assert(incremental_hash_table.stats().resizes > 0);
 
     printf("[PASSED]\n");
   }
 
-  static void TestStashBucketFindMajorOverflow() {
-    printf("[TEST STASH BUCKET FIND MAJOR OVERFLOW]\n");
-
-    DleftType::StashBucket bucket;
-
-    for (int i = 0; i < bucket.max_major_overflows; i++) {
-      assert(bucket.AppendMajorOverflow(i, i, Hasher1()(i)));
+  template <class HashTable>
+  static void TestDleftPromotion(HashTable &hash_table) {
+    uint32_t num_keys = 0;
+    while (hash_table.Append(std::forward<uint32_t>(num_keys), std::forward<uint32_t>(num_keys), Hasher1()(num_keys),
+                             HashTable::Hash2(num_keys, Hasher1()(num_keys)))) {
+      num_keys++;
     }
-    for (int i = 0; i < bucket.max_major_overflows; i++) {
-      uint32_t value;
-      assert(bucket.FindMajorOverflow(i, &value, Hasher1()(i)));
-      assert(!bucket.FindMajorOverflow(i+1, &value, Hasher1()(i)));
-      assert(value == i);
+    std::vector<uint32_t> keys(num_keys);
+    std::iota(keys.begin(), keys.end(), 0);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(num_keys));
+
+    // Count the overflows of buckets that have room for them
+    auto count_stranded = [&hash_table](size_t &minor, size_t &major) {
+      minor = major = 0;
+      for (size_t i = 0; i < hash_table.num_buckets_; i++) {
+        auto &bucket = hash_table.buckets_[i];
+        uint8_t num_minor = bucket.GetMinorOverflowCount(), num_major = bucket.overflow_count_ - num_minor;
+        if (bucket.GetSize() < bucket.bucket_capacity) {
+          minor += num_minor;
+          major += num_major;
+        } else if (num_minor < bucket.max_minor_overflows) {
+          major += num_major;
+        }
+      }
+    };
+    size_t minor, major, major_before = 0;
+    for (size_t i = 0; i < hash_table.num_stash_buckets_; i++) {
+      for (int j = 0; j < 2; j++) {
+        major_before += hash_table.stash_buckets_[i].position_[j] != hash_table.stash_buckets_[i].invalid_pos;
+      }
     }
+    assert(major_before > 0);
 
-    for (int i = 0; i < bucket.max_major_overflows; i += 2) {
-      assert(bucket.EraseMajorOverflow(i, Hasher1()(i)));
-      assert(!bucket.FindMajorOverflow(i, nullptr, Hasher1()(i)));
+    for (uint32_t i = 0; i < num_keys / 4; i++) {
+      assert(hash_table.erase(keys[i]));
     }
-
-    for (int i = bucket.max_major_overflows - 2; i >= 0; i -= 2) {
+    count_stranded(minor, major);
+    assert(minor == 0);  // Minor overflows always belong to their bucket
+    assert(major * 10 < major_before);  // Only major overflows of ambiguous buckets stay
+    assert(hash_table.promote_overflows() == 0);
+    for (uint32_t i = 0; i < num_keys; i++) {
       uint32_t value;
-      assert(bucket.AppendMajorOverflow(i, i*2, Hasher1()(i)));
-      assert(bucket.FindMajorOverflow(i, &value, Hasher1()(i)));
-      assert(value == i*2);
+      bool erased = std::find(keys.begin(), keys.begin() + num_keys / 4, i) != keys.begin() + num_keys / 4;
+      assert(hash_table.find(i, value) == !erased);
+      assert(erased || value == i);
+    }
+    for (uint32_t i = num_keys / 4; i < num_keys; i++) {
+      assert(hash_table.erase(keys[i]));
+    }
+    assert(hash_table.size() == 0);
+    for (size_t i = 0; i < hash_table.num_stash_buckets_; i++) {
+      assert(hash_table.stash_buckets_[i].GetSize() == 0);
     }
-
-    printf("[PASSED]\n");
   }
 
-  static void TestStashBucketInsertMajorOverflow() {
-    printf("[TEST STASH BUCKET INSERT MAJOR OVERFLOW]\n");
+  static void TestDleftPromotion() {
+    printf("[TEST DLEFT PROMOTION]\n");
 
-    DleftType::StashBucket bucket;
+    // One minor overflow per bucket and many stash buckets, so that removals strand many major overflows
+    PolicyDleftType<DleftPolicy<8, 1, 64, 16>> hash_table(1 << 16);
+    TestDleftPromotion(hash_table);
+    PolicyDleftType<DleftPolicy<8, 1, 64, 16>, true> buffered_hash_table(1 << 16);
+    TestDleftPromotion(buffered_hash_table);
+    DleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2, false, true, false, true, AlignedAllocator,
+                 DleftPolicy<8, 1, 64, 16>> concurrent_partial_key_hash_table(1 << 16);
+    TestDleftPromotion(concurrent_partial_key_hash_table);
 
-    for (int i = 0; i < bucket.max_major_overflows; i++) {
-      assert(bucket.AppendMajorOverflow(i, i, Hasher1()(i)));
+    printf("[PASSED]\n");
+  }
+
+  template <class HashTable>
+  static void TestDleftShrink(HashTable &hash_table) {
+    const uint32_t num_keys = 1 << 18;
+    for (uint32_t i = 0; i < num_keys; i++) {
+      assert(hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
     }
-    for (int i = 0; i < bucket.max_major_overflows; i += 2) {
-      assert(bucket.InsertMajorOverflow(i, i*2, Hasher1()(i)));
+    size_t memory_usage = hash_table.memory_usage();
+
+    // Removing most keys halves the table as they go, down to a size that has room for the rest
+    for (uint32_t i = num_keys / 64; i < num_keys; i++) {
+      assert(hash_table.erase(i));
     }
-    for (int i = 0; i < bucket.max_major_overflows; i += 2) {
+    hash_table.shrink_to_fit();
+    assert(hash_table.memory_usage() * 16 < memory_usage);
+    assert(hash_table.load_factor() >= 0.15);
+    for (uint32_t i = 0; i < num_keys; i++) {
       uint32_t value;
-      assert(bucket.FindMajorOverflow(i, &value, Hasher1()(i)));
-      if (i % 2 == 0) {
-        assert(value == i*2);
-      } else {
-        assert(value == i);
-      }
+      assert(hash_table.find(i, value) == (i < num_keys / 64));
+      assert(i >= num_keys / 64 || value == i);
     }
 
-    printf("[PASSED]\n");
-  }
-
-  static void TestBucketAppend() {
-    printf("[TEST BUCKET APPEND]\n");
+    // Shrinking a table that cannot get any smaller leaves it as it is
+    memory_usage = hash_table.memory_usage();
+    hash_table.shrink_to_fit();
+    assert(hash_table.memory_usage() == memory_usage);
+    assert(hash_table.size() == num_keys / 64);
 
-    DleftType::Bucket bucket;
+    // Filling it up again grows it as usual
+    for (uint32_t i = num_keys / 64; i < num_keys; i++) {
+      assert(hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+    }
+    for (uint32_t i = 0; i < num_keys; i++) {
+      uint32_t value;
+      assert(hash_table.find(i, value) && value == i);
+    }
+  }
 
-    for (int i = 0; i < bucket.bucket_capacity; i++) {
-      assert(bucket.Append(i, i, Hasher1()(i), nullptr));
+  static void TestDleftShrink() {
+    printf("[TEST DLEFT SHRINK]\n");
+
+    // Without the policy, only `shrink_to_fit` gives memory back
+    DleftType hash_table;
+    TestDleftShrink(hash_table);
+
+    DleftType shrinking_hash_table;
+    shrinking_hash_table.set_shrink_load_factor(0.2);
+    TestDleftShrink(shrinking_hash_table);
+    BufferedDleftType buffered_hash_table;
+    buffered_hash_table.set_shrink_load_factor(0.2);
+    TestDleftShrink(buffered_hash_table);
+    ConcurrentDleftType concurrent_hash_table;
+    concurrent_hash_table.set_shrink_load_factor(0.2);
+    TestDleftShrink(concurrent_hash_table);
+    IncrementalDleftType incremental_hash_table;
+    incremental_hash_table.set_shrink_load_factor(0.2);
+    TestDleftShrink(incremental_hash_table);
+
+    // The policy halves the table as keys go, before `shrink_to_fit` is called
+    DleftType policy_hash_table;
+    policy_hash_table.set_shrink_load_factor(0.2);
+    for (uint32_t i = 0; i < (1 << 16); i++) {
+      policy_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i));
     }
-    assert(!bucket.Append(2023u, 2023u, Hasher1()(2023u), nullptr));
+    size_t capacity = policy_hash_table.capacity();
+    for (uint32_t i = 0; i < (1 << 16) - (1 << 12); i++) {
+      assert(policy_hash_table.erase(i));
+    }
+    assert(policy_hash_table.capacity() * 8 <= capacity);
+    assert(policy_hash_table.load_factor() >= 0.1);
+
+    // A concurrent table that keeps filling up and emptying, while readers look keys up, gives back the arrays each
+    // resize replaces, rather than adding them up cycle after cycle (about three times its arrays per cycle); only
+    // those of the last few resizes may still be read
+    const uint32_t num_kept = 1000, num_cycled = 100000;
+    ConcurrentDleftType cycled_hash_table;
+    cycled_hash_table.set_shrink_load_factor(0.2);
+    for (uint32_t i = 0; i < num_kept; i++) {
+      assert(cycled_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+    }
+    size_t full_memory_usage = 0;  // Of the arrays alone, once full
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 2; t++) {
+      readers.emplace_back([&cycled_hash_table, &done]() {
+        while (!done) {
+          for (uint32_t i = 0; i < num_kept; i++) {
+            uint32_t value;
+            assert(cycled_hash_table.find(i, value) && value == i);
+          }
+        }
+      });
+    }
+    for (int cycle = 0; cycle < 10; cycle++) {
+      for (uint32_t i = num_kept; i < num_kept + num_cycled; i++) {
+        assert(cycled_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+      }
+      if (cycle == 0) {
+        full_memory_usage = cycled_hash_table.num_buckets_ * sizeof(ConcurrentDleftType::Bucket) +
+                            cycled_hash_table.num_stash_buckets_ * sizeof(ConcurrentDleftType::StashBucket);
+      }
+      assert(cycled_hash_table.memory_usage() <= full_memory_usage * 5);
+      for (uint32_t i = num_kept; i < num_kept + num_cycled; i++) {
+        assert(cycled_hash_table.erase(i));
+      }
+      assert(cycled_hash_table.memory_usage() <= full_memory_usage * 5);
+    }
+    done = true;
+    for (auto &reader : readers) {
+      reader.join();
+    }
+    cycled_hash_table.promote_overflows();  // Frees what readers still saw, now that they are done
+    assert(cycled_hash_table.retired_.empty());
+    assert(cycled_hash_table.memory_usage() * 16 < full_memory_usage);
 
     printf("[PASSED]\n");
   }
 
-  static void TestBucketErase() {
-    printf("[TEST BUCKET ERASE]\n");
+  // A value that owns memory, like a flow record, and counts how often it is copied or constructed from arguments
+  struct Record {
+    static inline size_t copies = 0;
+    static inline size_t constructions = 0;
 
-    DleftType::Bucket bucket;
+    std::vector<uint32_t> packets;
 
-    for (int i = 0; i < bucket.bucket_capacity; i++) {
-      assert(bucket.Append(i, i, Hasher1()(i), nullptr));
-    }
+    Record() = default;
+    Record(size_t n, uint32_t packet) : packets(n, packet) { constructions++; }
+    Record(const Record &other) : packets(other.packets) { copies++; }
+    Record(Record &&) noexcept = default;
+    auto operator=(const Record &other) -> Record & { packets = other.packets; copies++; return *this; }
+    auto operator=(Record &&) noexcept -> Record & = default;
+  };
 
-    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
-      assert(bucket.Erase(i, Hasher1()(i), nullptr));
-      assert(!bucket.Erase(i, Hasher1()(i), nullptr));
+  template <class HashTable>
+  static void TestDleftEmplace(HashTable &hash_table) {
+    const uint32_t num_keys = 100000;
+    Record::copies = Record::constructions = 0;
+
+    // Values are constructed once, in their slots, and only moved by resizes
+    for (uint32_t i = 0; i < num_keys; i++) {
+      assert(hash_table.try_emplace(i, 4, i));
     }
+    assert(Record::constructions == num_keys);
+    for (uint32_t i = 0; i < num_keys; i++) {
+      assert(!hash_table.try_emplace(i, 4, i + 1));
+      assert(!hash_table.emplace(i, 4, i + 1));
+    }
+    assert(Record::constructions == num_keys);
+    for (uint32_t i = 0; i < num_keys; i += 2) {
+      assert(!hash_table.insert_or_assign(i, Record(8, i * 2)));
+    }
+    for (uint32_t i = num_keys; i < num_keys * 2; i++) {
+      assert(hash_table.insert_or_assign(i, Record(8, i * 2)));
+      assert(!hash_table.insert(i, Record(8, i)));
+    }
+    assert(Record::copies == 0);
 
-    printf("[PASSED]\n");
+    for (uint32_t i = 0; i < num_keys * 2; i++) {
+      Record value;
+      assert(hash_table.find(i, value));
+      bool assigned = i % 2 == 0 || i >= num_keys;
+      assert(value.packets == std::vector<uint32_t>(assigned ? 8 : 4, assigned ? i * 2 : i));
+    }
+    assert(hash_table.size() == num_keys * 2);
   }
 
-  static void TestBucketFind() {
-    printf("[TEST BUCKET FIND]\n");
+  static void TestDleftEmplace() {
+    printf("[TEST DLEFT EMPLACE]\n");
 
-    DleftType::Bucket bucket;
+    DleftFpStash<uint32_t, Record, Hasher1, Hasher2> hash_table;
+    TestDleftEmplace(hash_table);
 
-    for (int i = 0; i < bucket.bucket_capacity; i++) {
-      assert(bucket.Append(i, i, Hasher1()(i), nullptr));
+    // A resize that fails midway moves the values it has rehashed back
+    size_t memory_usage = hash_table.memory_usage();
+    assert(!hash_table.Resize(hash_table.size() / 2));
+    assert(hash_table.memory_usage() == memory_usage);
+    for (uint32_t i = 0; i < hash_table.size(); i++) {
+      Record value;
+      assert(hash_table.find(i, value) && !value.packets.empty());
     }
-
-    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
+    BufferedDleftFpStash<uint32_t, Record, Hasher1, Hasher2> buffered_hash_table;
+    TestDleftEmplace(buffered_hash_table);
+    IncrementalDleftFpStash<uint32_t, Record, Hasher1, Hasher2> incremental_hash_table;
+    TestDleftEmplace(incremental_hash_table);
+
+    // Upserts from several threads
+    ConcurrentDleftType concurrent_hash_table;
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < 4; t++) {
+      threads.emplace_back([&concurrent_hash_table, t]() {
+        for (uint32_t i = 0; i < 100000; i++) {
+          concurrent_hash_table.insert_or_assign(i, t);
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    assert(concurrent_hash_table.size() == 100000);
+    for (uint32_t i = 0; i < 100000; i++) {
       uint32_t value;
-      assert(bucket.Find(i, &value, Hasher1()(i), nullptr));
-      assert(value == i);
-      assert(bucket.Erase(i, Hasher1()(i), nullptr));
-      assert(!bucket.Find(i, nullptr, Hasher1()(i), nullptr));
-      assert(bucket.Append(i, i*2, Hasher1()(i), nullptr));
+      assert(concurrent_hash_table.find(i, value) && value < 4);
     }
 
-    for (int i = 0; i < bucket.bucket_capacity; i++) {
+    // Sharded tables forward all three
+    ShardedDleftType sharded_hash_table;
+    for (uint32_t i = 0; i < 1000; i++) {
+      assert(sharded_hash_table.try_emplace(i, i));
+      assert(!sharded_hash_table.insert_or_assign(i, i * 2));
+    }
+    for (uint32_t i = 0; i < 1000; i++) {
       uint32_t value;
-      assert(bucket.Find(i, &value, Hasher1()(i), nullptr));
-      if (i % 2 == 0) {
-        assert(value == i*2);
-      } else {
-        assert(value == i);
-      }
+      assert(sharded_hash_table.find(i, value) && value == i * 2);
     }
 
     printf("[PASSED]\n");
   }
 
-  static void TestBucketInsert() {
-    printf("[TEST BUCKET INSERT]\n");
+  static auto MakeFlowState(uint32_t key, uint8_t state) -> FlowState {
+    FlowState value;
+    value.key = key;
+    memset(value.state, state, sizeof(value.state));
+    return value;
+  }
 
-    DleftType::Bucket bucket;
+  template <class HashTable>
+  static void TestDleftSlabValues(HashTable &hash_table) {
+    static_assert(sizeof(typename HashTable::Tuple) == 2 * sizeof(uint32_t));  // The key and a handle
+    const uint32_t num_keys = 200000;
 
-    for (int i = 0; i < bucket.bucket_capacity; i++) {
-      assert(bucket.Append(i, i, Hasher1()(i), nullptr));
+    for (uint32_t i = 0; i < num_keys; i++) {
+      assert(hash_table.insert(i, MakeFlowState(i, i % 256)));
+      assert(!hash_table.insert(i, MakeFlowState(i, 0)));
     }
-
-    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
-      assert(bucket.Insert(i, i*2, Hasher1()(i), nullptr));
+    for (uint32_t i = 0; i < num_keys * 2; i++) {
+      FlowState value;
+      assert(hash_table.find(i, value) == (i < num_keys));
+      assert(i >= num_keys || (value.key == i && value.state[195] == i % 256));
     }
 
-    for (int i = 0; i < bucket.bucket_capacity; i += 2) {
-      uint32_t value;
-      assert(bucket.Find(i, &value, Hasher1()(i), nullptr));
-      if (i % 2 == 0) {
-        assert(value == i*2);
-      } else {
-        assert(value == i);
-      }
+    // Removed values give their blocks to the next ones
+    size_t num_blocks = hash_table.slab_.size_;
+    for (uint32_t i = 0; i < num_keys; i += 2) {
+      assert(hash_table.erase(i));
     }
+    for (uint32_t i = 0; i < num_keys; i += 2) {
+      assert(hash_table.insert_or_assign(i, MakeFlowState(i, 1)));
+      assert(!hash_table.insert_or_assign(i + 1, MakeFlowState(i + 1, 2)));
+    }
+    assert(hash_table.slab_.size_ == num_blocks);
+
+    size_t num_found = 0;
+    hash_table.for_each([&num_found](const uint32_t &key, FlowState &value) {
+      assert(value.key == key && value.state[0] == 1 + key % 2);
+      num_found++;
+    });
+    for (auto it = hash_table.begin(); it != hash_table.end(); ++it) {
+      assert(it->value.key == it->key && (*it).value.state[0] == 1 + it->key % 2);
+    }
+    assert(num_found == num_keys && hash_table.size() == num_keys);
 
-    printf("[PASSED]\n");
+    hash_table.clear();
+    assert(hash_table.slab_.size_ == 0);
+    FlowState value;
+    assert(!hash_table.find(0, value));
   }
 
-  static void TestBucketAppendWithOverflow() {
-    printf("[TEST BUCKET APPEND WITH OVERFLOW]\n");
-
-    DleftType::Bucket bucket;
-    DleftType::StashBucket stash_bucket;
-
-    for (int i = 0; i < bucket.bucket_capacity; i++) {
-      assert(bucket.Append(i, i, Hasher1()(i), &stash_bucket));
+  static void TestDleftSlabValues() {
+    printf("[TEST DLEFT SLAB VALUES]\n");
+
+    SlabDleftType<FlowState> hash_table;
+    TestDleftSlabValues(hash_table);
+    SlabDleftType<FlowState, true> buffered_hash_table;
+    TestDleftSlabValues(buffered_hash_table);
+    SlabDleftType<FlowState, false, false, true> incremental_hash_table;
+    TestDleftSlabValues(incremental_hash_table);
+    SlabDleftType<FlowState, false, true> concurrent_hash_table;
+    TestDleftSlabValues(concurrent_hash_table);
+
+    // Slots are moved by resizes, but values stay in their blocks
+    SlabDleftType<Record> record_hash_table;
+    Record::copies = Record::constructions = 0;
+    for (uint32_t i = 0; i < 100000; i++) {
+      assert(record_hash_table.try_emplace(i, 4, i));
+    }
+    for (uint32_t i = 0; i < 100000; i += 2) {
+      assert(record_hash_table.erase(i));
+    }
+    assert(Record::copies == 0 && Record::constructions == 100000);
+    for (uint32_t i = 1; i < 100000; i += 2) {
+      Record value;
+      assert(record_hash_table.find(i, value) && value.packets == std::vector<uint32_t>(4, i));
     }
-    assert(bucket.overflow_count_ == 0);
 
-    for (int i = bucket.bucket_capacity; i < bucket.bucket_capacity + bucket.max_minor_overflows; i++) {
-      assert(bucket.Append(i, i, Hasher1()(i), &stash_bucket));
+    // A bulk load copies each value once, into the block of its last duplicate
+    std::vector<uint32_t> keys(300000);
+    std::vector<FlowState> values(keys.size());
+    for (uint32_t i = 0; i < keys.size(); i++) {
+      keys[i] = i % 250000;
+      values[i] = MakeFlowState(keys[i], i < 250000 ? 1 : 2);
     }
-    assert(bucket.overflow_count_ == bucket.max_minor_overflows);
-    assert(bucket.GetMinorOverflowCount() == bucket.max_minor_overflows);
-    for (int i = 0; i < stash_bucket.max_major_overflows; i++) {
-      assert(stash_bucket.position_[i] == stash_bucket.invalid_pos);
+    for (size_t num_threads : {1, 4}) {
+      hash_table.build(keys.data(), values.data(), keys.size(), num_threads);
+      assert(hash_table.size() == 250000 && hash_table.slab_.free_.size() == 50000);
+      for (uint32_t i = 0; i < 250000; i++) {
+        FlowState value;
+        assert(hash_table.find(i, value) && value.key == i && value.state[0] == (i < 50000 ? 2 : 1));
+      }
     }
 
-    for (int i = bucket.bucket_capacity + bucket.max_minor_overflows;
-         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
-         i++) {
-      assert(bucket.Append(i, i, Hasher1()(i), &stash_bucket));
+    // Readers follow handles while writers insert and remove
+    std::vector<std::thread> threads;
+    std::atomic<bool> done{false};
+    for (uint32_t i = 0; i < 10000; i++) {
+      assert(concurrent_hash_table.insert(i, MakeFlowState(i, 7)));
     }
-    assert(bucket.overflow_count_ == bucket.max_minor_overflows + stash_bucket.max_major_overflows);
-    assert(bucket.GetMinorOverflowCount() == bucket.max_minor_overflows);
-    for (int i = 0; i < stash_bucket.max_major_overflows; i++) {
-      assert(stash_bucket.position_[i] != stash_bucket.invalid_pos);
+    for (int t = 0; t < 2; t++) {
+      threads.emplace_back([&concurrent_hash_table, t]() {
+        for (uint32_t i = 10000 + t; i < 200000; i += 2) {
+          assert(concurrent_hash_table.insert(i, MakeFlowState(i, 8)));
+          assert(concurrent_hash_table.erase(i - 10000));
+        }
+      });
     }
-  
-    assert(!bucket.Append(2023u, 2023u, Hasher1()(2023u), &stash_bucket));
+    threads.emplace_back([&concurrent_hash_table, &done]() {
+      while (!done) {
+        for (uint32_t i = 0; i < 200000; i += 997) {
+          FlowState value;
+          if (concurrent_hash_table.find(i, value)) {
+            assert(value.key == i && value.state[100] == (i < 10000 ? 7 : 8));
+          }
+        }
+      }
+    });
+    threads[0].join();
+    threads[1].join();
+    done = true;
+    threads[2].join();
+    assert(concurrent_hash_table.size() == 10000);
 
     printf("[PASSED]\n");
   }
 
-  static void TestBucketEraseWithOverflow() {
-    printf("[TEST BUCKET ERASE WITH OVERFLOW]\n");
-
-    DleftType::Bucket bucket;
-    DleftType::StashBucket stash_bucket;
-
-    for (int i = 0;
-         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
-         i++) {
-      assert(bucket.Append(i, i, Hasher1()(i), &stash_bucket));
+  template <class HashTable>
+  static void TestDleftSoaBuckets(HashTable &hash_table) {
+    const uint64_t testcase_size = 200000;
+    for (uint64_t i = 0; i < testcase_size; i++) {
+      assert(hash_table.insert(i << 32 | i, i));
+      assert(!hash_table.insert(i << 32 | i, 0));
     }
-    assert(bucket.overflow_count_ == bucket.max_minor_overflows + stash_bucket.max_major_overflows);
-    assert(bucket.GetMinorOverflowCount() == bucket.max_minor_overflows);
-    for (int i = 0; i < stash_bucket.max_major_overflows; i++) {
-      assert(stash_bucket.position_[i] != stash_bucket.invalid_pos);
+    for (uint64_t i = 0; i < testcase_size; i += 2) {
+      assert(hash_table.erase(i << 32 | i));
+    }
+    for (uint64_t i = 1; i < testcase_size; i += 4) {
+      assert(!hash_table.insert_or_assign(i << 32 | i, i + 1));
+    }
+    for (uint64_t i = 0; i < testcase_size * 2; i++) {
+      uint32_t value;
+      assert(hash_table.find(i << 32 | i, value) == (i < testcase_size && i % 2 == 1));
+      assert(i >= testcase_size || i % 2 == 0 || value == i + (i % 4 == 1));
     }
 
-    for (int i = 0; i < bucket.bucket_capacity; i++) {
-      assert(bucket.Erase(i, Hasher1()(i), &stash_bucket));
-      assert(!bucket.Erase(i, Hasher1()(i), &stash_bucket));
+    size_t num_found = 0;
+    for (auto it = hash_table.begin(); it != hash_table.end(); ++it) {
+      assert(it->key >> 32 == (*it).value - ((*it).value % 4 == 2));
+      num_found++;
     }
-    assert(bucket.GetSize() == 0);
+    hash_table.for_each([](const uint64_t &key, uint32_t &value) { value = key; });
+    hash_table.for_each([](const uint64_t &key, uint32_t &value) { assert(value == static_cast<uint32_t>(key)); });
+    assert(num_found == testcase_size / 2 && hash_table.size() == testcase_size / 2);
+  }
 
-    for (int i = bucket.bucket_capacity + bucket.max_minor_overflows;
-         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
-         i++) {
-      assert(bucket.Erase(i, Hasher1()(i), &stash_bucket));
-      assert(!bucket.Erase(i, Hasher1()(i), &stash_bucket));
+  static void TestDleftSoaBuckets() {
+    printf("[TEST DLEFT SOA BUCKETS]\n");
+
+    // 8-byte keys take two cachelines past the header, and values are not interleaved with them
+    using HashTable = SoaDleftType<uint64_t, uint32_t>;
+    using Bucket = typename HashTable::Bucket;
+    Bucket bucket;
+    static_assert(sizeof(Bucket) == 32 + 16 * 8 + 16 * 4);
+    static_assert(sizeof(typename DleftFpStash<uint64_t, uint32_t, Hasher<uint64_t, seed1>,
+                                               Hasher<uint64_t, seed2>>::Bucket) == 32 + 16 * 16);
+    assert(reinterpret_cast<char *>(&bucket.tuples_[15].key) - reinterpret_cast<char *>(&bucket) == 32 + 15 * 8);
+    assert(reinterpret_cast<char *>(&bucket.tuples_[0].value) - reinterpret_cast<char *>(&bucket) == 32 + 16 * 8);
+
+    HashTable hash_table;
+    TestDleftSoaBuckets(hash_table);
+    SoaDleftType<uint64_t, uint32_t, false, true> incremental_hash_table;
+    TestDleftSoaBuckets(incremental_hash_table);
+    SoaDleftType<uint64_t, uint32_t, true> concurrent_hash_table;
+    TestDleftSoaBuckets(concurrent_hash_table);
+
+    // Bulk loads and resizes place slots by index like pair buckets do
+    std::vector<uint64_t> keys(300000);
+    std::vector<uint32_t> values(keys.size());
+    for (uint32_t i = 0; i < keys.size(); i++) {
+      keys[i] = i;
+      values[i] = i * 3;
     }
-    assert(bucket.overflow_count_ == bucket.max_minor_overflows);
-    assert(bucket.GetMinorOverflowCount() == bucket.max_minor_overflows);
-    for (int i = 0; i < stash_bucket.max_major_overflows; i++) {
-      assert(stash_bucket.position_[i] == stash_bucket.invalid_pos);
+    for (size_t num_threads : {1, 4}) {
+      hash_table.build(keys.data(), values.data(), keys.size(), num_threads);
+      hash_table.set_resize_threads(num_threads);
+      hash_table.reserve(hash_table.capacity() * 2);
+      for (uint32_t i = 0; i < keys.size(); i++) {
+        uint32_t value;
+        assert(hash_table.find(keys[i], value) && value == i * 3);
+      }
     }
 
-    for (int i = bucket.bucket_capacity; i < bucket.bucket_capacity + bucket.max_minor_overflows; i++) {
-      assert(bucket.Erase(i, Hasher1()(i), &stash_bucket));
-      assert(!bucket.Erase(i, Hasher1()(i), &stash_bucket));
+    // Handles of slab values are kept in the value array
+    SoaDleftType<uint64_t, FlowState, false, false, true> slab_hash_table;
+    for (uint32_t i = 0; i < 100000; i++) {
+      assert(slab_hash_table.insert(i, MakeFlowState(i, i % 256)));
     }
-    assert(bucket.overflow_count_ == 0);
-    assert(bucket.GetMinorOverflowCount() == 0);
+    for (uint32_t i = 0; i < 100000; i++) {
+      FlowState value;
+      assert(slab_hash_table.find(i, value) && value.key == i && value.state[0] == i % 256);
+    }
+
+    // Snapshots record the layout, so that pair buckets and structure-of-arrays buckets do not open each other's
+    const char *path = "/tmp/dleft_soa_snapshot_test";
+    SoaDleftType<uint32_t, uint32_t> small_hash_table;
+    for (uint32_t i = 0; i < 100000; i++) {
+      assert(small_hash_table.insert(i, i));
+    }
+    assert(small_hash_table.save(path));
+    DleftType pair_hash_table;
+    assert(!pair_hash_table.open_mapped(path));
+    SoaDleftType<uint32_t, uint32_t> mapped_hash_table;
+    assert(mapped_hash_table.open_mapped(path) && mapped_hash_table.size() == 100000);
+    for (uint32_t i = 0; i < 100000; i++) {
+      uint32_t value;
+      assert(mapped_hash_table.find(i, value) && value == i);
+    }
+    std::remove(path);
 
     printf("[PASSED]\n");
   }
 
-  static void TestBucketFindWithOverflow() {
-    printf("[TEST BUCKET FIND WITH OVERFLOW]\n");
+  template <class K, bool concurrent, bool incremental>
+  static void TestDleftCompareKeys(CompareKeyDleftType<K, concurrent, incremental> &hash_table) {
+    // Keys that differ in their high bits only, so that 8-byte keys are told apart by both halves
+    auto make_key = [](uint32_t i) -> K { return sizeof(K) == 8 ? static_cast<K>(i % 7) << 32 | i / 7 : i; };
+    const uint32_t testcase_size = 200000;
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      assert(hash_table.insert(make_key(i), i));
+      assert(!hash_table.insert(make_key(i), 0));
+    }
+    for (uint32_t i = 0; i < testcase_size; i += 2) {
+      assert(hash_table.erase(make_key(i)));
+      assert(!hash_table.erase(make_key(i)));
+    }
+    for (uint32_t i = 0; i < testcase_size * 2; i++) {
+      uint32_t value;
+      assert(hash_table.find(make_key(i), value) == (i < testcase_size && i % 2 == 1));
+      assert(i >= testcase_size || i % 2 == 0 || value == i);
+    }
+    assert(hash_table.size() == testcase_size / 2);
+  }
 
-    DleftType::Bucket bucket;
-    DleftType::StashBucket stash_bucket;
+  static void TestDleftCompareKeys() {
+    printf("[TEST DLEFT COMPARE KEYS]\n");
 
-    for (int i = 0;
-         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
-         i++) {
-      assert(bucket.Append(i, i, Hasher1()(i), &stash_bucket));
-    }
-    assert(bucket.overflow_count_ == bucket.max_minor_overflows + stash_bucket.max_major_overflows);
-    assert(bucket.GetMinorOverflowCount() == bucket.max_minor_overflows);
-    for (int i = 0; i < stash_bucket.max_major_overflows; i++) {
-      assert(stash_bucket.position_[i] != stash_bucket.invalid_pos);
+    const ProbeKernel default_kernel = CompareKeyDleftType<uint32_t>::probe_kernel_;
+    __builtin_cpu_init();
+    for (ProbeKernel kernel : {ProbeKernel::SSE2, ProbeKernel::AVX2}) {
+      if (kernel == ProbeKernel::AVX2 && !__builtin_cpu_supports("avx2")) {
+        continue;
+      }
+      CompareKeyDleftType<uint32_t>::probe_kernel_ = kernel;
+      CompareKeyDleftType<uint64_t>::probe_kernel_ = kernel;
+
+      // Vector compares match exactly the valid slots holding the key
+      CompareKeyDleftType<uint64_t> hash_table;
+      TestDleftCompareKeys(hash_table);
+      for (size_t i = 0; i < hash_table.num_buckets_; i++) {
+        const auto &bucket = hash_table.buckets_[i];
+        for (int slot = 0; slot < 16; slot++) {
+          uint64_t key = bucket.tuples_[slot].key;
+          for (uint64_t probe : {key, key ^ 1, key ^ (uint64_t{1} << 32)}) {
+            uint16_t mask = 0;
+            for (int j = 0; j < 16; j++) {
+              mask |= (bucket.tuples_[j].key == probe) << j;
+            }
+            assert(bucket.MatchSlots(probe, 0) == (mask & bucket.validity_));
+          }
+        }
+      }
+
+      CompareKeyDleftType<uint32_t> small_hash_table;
+      TestDleftCompareKeys(small_hash_table);
+      CompareKeyDleftType<uint32_t, false, true> incremental_hash_table;
+      TestDleftCompareKeys(incremental_hash_table);
+      CompareKeyDleftType<uint32_t, true> concurrent_hash_table;
+      TestDleftCompareKeys(concurrent_hash_table);
     }
+    CompareKeyDleftType<uint32_t>::probe_kernel_ = default_kernel;
+    CompareKeyDleftType<uint64_t>::probe_kernel_ = default_kernel;
 
-    for (int i = 0;
-         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
-         i++) {
-      uint32_t value;
-      assert(bucket.Find(i, &value, Hasher1()(i), &stash_bucket));
-      assert(value == i);
-      
-      assert(bucket.Erase(i, Hasher1()(i), &stash_bucket));
-      assert(!bucket.Find(i, nullptr, Hasher1()(i), &stash_bucket));
+    printf("[PASSED]\n");
+  }
 
-      assert(bucket.Append(i, i*2, Hasher1()(i), &stash_bucket));
-      assert(bucket.Find(i, &value, Hasher1()(i), &stash_bucket));
-      assert(value == i*2);
+  // Checks that every bucket and stash bucket of a table starts on a cacheline, as it grows
+  template <class HashTable>
+  static void TestDleftAlignedBuckets(size_t bucket_size) {
+    static_assert(alignof(typename HashTable::Bucket) == CACHELINE_SIZE);
+    static_assert(alignof(typename HashTable::StashBucket) == CACHELINE_SIZE);
+    assert(sizeof(typename HashTable::Bucket) == bucket_size);
+    assert(sizeof(typename HashTable::StashBucket) % CACHELINE_SIZE == 0);
+
+    HashTable hash_table;
+    for (uint32_t i = 0; i < 300000; i++) {
+      assert(hash_table.insert(i, i));
+      if ((i & (i - 1)) == 0) {
+        assert(reinterpret_cast<uintptr_t>(hash_table.buckets_) % CACHELINE_SIZE == 0);
+        assert(reinterpret_cast<uintptr_t>(hash_table.stash_buckets_) % CACHELINE_SIZE == 0);
+      }
+    }
+    for (uint32_t i = 0; i < 300000; i++) {
+      uint32_t value;
+      assert(hash_table.find(i, value) && value == i);
     }
+  }
+
+  static void TestDleftAlignedBuckets() {
+    printf("[TEST DLEFT ALIGNED BUCKETS]\n");
+
+    // The 32-byte header and 4 or 12 8-byte pairs, without padding; 16 pairs are padded to three cachelines
+    TestDleftAlignedBuckets<PolicyDleftType<OneCachelineDleftPolicy>>(64);
+    TestDleftAlignedBuckets<PolicyDleftType<TwoCachelineDleftPolicy>>(128);
+    TestDleftAlignedBuckets<PolicyDleftType<TwoCachelineDleftPolicy, false, true>>(128);
+    TestDleftAlignedBuckets<PolicyDleftType<DleftPolicy<16, 4, 255, 1024, false, false, false, true>>>(192);
+    TestDleftAlignedBuckets<DleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2, false, false, false, false,
+                                         HugePageAllocator<>, TwoCachelineDleftPolicy>>(128);
 
     printf("[PASSED]\n");
   }
 
-  static void TestBucketInsertWithOverflow() {
-    printf("[TEST BUCKET INSERT WITH OVERFLOW]\n");
+  template <class HashTable>
+  static void TestDleftChoices(HashTable &hash_table) {
+    const uint32_t testcase_size = 200000;
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      assert(hash_table.insert(i, i));
+      assert(!hash_table.insert(i, 0));
+    }
+    for (uint32_t i = 0; i < testcase_size; i += 2) {
+      assert(hash_table.erase(i));
+      assert(!hash_table.erase(i));
+    }
+    assert(hash_table.size() == testcase_size / 2);
 
-    DleftType::Bucket bucket;
-    DleftType::StashBucket stash_bucket;
+    std::vector<uint32_t> keys(testcase_size * 2), values(keys.size());
+    std::iota(keys.begin(), keys.end(), 0);
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    hash_table.find_batch(keys.data(), values.data(), found.get(), keys.size());
+    for (uint32_t i = 0; i < testcase_size * 2; i++) {
+      uint32_t value;
+      assert(hash_table.find(i, value) == (i < testcase_size && i % 2 == 1));
+      assert(found[i] == (i < testcase_size && i % 2 == 1));
+      assert(!found[i] || (value == i && values[i] == i));
+    }
+  }
 
-    for (int i = 0;
-         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
-         i++) {
-      assert(bucket.Append(i, i, Hasher1()(i), &stash_bucket));
+  // Load at which a table of `HashTable` first grows, and the overflows counted by then
+  template <class HashTable>
+  static auto FillToFirstResize(uint64_t &overflows) -> double {
+    HashTable hash_table(1 << 16);
+    const size_t capacity = hash_table.capacity();
+    uint32_t key = 0;
+    for (; hash_table.stats().resizes == 0; key++) {
+      assert(hash_table.insert(key, key));
+      if (key == static_cast<uint32_t>(capacity * 0.95)) {
+        DleftStats stats = hash_table.stats();
+        overflows = stats.minor_overflows + stats.major_overflows;
+      }
     }
+    return 1.0 * key / capacity;
+  }
 
-    for (int i = 0;
-         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
-         i += 2) {
-      assert(bucket.Insert(i, i*2, Hasher1()(i), &stash_bucket));
+  static void TestDleftChoices() {
+    printf("[TEST DLEFT CHOICES]\n");
+
+    ChoiceDleftType<3> hash_table(1000);
+    TestDleftChoices(hash_table);
+    ChoiceDleftType<4> four_choice_hash_table(1000);
+    TestDleftChoices(four_choice_hash_table);
+    ChoiceDleftType<3, false, true> incremental_hash_table(1000);
+    TestDleftChoices(incremental_hash_table);
+    ChoiceDleftType<4, true> concurrent_hash_table(1000);
+    TestDleftChoices(concurrent_hash_table);
+
+    // Writers lock all candidate buckets of a key, so readers keep seeing preloaded keys as the table grows
+    ChoiceDleftType<3, true> shared_hash_table(1000);
+    for (uint32_t i = 0; i < 20000; i++) {
+      assert(shared_hash_table.insert(i, i));
+    }
+    std::atomic<bool> done{false};
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < 4; t++) {
+      threads.emplace_back([&shared_hash_table, t]() {
+        for (uint32_t i = 20000 + t * 50000; i < 20000 + (t + 1) * 50000; i++) {
+          assert(shared_hash_table.insert(i, i));
+        }
+      });
+    }
+    std::thread reader([&shared_hash_table, &done]() {
+      while (!done) {
+        for (uint32_t i = 0; i < 20000; i++) {
+          uint32_t value;
+          assert(shared_hash_table.find(i, value) && value == i);
+        }
+      }
+    });
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    done = true;
+    reader.join();
+    assert(shared_hash_table.size() == 220000);
+
+    // Removals promote major overflows back to buckets with any number of choices
+    PolicyDleftType<DleftPolicy<8, 1, 64, 16, false, false, false, false, 3>> promotion_hash_table(1 << 16);
+    TestDleftPromotion(promotion_hash_table);
+    for (size_t num_threads : {1, 4}) {
+      TestDleftBuild<ChoiceDleftType<3>>(300000, num_threads);
+      TestDleftBuild<ChoiceDleftType<4, true>>(300000, num_threads);
+      TestDleftParallelResize<ChoiceDleftType<3>>(num_threads + 1);
     }
 
-    for (int i = 0;
-         i < bucket.bucket_capacity + bucket.max_minor_overflows + stash_bucket.max_major_overflows;
-         i += 2) {
+    // More choices even out buckets, so that fewer keys overflow at the same load, and tables fill up further
+    uint64_t overflows2 = 0, overflows3 = 0, overflows4 = 0;
+    double load2 = FillToFirstResize<StatsDleftType<>>(overflows2);
+    double load3 = FillToFirstResize<ChoiceDleftType<3>>(overflows3);
+    double load4 = FillToFirstResize<ChoiceDleftType<4>>(overflows4);
+    assert(overflows4 < overflows3 && overflows3 * 2 < overflows2);
+    assert(load2 < load3 && load3 <= load4);
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestDleftDisplacement() {
+    printf("[TEST DLEFT DISPLACEMENT]\n");
+
+    DisplacementDleftType<4> hash_table(1000);
+    TestDleftChoices(hash_table);
+    DisplacementDleftType<4, false, true> incremental_hash_table(1000);
+    TestDleftChoices(incremental_hash_table);
+    DisplacementDleftType<4, true> concurrent_hash_table(1000);
+    TestDleftChoices(concurrent_hash_table);
+    DisplacementDleftType<4, false, false, true> partial_key_hash_table(1000);
+    TestDleftChoices(partial_key_hash_table);
+    DisplacementDleftType<3, false, false, false, 3> choice_hash_table(1000);
+    TestDleftChoices(choice_hash_table);
+    for (size_t num_threads : {1, 4}) {
+      TestDleftBuild<DisplacementDleftType<4, true>>(300000, num_threads);
+    }
+
+    // Chains of moves make room where single moves cannot, so tables fill up further before they grow
+    uint64_t overflows = 0;
+    double load1 = FillToFirstResize<StatsDleftType<>>(overflows);
+    double load2 = FillToFirstResize<DisplacementDleftType<2>>(overflows);
+    double load4 = FillToFirstResize<DisplacementDleftType<4>>(overflows);
+    assert(load1 + 0.005 < load2 && load2 <= load4);
+
+    // Each insertion that ran out of space is counted once, by the length of the chain that made room for it
+    DisplacementDleftType<4> stats_hash_table(1 << 16);
+    uint32_t testcase_size = 0;
+    for (; stats_hash_table.stats().resizes == 0; testcase_size++) {
+      assert(stats_hash_table.insert(testcase_size, testcase_size));
+    }
+    for (uint32_t i = 0; i < testcase_size; i++) {  // Keys moved along chains are all still found
       uint32_t value;
-      assert(bucket.Find(i, &value, Hasher1()(i), &stash_bucket));
-      if (i % 2 == 0) {
-        assert(value == i*2);
-      } else {
-        assert(value == i);
-      }
+      assert(stats_hash_table.find(i, value) && value == i);
+    }
+    DleftStats stats = stats_hash_table.stats();
+    uint64_t chains = 0;
+    for (int i = 1; i <= DleftStats::max_path_length; i++) {
+      assert(i <= 4 || stats.path_lengths[i] == 0);
+      chains += stats.path_lengths[i];
     }
+    assert(stats.path_lengths[0] == 1 && stats.path_lengths[2] > 0);
+    assert(chains + stats.path_lengths[0] == stats.one_move_attempts);
+    assert(stats.path_lengths[1] == stats.one_move_successes);
 
     printf("[PASSED]\n");
   }
@@ -1528,6 +6155,36 @@ class DleftTest {
     printf("[PASSED]\n");
   }
 
+  static void TestDleftFindBatch() {
+    printf("[TEST DLEFT FIND BATCH]\n");
+
+    const int testcase_size = 60000;
+    DleftType hash_table(testcase_size);
+
+    for (int i = 0; i < testcase_size; i++) {
+      assert(hash_table.Append(i, i, Hasher1()(i), Hasher2()(i)));
+    }
+
+    // Mix positive and negative lookups, with a batch size that is not a multiple of the prefetch batch
+    const int batch_size = 100;
+    uint32_t keys[batch_size], values[batch_size];
+    bool found[batch_size];
+    for (int begin = 0; begin < testcase_size * 2; begin += batch_size) {
+      for (int i = 0; i < batch_size; i++) {
+        keys[i] = begin + i;
+      }
+      hash_table.find_batch(keys, values, found, batch_size);
+      for (int i = 0; i < batch_size; i++) {
+        assert(found[i] == (keys[i] < testcase_size));
+        if (found[i]) {
+          assert(values[i] == keys[i]);
+        }
+      }
+    }
+
+    printf("[PASSED]\n");
+  }
+
   static void TestDleftInsert() {
     printf("[TEST DLEFT INSERT]\n");
 
@@ -1579,42 +6236,722 @@ class DleftTest {
       assert(value == i);
     }
 
+    printf("[PASSED]\n");
+  }
+
+  template <class HashTable>
+  static void TestDleftParallelResize(size_t num_threads) {
+    const uint32_t testcase_size = 200000;
+    HashTable hash_table(1000);
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      assert(hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+    }
+    for (uint32_t i = 0; i < testcase_size; i += 3) {
+      assert(hash_table.erase(i));
+    }
+    size_t size = hash_table.size();
+
+    // Shrinking below the number of keys fails, leaving the table as it was
+    size_t num_buckets = hash_table.num_buckets_;
+    assert(!hash_table.Resize(size / 2, num_threads));
+    assert(hash_table.num_buckets_ == num_buckets && hash_table.size() == size);
+
+    assert(hash_table.Resize(hash_table.capacity() * 2, num_threads));
+    assert(hash_table.size() == size);
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      uint32_t value;
+      assert(hash_table.find(i, value) == (i % 3 != 0));
+      assert(i % 3 == 0 || value == i);
+    }
+
+    // The table grows with as many threads as it is told to
+    hash_table.set_resize_threads(num_threads);
+    for (uint32_t i = testcase_size; i < testcase_size * 4; i++) {
+      assert(hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+    }
+    assert(hash_table.size() == size + testcase_size * 3);
+    for (uint32_t i = 0; i < testcase_size * 4; i++) {
+      uint32_t value;
+      assert(hash_table.find(i, value) == (i >= testcase_size || i % 3 != 0));
+      assert(i % 3 == 0 || value == i);
+    }
+  }
+
+  static void TestDleftParallelResize() {
+    printf("[TEST DLEFT PARALLEL RESIZE]\n");
+
+    for (size_t num_threads : {2, 4, 7}) {
+      TestDleftParallelResize<DleftType>(num_threads);
+      TestDleftParallelResize<BufferedDleftType>(num_threads);
+      TestDleftParallelResize<ConcurrentDleftType>(num_threads);
+      TestDleftParallelResize<PartialKeyDleftType>(num_threads);
+      TestDleftParallelResize<PolicyDleftType<DleftPolicy<4, 1, 32, 16>>>(num_threads);  // Many keys left over
+    }
+
+    // Rehashed keys keep pointing into the arena
+    StringDleftType<> string_hash_table;
+    string_hash_table.set_resize_threads(4);
+    for (uint32_t i = 0; i < 200000; i++) {
+      std::string key = "host" + std::to_string(i) + ".example.com";
+      assert(string_hash_table.insert(KeySpan(key), std::forward<uint32_t>(i)));
+    }
+    for (uint32_t i = 0; i < 200000; i++) {
+      std::string key = "host" + std::to_string(i) + ".example.com";
+      uint32_t value;
+      assert(string_hash_table.find(KeySpan(key), value) && value == i);
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestDleftIncrementalResize() {
+    printf("[TEST DLEFT INCREMENTAL RESIZE]\n");
+
+    const uint32_t testcase_size = 200000;
+    IncrementalDleftType hash_table(1024);
+    int migrations = 0;
+
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      bool migrating = hash_table.Migrating();
+      assert(hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+      assert(!hash_table.insert(std::forward<uint32_t>(i), i + 1));
+      migrations += !migrating && hash_table.Migrating();
+
+      if (hash_table.Migrating() && i % 2 == 1) {  // Keys inserted before the resize must be found in either array
+        uint32_t value;
+        assert(hash_table.find(i / 2, value));
+        assert(value == i / 2);
+        assert(!hash_table.find(testcase_size + i, value));
+      }
+    }
+    assert(migrations > 0);
+    assert(hash_table.size() == testcase_size);
+
+    uint32_t extra = testcase_size;
+    while (!hash_table.Migrating()) {  // Grow the table again, so that half of the keys are erased while migrating
+      assert(hash_table.insert(std::forward<uint32_t>(extra), std::forward<uint32_t>(extra)));
+      extra++;
+    }
+    for (uint32_t i = 0; i < testcase_size; i += 2) {
+      assert(hash_table.erase(i));
+      assert(!hash_table.erase(i));
+    }
+    for (uint32_t i = testcase_size; i < extra; i++) {
+      assert(hash_table.erase(i));
+    }
+    assert(!hash_table.Migrating());
+    assert(hash_table.size() == testcase_size / 2);
+
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      uint32_t value;
+      assert(hash_table.find(i, value) == (i % 2 == 1));
+      assert(i % 2 == 0 || value == i);
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestDleftLargeTable() {
+    printf("[TEST DLEFT LARGE TABLE]\n");
+
+    const uint32_t testcase_size = 6000000;
+    DleftType hash_table(1 << 23);  // 2^19 buckets and 2^9 stash buckets
+    assert(hash_table.num_buckets_ > (1 << 16));
+    assert(hash_table.num_stash_buckets_ > (1 << 8));
+
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      assert(hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+    }
+    assert(hash_table.size() == testcase_size);
+
+    size_t used_high_buckets = 0;  // Buckets past the old 65,536-bucket limit must be used too
+    for (size_t i = 1 << 16; i < hash_table.num_buckets_; i++) {
+      used_high_buckets += hash_table.buckets_[i].GetSize() > 0;
+    }
+    assert(used_high_buckets > (hash_table.num_buckets_ - (1 << 16)) / 2);
+
+    for (uint32_t i = 0; i < testcase_size; i += 2) {
+      assert(hash_table.erase(i));
+    }
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      uint32_t value;
+      assert(hash_table.find(i, value) == (i % 2 == 1));
+      assert(i % 2 == 0 || value == i);
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestDleftPartialKey() {
+    printf("[TEST DLEFT PARTIAL KEY]\n");
+
+    // Without stash buckets, a table relies on one-moves once buckets fill up; the keys are hashed by the
+    // test itself, so that the counting hashers only count hashing inside the table
+    using CountingDleftType = DleftFpStash<uint32_t, uint32_t, CountingHasher1, CountingHasher2>;
+    using CountingPartialKeyDleftType = PartialKeyDleftFpStash<uint32_t, uint32_t, CountingHasher1, CountingHasher2>;
+    const uint32_t testcase_size = 1024;
+    CountingDleftType hash_table(testcase_size);
+    CountingPartialKeyDleftType partial_key_hash_table(testcase_size);
+    assert(partial_key_hash_table.num_stash_buckets_ == 0);
+
+    uint32_t key = 0;
+    CountingHasher1::calls = CountingHasher2::calls = 0;
+    while (hash_table.Append(std::forward<uint32_t>(key), std::forward<uint32_t>(key), Hasher1()(key), Hasher2()(key))) {
+      key++;
+    }
+    assert(CountingHasher1::calls > 0);  // One-moves rehash keys
+
+    uint32_t num_keys = 0;
+    CountingHasher1::calls = CountingHasher2::calls = 0;
+    while (true) {
+      uint32_t hash1 = Hasher1()(num_keys);
+      if (!partial_key_hash_table.Append(std::forward<uint32_t>(num_keys), std::forward<uint32_t>(num_keys), hash1,
+                                         partial_key_hash_table.Hash2(num_keys, hash1))) {
+        break;
+      }
+      num_keys++;
+    }
+    assert(CountingHasher1::calls == 0 && CountingHasher2::calls == 0);  // But not in partial-key mode
+    assert(num_keys > testcase_size * 3 / 4);
+
+    for (uint32_t i = 0; i < num_keys; i++) {  // Moved keys must still be found
+      uint32_t value;
+      assert(partial_key_hash_table.find(i, value));
+      assert(value == i);
+    }
+    assert(CountingHasher2::calls == 0);  // `H2` is never used
+
+    PartialKeyDleftType large_hash_table(1000);
+    for (uint32_t i = 0; i < 200000; i++) {  // Resizes must keep partial-key placement too
+      assert(large_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+    }
+    for (uint32_t i = 0; i < 200000; i += 2) {
+      assert(large_hash_table.erase(i));
+    }
+    for (uint32_t i = 0; i < 200000; i++) {
+      uint32_t value;
+      assert(large_hash_table.find(i, value) == (i % 2 == 1));
+      assert(i % 2 == 0 || value == i);
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestDleftProbeKernels() {
+    printf("[TEST DLEFT PROBE KERNELS]\n");
+
+    // Fill the table up, so that buckets have minor and major overflows
+    const uint32_t testcase_size = 1 << 16;
+    DleftType hash_table(testcase_size);
+    uint32_t num_keys = 0;
+    while (hash_table.Append(std::forward<uint32_t>(num_keys), std::forward<uint32_t>(num_keys), Hasher1()(num_keys),
+                             Hasher2()(num_keys))) {
+      num_keys++;
+    }
+
+    const ProbeKernel default_kernel = DleftType::probe_kernel_;
+    __builtin_cpu_init();
+    assert(default_kernel == (__builtin_cpu_supports("avx512bw") ? ProbeKernel::AVX512
+                              : __builtin_cpu_supports("avx2") ? ProbeKernel::AVX2 : ProbeKernel::SSE2));
+    for (ProbeKernel kernel : {ProbeKernel::SSE2, ProbeKernel::AVX2, ProbeKernel::AVX512}) {
+      if ((kernel == ProbeKernel::AVX2 && !__builtin_cpu_supports("avx2")) ||
+          (kernel == ProbeKernel::AVX512 && !__builtin_cpu_supports("avx512bw"))) {
+        continue;
+      }
+      DleftType::probe_kernel_ = kernel;
+
+      for (uint32_t i = 0; i < num_keys * 2; i++) {  // Every kernel must agree with the 128-bit searches
+        uint32_t hash1 = Hasher1()(i), hash2 = Hasher2()(i);
+        const auto *bucket1 = &hash_table.buckets_[DleftType::BucketIdx(hash1, hash_table.num_buckets_)];
+        const auto *bucket2 = &hash_table.buckets_[DleftType::BucketIdx(hash2, hash_table.num_buckets_)];
+        auto masks = DleftType::Probe(i, bucket1, bucket2, hash1, hash2);
+        assert(masks.fingerprints ==
+               (bucket1->MatchFingerprints(hash1) | (uint32_t(bucket2->MatchFingerprints(hash2)) << 16)));
+        assert(masks.overflows == uint16_t(bucket1->MatchOverflows(hash1) | (bucket2->MatchOverflows(hash2) << 8)));
+
+        uint32_t value;
+        assert(hash_table.find(i, value) == (i < num_keys));
+        assert(i >= num_keys || value == i);
+      }
+    }
+    DleftType::probe_kernel_ = default_kernel;
+
+    printf("[PASSED]\n");
+  }
+
+  template <class HashTable>
+  static void TestDleftAllocator() {
+    HashTable hash_table(1000);
+    for (uint32_t i = 0; i < 400000; i++) {  // Grows from one page to several huge pages, freeing the old arrays
+      assert(hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+      assert(reinterpret_cast<uintptr_t>(hash_table.buckets_) % CACHELINE_SIZE == 0);
+      assert(reinterpret_cast<uintptr_t>(hash_table.stash_buckets_) % CACHELINE_SIZE == 0);
+    }
+    for (uint32_t i = 0; i < 400000; i += 2) {
+      assert(hash_table.erase(i));
+    }
+    for (uint32_t i = 0; i < 400000; i++) {
+      uint32_t value = 0;
+      assert(hash_table.find(i, value) == (i % 2 == 1));
+      assert(i % 2 == 0 || value == i);
+    }
+  }
+
+  static void TestDleftAllocators() {
+    printf("[TEST DLEFT ALLOCATORS]\n");
+
+    TestDleftAllocator<AllocatorDleftType<AlignedAllocator>>();
+    TestDleftAllocator<AllocatorDleftType<HugePageAllocator<>>>();
+    TestDleftAllocator<AllocatorDleftType<HugePageAllocator<HUGE_PAGE_SIZE, true>>>();
+    TestDleftAllocator<AllocatorDleftType<HugeTLBAllocator<>>>();  // Falls back if no huge page is reserved
+    TestDleftAllocator<AllocatorDleftType<HugePageAllocator<>, true>>();  // Retires the old arrays instead
+    TestDleftAllocator<AllocatorDleftType<HugePageAllocator<>, false, true>>();  // Frees them bucket by bucket
+
+    // Large arrays start at a huge page boundary
+    AllocatorDleftType<HugePageAllocator<>> hash_table(1 << 20);
+    assert(reinterpret_cast<uintptr_t>(hash_table.buckets_) % HUGE_PAGE_SIZE == 0);
+
+    printf("[PASSED]\n");
+  }
+
+  template <class HashTable>
+  static void TestDleftPolicy() {
+    using StashBucket = typename HashTable::StashBucket;
+
+    // A full stash bucket has no free slot, whatever its capacity
+    auto stash_bucket = std::make_unique<StashBucket>();
+    for (uint32_t i = 0; i < StashBucket::bucket_capacity; i++) {
+      assert(stash_bucket->InsertMinorOverflow(std::forward<uint32_t>(i), std::forward<uint32_t>(i)) == i);
+    }
+    assert(stash_bucket->GetSize() == StashBucket::bucket_capacity);
+    assert(stash_bucket->InsertMinorOverflow(0u, 0u) == StashBucket::invalid_pos);
+
+    const uint32_t testcase_size = 200000;
+    HashTable hash_table(1000);
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      assert(hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+    }
+    for (uint32_t i = 0; i < testcase_size; i += 2) {
+      assert(hash_table.erase(i));
+    }
+    assert(hash_table.size() == testcase_size / 2);
+    assert(hash_table.num_stash_buckets_ == hash_table.num_buckets_ / HashTable::policy_type::stash_ratio);
+    for (uint32_t i = 0; i < testcase_size * 2; i++) {
+      uint32_t value;
+      assert(hash_table.find(i, value) == (i < testcase_size && i % 2 == 1));
+      assert(i >= testcase_size || i % 2 == 0 || value == i);
+    }
+  }
+
+  static void TestDleftPolicies() {
+    printf("[TEST DLEFT POLICIES]\n");
+
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<>>>();
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<8, 2, 64, 64>>>();
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<12, 3, 100, 256>>>();
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<4, 1, 32, 16>, true>>();  // The write buffer is the whole bucket
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<8, 2, 64, 64>, false, true>>();
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<16, 4, 255, 1024, false, true>>>();
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<8, 2, 64, 64, false, true>, false, true>>();
+    TestDleftPolicy<PolicyDleftType<OneCachelineDleftPolicy>>();
+    TestDleftPolicy<PolicyDleftType<TwoCachelineDleftPolicy, false, true>>();
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<4, 1, 32, 16, false, false, false, false, 3>>>();
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<8, 2, 64, 64, false, false, false, false, 4>, false, true>>();
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<16, 4, 255, 1024, false, true, true, false, 3>>>();
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<4, 1, 32, 16, false, false, false, false, 2, 4>, true>>();
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<8, 2, 64, 64, true, true, false, false, 2, 3>, false, true>>();
+    TestDleftPolicy<PolicyDleftType<DleftPolicy<8, 2, 64, 64, false, false, false, true, 3, 2>>>();
+
+    printf("[PASSED]\n");
+  }
+
+  // Checks that `for_each`, `parallel_for_each` and iterators each see the keys `expected` once, with their values
+  template <class HashTable>
+  static void CheckIteration(HashTable &hash_table, const std::vector<uint32_t> &expected) {
+    std::vector<uint32_t> keys;
+    hash_table.for_each([&](const uint32_t &key, uint32_t &value) {
+      assert(key == value);
+      keys.push_back(key);
+    });
+    std::sort(keys.begin(), keys.end());
+    assert(keys == expected);
+
+    keys.clear();
+    for (auto &tuple : hash_table) {
+      assert(tuple.key == tuple.value);
+      keys.push_back(tuple.key);
+    }
+    std::sort(keys.begin(), keys.end());
+    assert(keys == expected);
+
+    for (size_t num_threads : {1, 3, 8}) {
+      std::vector<std::atomic<uint8_t>> seen(expected.empty() ? 0 : expected.back() + 1);
+      std::atomic<size_t> count{0};
+      hash_table.parallel_for_each([&](const uint32_t &key, uint32_t &value) {
+        assert(key == value && key < seen.size());
+        assert(seen[key].fetch_add(1) == 0);
+        count++;
+      }, num_threads);
+      assert(count == expected.size());
+    }
+  }
+
+  static void TestDleftIteration() {
+    printf("[TEST DLEFT ITERATION]\n");
+
+    DleftType empty_hash_table;
+    assert(empty_hash_table.begin() == empty_hash_table.end());
+    CheckIteration(empty_hash_table, {});
+
+    // Filled up until insertion fails, so that many keys are minor and major overflows in stash buckets
+    DleftType hash_table(1 << 16);
+    std::vector<uint32_t> expected;
+    uint32_t num_keys = 0;
+    while (hash_table.Append(std::forward<uint32_t>(num_keys), std::forward<uint32_t>(num_keys), Hasher1()(num_keys),
+                             Hasher2()(num_keys))) {
+      num_keys++;
+    }
+    for (uint32_t i = 0; i < num_keys; i++) {
+      if (i % 3 == 0) {
+        assert(hash_table.erase(i));
+      } else {
+        expected.push_back(i);
+      }
+    }
+    CheckIteration(hash_table, expected);
+
+    // Values can be updated in place
+    hash_table.for_each([](const uint32_t &key, uint32_t &value) { value = key * 2; });
+    for (auto it = hash_table.begin(); it != hash_table.end(); it++) {
+      assert(it->value == it->key * 2);
+      it->value = it->key;
+    }
+
+    // Halfway through a migration, keys are split between the old and the new arrays
+    IncrementalDleftType incremental_hash_table(1000);
+    expected.clear();
+    for (uint32_t i = 0; incremental_hash_table.old_buckets_ == nullptr || incremental_hash_table.migrate_idx_ <
+                         incremental_hash_table.old_num_buckets_ / 2; i++) {
+      assert(incremental_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+      expected.push_back(i);
+    }
+    CheckIteration(incremental_hash_table, expected);
+
+    ConcurrentDleftType concurrent_hash_table;
+    for (uint32_t i = 0; i < expected.size(); i++) {
+      assert(concurrent_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+    }
+    CheckIteration(concurrent_hash_table, expected);
+
+    printf("[PASSED]\n");
+  }
+
+  template <class HashTable>
+  static void TestDleftBuild(size_t n, size_t num_threads) {
+    // Keys in random order, then every fourth key again with a larger value, which must win
+    std::vector<uint32_t> keys(n), values;
+    std::iota(keys.begin(), keys.end(), 0);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(n));
+    values = keys;
+    for (uint32_t i = 0; i < n; i += 4) {
+      keys.push_back(i);
+      values.push_back(i + 1);
+    }
+
+    HashTable hash_table;
+    for (uint32_t i = 0; i < 1000; i++) {  // Dropped by `build`
+      assert(hash_table.insert(std::forward<uint32_t>(n + i), std::forward<uint32_t>(i)));
+    }
+    hash_table.build(keys.data(), values.data(), keys.size(), num_threads);
+    assert(hash_table.size() == n);
+    for (uint32_t i = 0; i < n + 1000; i++) {
+      uint32_t value;
+      assert(hash_table.find(i, value) == (i < n));
+      assert(i >= n || value == (i % 4 == 0 ? i + 1 : i));
+    }
+    for (uint32_t i = 0; i < n; i += 2) {  // The table keeps working as usual
+      assert(hash_table.erase(i));
+    }
+    for (uint32_t i = n; i < n * 2; i++) {
+      assert(hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+    }
+    assert(hash_table.size() == n / 2 + n);
+  }
+
+  static void TestDleftBuild() {
+    printf("[TEST DLEFT BUILD]\n");
+
+    for (size_t num_threads : {1, 4, 7}) {
+      TestDleftBuild<DleftType>(300000, num_threads);
+      TestDleftBuild<DleftType>(1000, num_threads);
+      TestDleftBuild<BufferedDleftType>(300000, num_threads);
+      TestDleftBuild<ConcurrentDleftType>(300000, num_threads);
+      TestDleftBuild<IncrementalDleftType>(300000, num_threads);
+      TestDleftBuild<PartialKeyDleftType>(300000, num_threads);
+      TestDleftBuild<PolicyDleftType<DleftPolicy<4, 1, 32, 16>>>(300000, num_threads);  // Many keys left over
+    }
+    DleftType hash_table;
+    hash_table.build(nullptr, nullptr, 0);
+    assert(hash_table.size() == 0);
+
+    // Keys go to the less loaded of their buckets, as inserted ones do, so that few more overflow to the stash than
+    // when inserting them, with the buckets 93% full; placing each key into its first bucket with room, when there
+    // is one, overflows several times more
+    auto stashed = [](const DleftType &hash_table) {
+      size_t in_buckets = 0;
+      for (size_t i = 0; i < hash_table.num_buckets_; i++) {
+        in_buckets += hash_table.buckets_[i].GetSize();
+      }
+      return hash_table.size() - in_buckets;
+    };
+    std::vector<uint32_t> build_keys(490000);
+    std::iota(build_keys.begin(), build_keys.end(), 0);
+    DleftType built_table, inserted_table;
+    built_table.build(build_keys.data(), build_keys.data(), build_keys.size(), 4);
+    while (inserted_table.num_buckets_ < built_table.num_buckets_) {
+      inserted_table.Resize(inserted_table.BucketCapacity() * 2);
+    }
+    for (uint32_t key : build_keys) {
+      assert(inserted_table.insert(std::forward<uint32_t>(key), std::forward<uint32_t>(key)));
+    }
+    assert(inserted_table.num_buckets_ == built_table.num_buckets_);
+    assert(stashed(built_table) < stashed(inserted_table) * 3);
+
+    // Keys are copied into the arena, whichever thread places them
+    std::vector<std::string> strings;
+    std::vector<KeySpan> keys;
+    std::vector<uint32_t> values;
+    for (uint32_t i = 0; i < 200000; i++) {
+      strings.push_back("host" + std::to_string(i) + ".example.com");
+      values.push_back(i);
+    }
+    for (const auto &str : strings) {
+      keys.emplace_back(str);
+    }
+    StringDleftType<> string_hash_table;
+    string_hash_table.build(keys.data(), values.data(), keys.size(), 4);
+    strings.clear();
+    for (uint32_t i = 0; i < 200000; i++) {
+      std::string key = "host" + std::to_string(i) + ".example.com";
+      uint32_t value;
+      assert(string_hash_table.find(KeySpan(key), value) && value == i);
+    }
+
+    // Each thread copies into an arena of its own, spliced into the table's, which later keys go on filling
+    size_t key_bytes = 0;
+    for (const KeySpan &key : keys) {
+      key_bytes += key.size();
+    }
+    assert(string_hash_table.memory_usage() > key_bytes);
+    for (uint32_t i = 200000; i < 210000; i++) {
+      std::string key = "host" + std::to_string(i) + ".example.com";
+      assert(string_hash_table.insert(KeySpan(key), std::forward<uint32_t>(i)));
+    }
+    for (uint32_t i = 0; i < 210000; i++) {
+      std::string key = "host" + std::to_string(i) + ".example.com";
+      uint32_t value;
+      assert(string_hash_table.find(KeySpan(key), value) && value == i);
+    }
+
+    printf("[PASSED]\n");
+  }
+
+  static void TestDleftSnapshot() {
+    printf("[TEST DLEFT SNAPSHOT]\n");
+
+    const char *path = "/tmp/dleft_snapshot_test";
+    const uint32_t testcase_size = 200000;
+    DleftType hash_table(1000);
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      assert(hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+    }
+    for (uint32_t i = 0; i < testcase_size; i += 2) {
+      assert(hash_table.erase(i));
+    }
+    assert(hash_table.save(path));
+
+    auto check = [](auto &hash_table, uint32_t begin, uint32_t end) {
+      assert(hash_table.size() == static_cast<size_t>(end - begin) / 2);
+      for (uint32_t i = begin; i < end; i++) {
+        uint32_t value;
+        assert(hash_table.find(i, value) == (i % 2 == 1));
+        assert(i % 2 == 0 || value == i);
+      }
+    };
+
+    DleftType mapped_hash_table(16);
+    assert(mapped_hash_table.open_mapped(path));
+    assert(mapped_hash_table.num_buckets_ == hash_table.num_buckets_);
+    check(mapped_hash_table, 0, testcase_size);
+    for (uint32_t i = testcase_size; i < testcase_size * 4; i++) {  // Grows out of the mapping, which is then unmapped
+      assert(mapped_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+      if (i % 2 == 0) {
+        assert(mapped_hash_table.erase(i));
+      }
+    }
+    assert(mapped_hash_table.mappings_.empty());
+    check(mapped_hash_table, 0, testcase_size * 4);
+
+    // Changes to a mapped table are not written back; modes that keep the same layout can open the snapshot too
+    ConcurrentDleftType concurrent_hash_table;
+    assert(concurrent_hash_table.open_mapped(path));
+    check(concurrent_hash_table, 0, testcase_size);
+    IncrementalDleftType incremental_hash_table;
+    assert(incremental_hash_table.open_mapped(path));
+    for (uint32_t i = testcase_size; i < testcase_size * 2; i++) {
+      assert(incremental_hash_table.insert(std::forward<uint32_t>(i), std::forward<uint32_t>(i)));
+      if (i % 2 == 0) {
+        assert(incremental_hash_table.erase(i));
+      }
+    }
+    check(incremental_hash_table, 0, testcase_size * 2);
+
+    PartialKeyDleftType partial_key_hash_table;  // Places keys differently
+    assert(!partial_key_hash_table.open_mapped(path));
+    ChoiceDleftType<3> choice_hash_table;  // So do more choices
+    assert(!choice_hash_table.open_mapped(path));
+    assert(!mapped_hash_table.open_mapped("/tmp/dleft_snapshot_test_missing"));
+    std::remove(path);
+
+    printf("[PASSED]\n");
+  }
+
+  template <class HashTable>
+  static void TestDleftStringKey() {
+    // Keys of all sizes, built in temporary strings, which the table must not keep pointing to
+    auto make_key = [](uint32_t i) {
+      return i % 3 == 0 ? std::to_string(i) : "www." + std::to_string(i) + std::string(i % 64, 'x') + ".example.com";
+    };
+    const uint32_t testcase_size = 100000;
+    HashTable hash_table;
+    for (uint32_t i = 0; i < testcase_size; i++) {
+      std::string key = make_key(i);
+      assert(hash_table.insert(KeySpan(key), std::forward<uint32_t>(i)));
+      assert(!hash_table.insert(KeySpan(key), std::forward<uint32_t>(i)));
+    }
+    for (uint32_t i = 0; i < testcase_size; i += 2) {
+      std::string key = make_key(i);
+      assert(hash_table.erase(KeySpan(key)));
+    }
+    assert(hash_table.size() == testcase_size / 2);
+    for (uint32_t i = 0; i < testcase_size * 2; i++) {
+      std::string key = make_key(i);
+      uint32_t value;
+      assert(hash_table.find(KeySpan(key), value) == (i < testcase_size && i % 2 == 1));
+      assert(i >= testcase_size || i % 2 == 0 || value == i);
+      if (i % 3 != 0) {  // A prefix of a key is another key
+        key.pop_back();
+        assert(!hash_table.find(KeySpan(key), value));
+      }
+    }
+
+    // Walking the table views each key in the arena
+    size_t walked = 0;
+    hash_table.for_each([&](const KeySpan &key, uint32_t value) {
+      assert(std::string(key.data(), key.size()) == make_key(value));
+      walked++;
+    });
+    assert(walked == testcase_size / 2);
+
+    // Clearing the table makes room for as many keys again
+    size_t memory_usage = hash_table.memory_usage();
+    hash_table.clear();
+    for (uint32_t i = 1; i < testcase_size; i += 2) {
+      std::string key = make_key(i);
+      assert(hash_table.insert(KeySpan(key), std::forward<uint32_t>(i)));
+    }
+    assert(hash_table.memory_usage() <= memory_usage);
+
+    // Replacing the keys one by one many times over leaves no more than a few times their bytes in the arena
+    hash_table.clear();
+    const uint32_t window = 10000;
+    for (uint32_t i = 0; i < window * 50; i++) {
+      std::string key = make_key(i);
+      assert(hash_table.insert(KeySpan(key), std::forward<uint32_t>(i)));
+      if (i >= window) {
+        key = make_key(i - window);
+        assert(hash_table.erase(KeySpan(key)));
+      }
+      if (i == window * 2) {
+        memory_usage = hash_table.memory_usage();
+      }
+    }
+    assert(hash_table.memory_usage() <= memory_usage + 6 * HashTable::KeyArena::first_chunk_size);
+    for (uint32_t i = window * 49; i < window * 51; i++) {
+      std::string key = make_key(i);
+      uint32_t value;
+      assert(hash_table.find(KeySpan(key), value) == (i < window * 50));
+    }
+  }
+
+  static void TestDleftStringKeys() {
+    printf("[TEST DLEFT STRING KEYS]\n");
+
+    TestDleftStringKey<StringDleftType<>>();
+    TestDleftStringKey<StringDleftType<true>>();
+    TestDleftStringKey<StringDleftType<false, true>>();
+
+    // Slots hold the offset and length of a key in the arena
+    static_assert(sizeof(typename StringDleftType<>::StoredKey) == 8);
+
+    StringDleftType<> hash_table;
+    assert(hash_table.insert(KeySpan(), 1));  // The empty key is a key too
+    uint32_t value;
+    assert(hash_table.find(KeySpan(""), value) && value == 1);
+
+    // Keys longer than a slot can tell are rejected, by insertions and builds alike
+    std::string long_key(KeySpan::max_length + 1, 'x');
+    bool thrown = false;
+    try {
+      hash_table.insert(KeySpan(long_key), 2);
+    } catch (const std::length_error &) {
+      thrown = true;
+    }
+    assert(thrown && hash_table.size() == 1 && !hash_table.find(KeySpan(long_key), value));
+    long_key.pop_back();
+    assert(hash_table.insert(KeySpan(long_key), 2));
+    assert(hash_table.find(KeySpan(long_key), value) && value == 2);
+    long_key.push_back('x');
+    KeySpan keys[] = {KeySpan("a"), KeySpan(long_key)};
+    uint32_t values[] = {3, 4};
+    thrown = false;
+    try {
+      hash_table.build(keys, values, 2);
+    } catch (const std::length_error &) {
+      thrown = true;
+    }
+    assert(thrown && hash_table.size() == 2);
+
     printf("[PASSED]\n");
   }
 
 	static void TestDleftFalsePositives() {
-	 #ifdef __COUNT_FALSE_POSITIVES__
 	 	const int testcase_size = 1000000;
-    DleftType hash_table(testcase_size);
+    StatsDleftType<> hash_table(testcase_size);
 
 		for (int i = 0; i < testcase_size; i++) {
 			hash_table.insert(i, i);
 		}
 
-		false_positive = 0;
+		uint64_t false_positives = hash_table.stats().false_positives;
 		for (int i = 0; i < testcase_size; i++) {
 			uint32_t value;
 			hash_table.find(i, value);
 		}
-		printf("Positive Read: %ld false positives\n", false_positive);
+		printf("Positive Read: %ld false positives\n", hash_table.stats().false_positives - false_positives);
 
-		false_positive = 0;
+		false_positives = hash_table.stats().false_positives;
 		for (int i = testcase_size; i < testcase_size * 2; i++) {
 			uint32_t value;
 			hash_table.find(i, value);
 		}
-		printf("Negative Read: %ld false positives\n", false_positive);
-	 #endif
+		printf("Negative Read: %ld false positives\n", hash_table.stats().false_positives - false_positives);
 	}
 
 	static void TestDleftMaxLoadFactor() {
-    DleftType hash_table(1000000);
+    StatsDleftType<> hash_table(1000000);
     size_t bucket_total{0}, stash_bucket_total{0};
 
-	 #ifdef __COUNT_OVERFLOWS__
-	 	minor_overflows = major_overflows = 0;
-	 #endif
-
     uint32_t key = 0;
     while (hash_table.Append(std::forward<uint32_t>(key), std::forward<uint32_t>(key), Hasher1()(key), Hasher2()(key))) {
       key++;
@@ -1642,10 +6979,8 @@ class DleftTest {
            1.0 * bucket_total / hash_table.BucketCapacity(),
            1.0 * stash_bucket_total / hash_table.StashBucketCapacity());
 
-	 #ifdef __COUNT_OVERFLOWS__
-		printf("# of Minor Overflows: %ld\n", minor_overflows);
-		printf("# of Major Overflows: %ld\n", major_overflows);
-	 #endif
+		printf("# of Minor Overflows: %ld\n", hash_table.stats().minor_overflows);
+		printf("# of Major Overflows: %ld\n", hash_table.stats().major_overflows);
 	}
 };
 #endif
@@ -1653,6 +6988,7 @@ class DleftTest {
 #undef __DEBUG_DLEFT__
 #undef DEBUG_DLEFT
 #undef DLEFT_TYPE
+#undef PREFETCH
 #undef UNLIKELY
 #undef LIKELY
 #undef FINGERPRINT16
@@ -1662,5 +6998,4 @@ class DleftTest {
 #undef CLEAR_BIT
 #undef ROUNDUP_POWER_2
 #undef BYTE_ROUND_UP
-#undef BUCKET_STASH_BUCKET_RATIO
 #undef CACHELINE_SIZE
@@ -17,11 +17,41 @@
 # include <limits>
 # include <chrono>
 # include <type_traits>
+# include <thread>
+# include <algorithm>
+
+// Runs the performance test on every d-left variant (buffered, partial-key, SoA, ...), not only the default one
+// #define __TEST_MAP_VARIANTS__
+
+// Compares the latency of buffered and unbuffered d-left tables when keys are read right after insertion
+// #define __TEST_WRITE_BUFFER__
+
+// Measures how the read and write throughput of concurrent tables scale with the number of threads
+// #define __TEST_CONCURRENCY__
+
+// Compares the insertion tail latency of stop-the-world and incremental resizing, starting from an empty table
+// #define __TEST_TAIL_LATENCY__
+
+// Measures how fast parallel_for_each walks a full table with 1, 2, 4, ... threads
+// #define __TEST_ITERATION__
+
+// Compares loading a table with build() and with one insert() per key, starting from an empty table
+// #define __TEST_BULK_BUILD__
+
+// Measures how long doubling a full table takes when its keys are rehashed with 1, 2, 4, ... threads
+// #define __TEST_PARALLEL_RESIZE__
+
+// Compares tables keyed by variable-length DNS names, d-left (see `KeySpan`) against std::unordered_map<std::string, V>
+// #define __TEST_STRING_KEYS__
+
+// Compares 200-byte values stored in buckets, in buckets that keep keys apart from values
+// (see `DleftPolicy::soa_buckets`) and in a slab behind 32-bit handles (see `DleftPolicy::slab_values`)
+// #define __TEST_LARGE_VALUES__
 
 template<class K, class V, class Hasher>
 class std_unordered_map_wrapper {
  public:
-  auto insert(K &&key, V &&value) -> bool { return map.insert({key, value}).second; }
+  auto insert(const K &key, const V &value) -> bool { return map.emplace(key, value).second; }
 
   auto erase(const K &key) -> bool { return map.erase(key) > 0; }
 
@@ -43,6 +73,30 @@ class std_unordered_map_wrapper {
   std::unordered_map<K, V, Hasher> map;
 };
 
+// Keyed by `KeySpan` like a variable-length-key d-left table, but stores the keys as std::string
+template<class V>
+class std_string_map_wrapper {
+ public:
+  auto insert(KeySpan &&key, V &&value) -> bool { return map.emplace(std::string(key.data(), key.size()), value).second; }
+
+  auto find(const KeySpan &key, V &value) const -> bool {
+    probe.assign(key.data(), key.size());  // Reused, so that lookups do not allocate
+    auto itr = map.find(probe);
+    if (itr == map.end()) {
+      return false;
+    }
+    value = itr->second;
+    return true;
+  }
+
+  void reserve(size_t size) { map.reserve(size); }
+
+  void clear() { map.clear(); }
+ private:
+  std::unordered_map<std::string, V> map;
+  mutable std::string probe;
+};
+
 class HashTableTest {
  private:
   static constexpr uint32_t seed1 = 0x5d445e6e;
@@ -73,10 +127,55 @@ class HashTableTest {
   using std_unordered_map = std_unordered_map_wrapper<uint32_t, uint32_t, Hasher64>;
   using cuckoo_map = libcuckoo::cuckoohash_map<uint32_t, uint32_t, Hasher64>;
   using dleft_map = DleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2>;
+  using dleft_buffered_map = BufferedDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2>;
+  using dleft_concurrent_map = ConcurrentDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2>;
+  using dleft_incremental_map = IncrementalDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2>;
+  using dleft_partial_key_map = PartialKeyDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2>;
+  using dleft_soa_map =
+      PolicyDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2, DleftPolicy<16, 4, 255, 1024, false, true>>;
+  using dleft_compare_key_map =
+      PolicyDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2, DleftPolicy<16, 4, 255, 1024, false, true, true>>;
+  using dleft_one_cacheline_map = PolicyDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2, OneCachelineDleftPolicy>;
+  using dleft_two_cacheline_map = PolicyDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2, TwoCachelineDleftPolicy>;
+  using dleft_3_choice_map = PolicyDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2,
+                                                DleftPolicy<16, 4, 255, 1024, false, false, false, false, 3>>;
+  using dleft_4_choice_map = PolicyDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2,
+                                                DleftPolicy<16, 4, 255, 1024, false, false, false, false, 4>>;
+  using dleft_displacement_map = PolicyDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2,
+                                                    DleftPolicy<16, 4, 255, 1024, false, false, false, false, 2, 4>>;
+  using dleft_sharded_map = ShardedDleft<uint32_t, uint32_t, Hasher1, Hasher2>;
+  using std_string_map = std_string_map_wrapper<uint32_t>;
+  using dleft_string_map = DleftFpStash<KeySpan, uint32_t, KeySpanHasher<seed1>, KeySpanHasher<seed2>>;
+
+  struct LargeValue {
+    uint32_t data[50];
+  };
+  using dleft_inline_value_map = DleftFpStash<uint32_t, LargeValue, Hasher1, Hasher2>;
+  using dleft_slab_value_map =
+      PolicyDleftFpStash<uint32_t, LargeValue, Hasher1, Hasher2, DleftPolicy<16, 4, 255, 1024, true>>;
+  using dleft_soa_value_map =
+      PolicyDleftFpStash<uint32_t, LargeValue, Hasher1, Hasher2, DleftPolicy<16, 4, 255, 1024, false, true>>;
 
   static constexpr char std_unordered_map_name[] = "std_unordered_map";
   static constexpr char cuckoo_map_name[] = "cuckoohash_map";
   static constexpr char dleft_map_name[] = "dleft_map";
+  static constexpr char dleft_buffered_map_name[] = "dleft_buffered_map";
+  static constexpr char dleft_concurrent_map_name[] = "dleft_concurrent_map";
+  static constexpr char dleft_incremental_map_name[] = "dleft_incremental_map";
+  static constexpr char dleft_partial_key_map_name[] = "dleft_partial_key_map";
+  static constexpr char dleft_soa_map_name[] = "dleft_soa_map";
+  static constexpr char dleft_compare_key_map_name[] = "dleft_compare_key_map";
+  static constexpr char dleft_one_cacheline_map_name[] = "dleft_one_cacheline_map";
+  static constexpr char dleft_two_cacheline_map_name[] = "dleft_two_cacheline_map";
+  static constexpr char dleft_3_choice_map_name[] = "dleft_3_choice_map";
+  static constexpr char dleft_4_choice_map_name[] = "dleft_4_choice_map";
+  static constexpr char dleft_displacement_map_name[] = "dleft_displacement_map";
+  static constexpr char dleft_sharded_map_name[] = "dleft_sharded_map";
+  static constexpr char std_string_map_name[] = "std_string_map";
+  static constexpr char dleft_string_map_name[] = "dleft_string_map";
+  static constexpr char dleft_inline_value_map_name[] = "dleft_inline_value_map";
+  static constexpr char dleft_slab_value_map_name[] = "dleft_slab_value_map";
+  static constexpr char dleft_soa_value_map_name[] = "dleft_soa_value_map";
 
  public:
   static void RunAllTests() {
@@ -84,6 +183,60 @@ class HashTableTest {
     TestPerformance<std_unordered_map, std_unordered_map_name>();
     TestPerformance<cuckoo_map, cuckoo_map_name>();
     TestPerformance<dleft_map, dleft_map_name>();
+
+   #ifdef __TEST_MAP_VARIANTS__
+    TestPerformance<dleft_buffered_map, dleft_buffered_map_name>();
+    TestPerformance<dleft_partial_key_map, dleft_partial_key_map_name>();
+    TestPerformance<dleft_soa_map, dleft_soa_map_name>();
+    TestPerformance<dleft_compare_key_map, dleft_compare_key_map_name>();
+    TestPerformance<dleft_one_cacheline_map, dleft_one_cacheline_map_name>();
+    TestPerformance<dleft_two_cacheline_map, dleft_two_cacheline_map_name>();
+    TestPerformance<dleft_3_choice_map, dleft_3_choice_map_name>();
+    TestPerformance<dleft_4_choice_map, dleft_4_choice_map_name>();
+    TestPerformance<dleft_displacement_map, dleft_displacement_map_name>();
+   #endif
+
+   #ifdef __TEST_WRITE_BUFFER__
+    TestWriteBuffer<dleft_map, dleft_map_name>();
+    TestWriteBuffer<dleft_buffered_map, dleft_buffered_map_name>();
+   #endif
+
+   #ifdef __TEST_CONCURRENCY__
+    TestReadScalability<cuckoo_map, cuckoo_map_name>();
+    TestReadScalability<dleft_concurrent_map, dleft_concurrent_map_name>();
+    TestReadScalability<dleft_sharded_map, dleft_sharded_map_name>();
+    TestWriteScalability<cuckoo_map, cuckoo_map_name>();
+    TestWriteScalability<dleft_concurrent_map, dleft_concurrent_map_name>();
+    TestWriteScalability<dleft_sharded_map, dleft_sharded_map_name>();
+   #endif
+
+   #ifdef __TEST_TAIL_LATENCY__
+    TestTailLatency<dleft_map, dleft_map_name>();
+    TestTailLatency<dleft_incremental_map, dleft_incremental_map_name>();
+   #endif
+
+   #ifdef __TEST_ITERATION__
+    TestIteration<dleft_map, dleft_map_name>();
+   #endif
+
+   #ifdef __TEST_BULK_BUILD__
+    TestBulkBuild<dleft_map, dleft_map_name>();
+   #endif
+
+   #ifdef __TEST_PARALLEL_RESIZE__
+    TestParallelResize<dleft_map, dleft_map_name>();
+   #endif
+
+   #ifdef __TEST_STRING_KEYS__
+    TestStringKeys<std_string_map, std_string_map_name>();
+    TestStringKeys<dleft_string_map, dleft_string_map_name>();
+   #endif
+
+   #ifdef __TEST_LARGE_VALUES__
+    TestLargeValues<dleft_inline_value_map, dleft_inline_value_map_name>();
+    TestLargeValues<dleft_slab_value_map, dleft_slab_value_map_name>();
+    TestLargeValues<dleft_soa_value_map, dleft_soa_value_map_name>();
+   #endif
   }
 
  private:
@@ -115,14 +268,354 @@ class HashTableTest {
     }
   }
 
+  // Inserts each key and looks up the key inserted `recent_lag` insertions earlier, as when a flow is set up
+  // and its next packet arrives shortly after; the lag keeps the lookup from simply hitting the insert's cachelines
+  template<class map_type, const char *name>
+  static void TestWriteBuffer() {
+    const int recent_lag = 1024;
+
+    printf("[WRITE BUFFER TEST]\nTesting %s\n", name);
+
+    std::vector<uint32_t> keys;
+    std::unordered_set<uint32_t> key_set;
+    GetDataset(keys, key_set);
+
+    map_type map;
+    map.clear();
+    map.reserve(keys.size());
+
+    std::string filename = std::string("data/") + name + "_write_buffer.csv";
+    FILE *file = fopen(filename.c_str(), "w");
+    fprintf(file, "Load Factor, Write Latency(ns), Recent Read Latency(ns), Postive Read Latency(ns)\n");
+
+    int num_batches = 16;
+    int batch_size = keys.size() / num_batches;
+    for (int i = 0; i < num_batches; i++) {
+      size_t write_ns = 0, recent_read_ns = 0;
+      for (int j = i * batch_size; j < (i + 1) * batch_size; j++) {
+        uint32_t result;
+        auto start = std::chrono::high_resolution_clock::now();
+        map.insert(keys[j], keys[j]);
+        auto end = std::chrono::high_resolution_clock::now();
+        write_ns += (end - start).count();
+
+        start = std::chrono::high_resolution_clock::now();
+        map.find(keys[j >= recent_lag ? j - recent_lag : j], result);
+        end = std::chrono::high_resolution_clock::now();
+        recent_read_ns += (end - start).count();
+      }
+      double positive_read_latency = TestReadPositiveLatency(map, keys, 0, (i + 1) * batch_size);
+      double load_factor = TestLoadFactor(map);
+      fprintf(file, "%lf,%lf,%lf,%lf\n", load_factor, 1.0 * write_ns / batch_size,
+              1.0 * recent_read_ns / batch_size, positive_read_latency);
+    }
+    fclose(file);
+  }
+
+  // Fills the table, then lets 1, 2, 4, ... reader threads look up disjoint slices of the keys at the same time
+  template<class map_type, const char *name>
+  static void TestReadScalability() {
+    const int max_threads = 64, num_rounds = 4;
+
+    printf("[READ SCALABILITY TEST]\nTesting %s\n", name);
+
+    std::vector<uint32_t> keys;
+    std::unordered_set<uint32_t> key_set;
+    GetDataset(keys, key_set);
+
+    map_type map;
+    map.clear();
+    map.reserve(keys.size());
+    for (auto key : keys) {
+      map.insert(key, key);
+    }
+
+    std::string filename = std::string("data/") + name + "_scalability.csv";
+    FILE *file = fopen(filename.c_str(), "w");
+    fprintf(file, "Threads, Read Throughput(Mops)\n");
+
+    for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+      std::vector<std::thread> threads;
+      size_t slice_size = keys.size() / num_threads;
+      const auto start = std::chrono::high_resolution_clock::now();
+      for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&map, &keys, slice_size, t]() {
+          for (int round = 0; round < num_rounds; round++) {
+            for (size_t i = t * slice_size; i < (t + 1) * slice_size; i++) {
+              uint32_t value;
+              map.find(keys[i], value);
+            }
+          }
+        });
+      }
+      for (auto &thread : threads) {
+        thread.join();
+      }
+      const auto end = std::chrono::high_resolution_clock::now();
+      double total_ops = 1.0 * slice_size * num_threads * num_rounds;
+      fprintf(file, "%d,%lf\n", num_threads, total_ops * 1e3 / (end - start).count());
+    }
+    fclose(file);
+  }
+
+  // Lets 1, 2, 4, ... writer threads insert disjoint slices of the keys into an empty table at the same time,
+  // without reserving space first, so that the table resizes along the way
+  template<class map_type, const char *name>
+  static void TestWriteScalability() {
+    const int max_threads = 64;
+
+    printf("[WRITE SCALABILITY TEST]\nTesting %s\n", name);
+
+    std::vector<uint32_t> keys;
+    std::unordered_set<uint32_t> key_set;
+    GetDataset(keys, key_set);
+
+    std::string filename = std::string("data/") + name + "_write_scalability.csv";
+    FILE *file = fopen(filename.c_str(), "w");
+    fprintf(file, "Threads, Write Throughput(Mops)\n");
+
+    for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+      map_type map;
+      std::vector<std::thread> threads;
+      size_t slice_size = keys.size() / num_threads;
+      const auto start = std::chrono::high_resolution_clock::now();
+      for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&map, &keys, slice_size, t]() {
+          for (size_t i = t * slice_size; i < (t + 1) * slice_size; i++) {
+            map.insert(keys[i], keys[i]);
+          }
+        });
+      }
+      for (auto &thread : threads) {
+        thread.join();
+      }
+      const auto end = std::chrono::high_resolution_clock::now();
+      fprintf(file, "%d,%lf\n", num_threads, 1.0 * slice_size * num_threads * 1e3 / (end - start).count());
+    }
+    fclose(file);
+  }
+
+  // Inserts every key without reserving space first, so that the table resizes along the way
+  template<class map_type, const char *name>
+  static void TestTailLatency() {
+    const double percentiles[] = {50, 99, 99.9, 99.99, 100};
+
+    printf("[TAIL LATENCY TEST]\nTesting %s\n", name);
+
+    std::vector<uint32_t> keys;
+    std::unordered_set<uint32_t> key_set;
+    GetDataset(keys, key_set);
+
+    map_type map;
+    std::vector<size_t> latencies;
+    for (auto key : keys) {
+      const auto start = std::chrono::high_resolution_clock::now();
+      map.insert(key, key);
+      const auto end = std::chrono::high_resolution_clock::now();
+      latencies.emplace_back((end - start).count());
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    std::string filename = std::string("data/") + name + "_tail_latency.csv";
+    FILE *file = fopen(filename.c_str(), "w");
+    fprintf(file, "Percentile, Write Latency(ns)\n");
+    for (auto percentile : percentiles) {
+      size_t idx = std::min(latencies.size() - 1, static_cast<size_t>(percentile / 100 * latencies.size()));
+      fprintf(file, "%lf,%lu\n", percentile, latencies[idx]);
+    }
+    fclose(file);
+  }
+
+  template<class map_type, const char *name>
+  static void TestIteration() {
+    const int max_threads = 64, num_rounds = 4;
+
+    printf("[ITERATION TEST]\nTesting %s\n", name);
+
+    std::vector<uint32_t> keys;
+    std::unordered_set<uint32_t> key_set;
+    GetDataset(keys, key_set);
+
+    map_type map;
+    map.clear();
+    map.reserve(keys.size());
+    for (auto key : keys) {
+      map.insert(key, key);
+    }
+
+    std::string filename = std::string("data/") + name + "_iteration.csv";
+    FILE *file = fopen(filename.c_str(), "w");
+    fprintf(file, "Threads, Latency(ns per key), Bandwidth(GB/s)\n");
+
+    int hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int num_threads = 1; num_threads <= std::min(max_threads, hardware_threads); num_threads *= 2) {
+      const auto start = std::chrono::high_resolution_clock::now();
+      for (int round = 0; round < num_rounds; round++) {
+        map.parallel_for_each([](const uint32_t &key, uint32_t &value) {
+          thread_local uint64_t checksum;  // Keeps the walk from being optimized away
+          checksum += key ^ value;
+        }, num_threads);
+      }
+      const auto end = std::chrono::high_resolution_clock::now();
+      double ns = 1.0 * (end - start).count() / num_rounds;
+      fprintf(file, "%d,%lf,%lf\n", num_threads, ns / map.size(), map.memory_usage() / ns);
+    }
+    fclose(file);
+  }
+
+  template<class map_type, const char *name>
+  static void TestBulkBuild() {
+    printf("[BULK BUILD TEST]\nTesting %s\n", name);
+
+    std::vector<uint32_t> keys;
+    std::unordered_set<uint32_t> key_set;
+    GetDataset(keys, key_set);
+
+    std::string filename = std::string("data/") + name + "_bulk_build.csv";
+    FILE *file = fopen(filename.c_str(), "w");
+    fprintf(file, "Threads, Load Time(ms)\n");
+
+    {
+      map_type map;
+      const auto start = std::chrono::high_resolution_clock::now();
+      for (auto key : keys) {
+        map.insert(key, key);
+      }
+      const auto end = std::chrono::high_resolution_clock::now();
+      fprintf(file, "insert,%lf\n", (end - start).count() / 1e6);
+    }
+
+    int hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int num_threads = 1; num_threads <= hardware_threads; num_threads *= 2) {
+      map_type map;
+      const auto start = std::chrono::high_resolution_clock::now();
+      map.build(keys.data(), keys.data(), keys.size(), num_threads);
+      const auto end = std::chrono::high_resolution_clock::now();
+      fprintf(file, "%d,%lf\n", num_threads, (end - start).count() / 1e6);
+    }
+    fclose(file);
+  }
+
+  template<class map_type, const char *name>
+  static void TestParallelResize() {
+    printf("[PARALLEL RESIZE TEST]\nTesting %s\n", name);
+
+    std::vector<uint32_t> keys;
+    std::unordered_set<uint32_t> key_set;
+    GetDataset(keys, key_set);
+
+    std::string filename = std::string("data/") + name + "_parallel_resize.csv";
+    FILE *file = fopen(filename.c_str(), "w");
+    fprintf(file, "Threads, Resize Time(ms)\n");
+
+    int hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int num_threads = 1; num_threads <= hardware_threads; num_threads *= 2) {
+      map_type map;
+      map.build(keys.data(), keys.data(), keys.size());
+      map.set_resize_threads(num_threads);
+      const auto start = std::chrono::high_resolution_clock::now();
+      map.reserve(map.capacity() * 2);
+      const auto end = std::chrono::high_resolution_clock::now();
+      fprintf(file, "%d,%lf\n", num_threads, (end - start).count() / 1e6);
+    }
+    fclose(file);
+  }
+
+  // Inserts host names, then looks up every one of them, and as many names that were not inserted
+  template<class map_type, const char *name>
+  static void TestStringKeys() {
+    printf("[STRING KEYS TEST]\nTesting %s\n", name);
+
+    std::vector<std::string> keys, absent_keys;
+    GetStringDataset(keys, absent_keys);
+
+    map_type map;
+    map.clear();
+    map.reserve(keys.size());
+
+    size_t write_ns = 0, positive_read_ns = 0, negative_read_ns = 0;
+    uint32_t value = 0;
+    for (const auto &key : keys) {
+      const auto start = std::chrono::high_resolution_clock::now();
+      map.insert(KeySpan(key), std::move(value));
+      const auto end = std::chrono::high_resolution_clock::now();
+      write_ns += (end - start).count();
+      value++;
+    }
+    for (const auto &key : keys) {
+      const auto start = std::chrono::high_resolution_clock::now();
+      map.find(KeySpan(key), value);
+      const auto end = std::chrono::high_resolution_clock::now();
+      positive_read_ns += (end - start).count();
+    }
+    for (const auto &key : absent_keys) {
+      const auto start = std::chrono::high_resolution_clock::now();
+      map.find(KeySpan(key), value);
+      const auto end = std::chrono::high_resolution_clock::now();
+      negative_read_ns += (end - start).count();
+    }
+
+    std::string filename = std::string("data/") + name + "_string_keys.csv";
+    FILE *file = fopen(filename.c_str(), "w");
+    fprintf(file, "Write Latency(ns), Postive Read Latency(ns), Negative Read Latency(ns)\n");
+    fprintf(file, "%lf,%lf,%lf\n", 1.0 * write_ns / keys.size(), 1.0 * positive_read_ns / keys.size(),
+            1.0 * negative_read_ns / absent_keys.size());
+    fclose(file);
+  }
+
+  // Grows a table of large values from empty, then looks up every key, and as many keys that were not inserted
+  template<class map_type, const char *name>
+  static void TestLargeValues() {
+    printf("[LARGE VALUES TEST]\nTesting %s\n", name);
+
+    std::vector<uint32_t> keys;
+    std::unordered_set<uint32_t> key_set;
+    GetDataset(keys, key_set);
+
+    map_type map;
+    size_t write_ns = 0, positive_read_ns = 0, negative_read_ns = 0;
+    LargeValue value{};
+    for (auto key : keys) {
+      value.data[0] = key;
+      const auto start = std::chrono::high_resolution_clock::now();
+      map.insert(key, value);
+      const auto end = std::chrono::high_resolution_clock::now();
+      write_ns += (end - start).count();
+    }
+    for (auto key : keys) {
+      const auto start = std::chrono::high_resolution_clock::now();
+      map.find(key, value);
+      const auto end = std::chrono::high_resolution_clock::now();
+      positive_read_ns += (end - start).count();
+    }
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_int_distribution<uint32_t> dist;
+    for (size_t i = 0; i < keys.size(); i++) {
+      uint32_t key;
+      while (key_set.count(key = dist(gen)));
+      const auto start = std::chrono::high_resolution_clock::now();
+      map.find(key, value);
+      const auto end = std::chrono::high_resolution_clock::now();
+      negative_read_ns += (end - start).count();
+    }
+
+    std::string filename = std::string("data/") + name + "_large_values.csv";
+    FILE *file = fopen(filename.c_str(), "w");
+    fprintf(file, "Write Latency(ns), Postive Read Latency(ns), Negative Read Latency(ns), Bytes per Key\n");
+    fprintf(file, "%lf,%lf,%lf,%lf\n", 1.0 * write_ns / keys.size(), 1.0 * positive_read_ns / keys.size(),
+            1.0 * negative_read_ns / keys.size(), 1.0 * map.memory_usage() / map.size());
+    fclose(file);
+  }
+
   template<class map_type>
   static auto TestWriteLatency(map_type &map, const std::vector<uint32_t> &dataset,
                                int begin, int end) -> double {
     size_t total_ns = 0;
     for (int i = begin; i < end; i++) {
-      auto key = dataset[i], value = dataset[i];
       const auto start = std::chrono::high_resolution_clock::now();
-      map.insert(std::forward<uint32_t>(key), std::forward<uint32_t>(value));
+      map.insert(dataset[i], dataset[i]);
       const auto end = std::chrono::high_resolution_clock::now();
       total_ns += (end - start).count();
     }
@@ -182,6 +675,28 @@ class HashTableTest {
       keys.emplace_back(key);
     }
   }
+
+  // Random host names such as "www.k3x9q.example.net", half of which are not inserted
+  static void GetStringDataset(std::vector<std::string> &keys, std::vector<std::string> &absent_keys) {
+    const size_t size = 1000000;
+    const char *prefixes[] = {"", "www.", "mail.", "cdn.", "api."};
+    const char *suffixes[] = {".com", ".net", ".org", ".example.com", ".co.uk"};
+    const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::unordered_set<std::string> key_set;
+    while (key_set.size() < size * 2) {
+      std::string key = prefixes[gen() % 5];
+      for (size_t i = 0, length = 3 + gen() % 20; i < length; i++) {
+        key += alphabet[gen() % (sizeof(alphabet) - 1)];
+      }
+      key += suffixes[gen() % 5];
+      if (key_set.insert(key).second) {
+        (key_set.size() % 2 == 0 ? keys : absent_keys).emplace_back(std::move(key));
+      }
+    }
+  }
 };
 
 int main() {
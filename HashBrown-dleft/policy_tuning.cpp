@@ -0,0 +1,220 @@
+// Sweeps `DleftPolicy` geometries over several key distributions, and reports, for each distribution, the
+// policies on the Pareto frontier of lookup latency against bytes per key (those that no other policy beats
+// on both at once). Results go to data/policy_tuning_<distribution>.csv, and the frontier to stdout.
+#include "dleft_fp_stash.hpp"
+#include "xxhash.h"
+#include <stdint.h>
+
+#include <string>
+
+# include <unordered_set>
+# include <vector>
+
+# include <random>
+# include <chrono>
+# include <algorithm>
+# include <limits>
+
+class PolicyTuning {
+ private:
+  static constexpr uint32_t seed1 = 0x5d445e6e;
+  static constexpr uint32_t seed2 = 0xf09ad611;
+
+  template<class K, uint64_t seed>
+  class Hasher {
+  public:
+    auto operator()(const K &key) const -> uint32_t {
+      return XXH32(&key, sizeof(K), seed);
+    }
+  };
+
+  using Hasher1 = Hasher<uint32_t, seed1>;
+  using Hasher2 = Hasher<uint32_t, seed2>;
+
+  template<class Policy>
+  using int_map = PolicyDleftFpStash<uint32_t, uint32_t, Hasher1, Hasher2, Policy>;
+  template<class Policy>
+  using string_map = PolicyDleftFpStash<KeySpan, uint32_t, KeySpanHasher<seed1>, KeySpanHasher<seed2>, Policy>;
+
+  // The default geometry, then smaller buckets, fewer minor overflows, smaller and fewer stash buckets, buckets
+  // aligned to cachelines (padded to three of them, and filling one or two exactly), more choices per key, and last
+  // longer chains of moves before growing
+  template<class... Policies>
+  struct PolicyList {};
+
+  using policies = PolicyList<
+      DleftPolicy<>,
+      DleftPolicy<16, 4, 255, 256>,
+      DleftPolicy<16, 4, 255, 4096>,
+      DleftPolicy<16, 4, 128, 512>,
+      DleftPolicy<16, 2, 64, 256>,
+      DleftPolicy<12, 4, 255, 1024>,
+      DleftPolicy<12, 3, 128, 256>,
+      DleftPolicy<8, 4, 255, 256>,
+      DleftPolicy<8, 2, 64, 64>,
+      DleftPolicy<4, 1, 32, 16>,
+      DleftPolicy<16, 4, 255, 1024, false, false, false, true>,
+      OneCachelineDleftPolicy,
+      TwoCachelineDleftPolicy,
+      DleftPolicy<16, 4, 255, 1024, false, false, false, false, 3>,
+      DleftPolicy<8, 2, 64, 256, false, false, false, false, 3>,
+      DleftPolicy<4, 4, 255, 64, false, false, false, true, 4>,
+      DleftPolicy<16, 4, 255, 1024, false, false, false, false, 2, 4>,
+      DleftPolicy<8, 2, 64, 256, false, false, false, false, 2, 4>>;
+
+  struct Result {
+    std::string policy;
+    double bytes_per_key;
+    double positive_read_ns;
+    double negative_read_ns;
+
+    auto read_ns() const -> double { return (positive_read_ns + negative_read_ns) / 2; }
+  };
+
+ public:
+  static void RunAllTests() {
+    const size_t size = 1000000;
+    std::vector<uint32_t> keys, absent_keys;
+    std::vector<std::string> string_keys, absent_string_keys;
+
+    GetUniformDataset(keys, absent_keys, size);
+    Report("uniform", Sweep<int_map>(keys, absent_keys, policies()));
+
+    keys.clear();
+    absent_keys.clear();
+    GetSequentialDataset(keys, absent_keys, size);
+    Report("sequential", Sweep<int_map>(keys, absent_keys, policies()));
+
+    GetStringDataset(string_keys, absent_string_keys, size);
+    Report("dns", Sweep<string_map>(string_keys, absent_string_keys, policies()));
+  }
+
+ private:
+  template<template<class> class map_type, class K, class... Policies>
+  static auto Sweep(const std::vector<K> &keys, const std::vector<K> &absent_keys, PolicyList<Policies...>)
+      -> std::vector<Result> {
+    return {TestPolicy<map_type<Policies>, Policies>(keys, absent_keys)...};
+  }
+
+  // Grows a table from empty, as a table would in use, so that bytes per key include the slack left by resizing
+  template<class map_type, class Policy, class K>
+  static auto TestPolicy(const std::vector<K> &keys, const std::vector<K> &absent_keys) -> Result {
+    map_type map;
+    uint32_t value = 0;
+    for (const auto &key : keys) {
+      map.insert(MakeKey(key), std::move(value));
+      value++;
+    }
+
+    Result result;
+    result.policy = "b" + std::to_string(Policy::bucket_capacity) + "_m" + std::to_string(Policy::max_minor_overflows) +
+                    "_s" + std::to_string(Policy::stash_bucket_capacity) + "_r" + std::to_string(Policy::stash_ratio) +
+                    (Policy::aligned_buckets ? "_aligned" : "") +
+                    (Policy::num_choices != 2 ? "_d" + std::to_string(Policy::num_choices) : "") +
+                    (Policy::max_moves != 1 ? "_k" + std::to_string(Policy::max_moves) : "");
+    result.bytes_per_key = 1.0 * map.memory_usage() / map.size();
+    result.positive_read_ns = TestReadLatency(map, keys);
+    result.negative_read_ns = TestReadLatency(map, absent_keys);
+    printf("%s: %lf bytes/key, %lf ns/read\n", result.policy.c_str(), result.bytes_per_key, result.read_ns());
+    return result;
+  }
+
+  template<class map_type, class K>
+  static auto TestReadLatency(const map_type &map, const std::vector<K> &keys) -> double {
+    uint32_t value, found = 0;
+    const auto start = std::chrono::high_resolution_clock::now();
+    for (const auto &key : keys) {
+      found += map.find(MakeKey(key), value);
+    }
+    const auto end = std::chrono::high_resolution_clock::now();
+    asm volatile("" : : "r"(found));  // Keeps the lookups from being optimized away
+    return 1.0 * (end - start).count() / keys.size();
+  }
+
+  static auto MakeKey(uint32_t key) -> uint32_t { return key; }
+
+  static auto MakeKey(const std::string &key) -> KeySpan { return KeySpan(key); }
+
+  // Writes every result, then prints the frontier, from the smallest to the fastest policy
+  static void Report(const char *distribution, std::vector<Result> results) {
+    std::sort(results.begin(), results.end(), [](const Result &a, const Result &b) {
+      return a.bytes_per_key < b.bytes_per_key ||
+             (a.bytes_per_key == b.bytes_per_key && a.read_ns() < b.read_ns());
+    });
+
+    std::string filename = std::string("data/policy_tuning_") + distribution + ".csv";
+    FILE *file = fopen(filename.c_str(), "w");
+    if (file == nullptr) {  // Still prints the frontier
+      fprintf(stderr, "Cannot open %s\n", filename.c_str());
+    } else {
+      fprintf(file, "Policy, Bytes per Key, Postive Read Latency(ns), Negative Read Latency(ns), Pareto Optimal\n");
+    }
+
+    printf("[PARETO FRONTIER] %s\n", distribution);
+    double best_read_ns = std::numeric_limits<double>::infinity();
+    for (const auto &result : results) {
+      bool optimal = result.read_ns() < best_read_ns;  // Nothing smaller is at least as fast
+      if (optimal) {
+        best_read_ns = result.read_ns();
+        printf("%s: %lf bytes/key, %lf ns/read\n", result.policy.c_str(), result.bytes_per_key, result.read_ns());
+      }
+      if (file != nullptr) {
+        fprintf(file, "%s,%lf,%lf,%lf,%d\n", result.policy.c_str(), result.bytes_per_key, result.positive_read_ns,
+                result.negative_read_ns, optimal);
+      }
+    }
+    if (file != nullptr) {
+      fclose(file);
+    }
+  }
+
+  static void GetUniformDataset(std::vector<uint32_t> &keys, std::vector<uint32_t> &absent_keys, size_t size) {
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_int_distribution<uint32_t> dist;
+
+    std::unordered_set<uint32_t> key_set;
+    while (key_set.size() < size * 2) {
+      uint32_t key = dist(gen);
+      if (key_set.insert(key).second) {
+        (key_set.size() % 2 == 0 ? keys : absent_keys).emplace_back(key);
+      }
+    }
+  }
+
+  // Dense identifiers, as handed out by a counter; lookups come in random order
+  static void GetSequentialDataset(std::vector<uint32_t> &keys, std::vector<uint32_t> &absent_keys, size_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+      keys.emplace_back(i);
+      absent_keys.emplace_back(size + i);
+    }
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::shuffle(keys.begin(), keys.end(), gen);
+  }
+
+  // Random host names such as "www.k3x9q.example.net", half of which are not inserted
+  static void GetStringDataset(std::vector<std::string> &keys, std::vector<std::string> &absent_keys, size_t size) {
+    const char *prefixes[] = {"", "www.", "mail.", "cdn.", "api."};
+    const char *suffixes[] = {".com", ".net", ".org", ".example.com", ".co.uk"};
+    const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::unordered_set<std::string> key_set;
+    while (key_set.size() < size * 2) {
+      std::string key = prefixes[gen() % 5];
+      for (size_t i = 0, length = 3 + gen() % 20; i < length; i++) {
+        key += alphabet[gen() % (sizeof(alphabet) - 1)];
+      }
+      key += suffixes[gen() % 5];
+      if (key_set.insert(key).second) {
+        (key_set.size() % 2 == 0 ? keys : absent_keys).emplace_back(std::move(key));
+      }
+    }
+  }
+};
+
+int main() {
+  PolicyTuning::RunAllTests();
+}
@@ -1,4 +1,6 @@
 // Hash Brown
+#pragma once
+
 typedef unsigned long long hb_uint64_t;
 typedef unsigned int hb_uint32_t;
 typedef unsigned short hb_uint16_t;
@@ -81,8 +83,8 @@ HB_INLINE void hash_round(const void *data, hb_uint64_t& state0, hb_uint64_t& st
     Hashes small inputs. Length must be < 32 bytes.
 */
 HB_INLINE hb_uint64_t hashbrownsmall(hb_uint64_t seed, size_t length, void *data) {
-    hb_uint64_t a;
-    hb_uint64_t b;
+    hb_uint64_t a = 0;
+    hb_uint64_t b = 0;
 
     seed ^= P1;
 
@@ -192,7 +194,7 @@ HB_INLINE hb_uint64_t hashbrownbig(hb_uint64_t seed, size_t length, void *input)
 }
 
 // Main frontend function for hashing
-hb_uint64_t hashbrown(hb_uint64_t seed, size_t length, void* data) {
+HB_INLINE hb_uint64_t hashbrown(hb_uint64_t seed, size_t length, void* data) {
     if (length < 32) {
         return hashbrownsmall(seed, length, data);
     }